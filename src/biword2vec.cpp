@@ -21,6 +21,41 @@ void print_usage(int argc, char **argv) {
         "--weight_type freq|degree : set type of negative sampling weight, "
         "frequency v.s. vertex in-degree, default frequency\n"
         "--seed seed : set seed, default 1\n"
+        "--pin_cpu : pin worker threads to cpu cores\n"
+        "--chunk_size size : set number of edges a thread takes at once, default 10000\n"
+        "--batch size : set number of edges sharing negative samples, default 1\n"
+        "--prefetch distance : set number of batches prefetched ahead, default 0\n"
+        "--partitions n : train n x n bucket pairs of source/target ids, default 0\n"
+        "--partition_budget bytes : choose partitions so that the rows of one bucket "
+        "pair fit into bytes, e.g. 8M\n"
+        "--memory_budget bytes : train out of core within bytes of memory, "
+        "keeping edges and embeddings on disk next to the model, e.g. 4G\n"
+        "--workers n : train with n processes sharing the model in POSIX "
+        "shared memory, each with --threads threads, default 1\n"
+        "--checkpoint seconds : write a binary checkpoint next to the model "
+        "every seconds, default 0 (none)\n"
+        "--resume : continue from the checkpoint of an interrupted run\n"
+        "--init_model path : start from the embeddings of the model at path "
+        "(path.source/path.target, or a checkpoint), only new ids are random; "
+        "combine with a reduced --words\n"
+        "--binary : save the model as binary embedding files that distance "
+        "maps without parsing, default text\n"
+        "--npy : save each matrix as a .npy file with page aligned data, "
+        "e.g. model.source.npy, and its row names as model.source.vocab\n"
+        "--quantize int8|pq : save binary files of int8 rows with a scale per row, "
+        "or of product quantization codes with codebooks trained on the model\n"
+        "--pq_subspaces m : set number of product quantization subspaces, "
+        "default hidden / 4\n"
+        "--stream : train online on edges as they arrive, e.g. --input - for stdin "
+        "or a fifo; every block is trained iter times its size\n"
+        "--stream_block n : set number of edges per block of a stream, default 100000\n"
+        "--snapshot seconds : export the model of a stream every seconds, "
+        "default 0 (at the end only); every file is replaced whole, but "
+        ".source and .target are renamed one after the other, so a reader "
+        "between the two renames pairs a new source with the old target\n"
+        "--hot_rows n : replicate the n hottest target rows per thread, default 0\n"
+        "--hot_sources n : replicate the n hottest source rows per thread, default 0\n"
+        "--hot_sync updates : set updates between merges of hot rows, default 1000\n"
         "--help : print this help\n", argv[0]
     );
 }
@@ -42,12 +77,34 @@ int main(int argc, char**argv) {
         {"weight_neg_sampling", required_argument, nullptr, 'c'},
         {"weight_type", required_argument, nullptr, 'p'},
         {"seed", required_argument, nullptr, 's'},
+        {"pin_cpu", no_argument, nullptr, 'u'},
+        {"chunk_size", required_argument, nullptr, 'k'},
+        {"batch", required_argument, nullptr, 'b'},
+        {"prefetch", required_argument, nullptr, 'd'},
+        {"partitions", required_argument, nullptr, 'P'},
+        {"partition_budget", required_argument, nullptr, 'B'},
+        {"memory_budget", required_argument, nullptr, 'M'},
+        {"workers", required_argument, nullptr, 'W'},
+        {"checkpoint", required_argument, nullptr, 'C'},
+        {"resume", no_argument, nullptr, 'R'},
+        {"init_model", required_argument, nullptr, 'I'},
+        {"binary", no_argument, nullptr, 'N'},
+        {"npy", no_argument, nullptr, 'Y'},
+        {"quantize", required_argument, nullptr, 'Q'},
+        {"pq_subspaces", required_argument, nullptr, 'q'},
+        {"stream", no_argument, nullptr, 'S'},
+        {"stream_block", required_argument, nullptr, 'L'},
+        {"snapshot", required_argument, nullptr, 'T'},
+        {"hot_rows", required_argument, nullptr, 'r'},
+        {"hot_sources", required_argument, nullptr, 'o'},
+        {"hot_sync", required_argument, nullptr, 'y'},
         {"help", no_argument, nullptr, 'h'},
         {nullptr, 0, nullptr, 0}
     };
 
     std::string input_path;
     std::string model_path;
+    std::string init_model;
 
     size_t iteration = 1;
     double alpha = 0.05;
@@ -56,6 +113,25 @@ int main(int argc, char**argv) {
     size_t words_per_iter = 0;
     size_t threads = 1;
     unsigned seed = 1;
+    bool pin_cpu = false;
+    size_t chunk_size = DEF_TRAIN_CHUNK_SIZE;
+    size_t batch_size = 1;
+    size_t prefetch_distance = 0;
+    size_t partitions = 0;
+    size_t partition_budget = 0;
+    size_t memory_budget = 0;
+    size_t workers = 1;
+    size_t checkpoint_interval = 0;
+    bool resume = false;
+    ModelFormat format = FORMAT_TEXT;
+    EmbeddingEncoding encoding = ENCODING_FLOAT32;
+    size_t pq_subspaces = 0;
+    bool stream = false;
+    size_t stream_block = DEF_STREAM_BLOCK_SIZE;
+    size_t snapshot_interval = 0;
+    size_t hot_targets = 0;
+    size_t hot_sources = 0;
+    size_t hot_sync = DEF_HOT_SYNC_INTERVAL;
     double weight_neg_sampling = 0;
     LossType method = LOSS_LINE;
     WeightType type = WEIGHT_FREQ;
@@ -112,6 +188,77 @@ int main(int argc, char**argv) {
         case 's':
             seed = static_cast<unsigned>(atoi(optarg));
             break;
+        case 'u':
+            pin_cpu = true;
+            break;
+        case 'k':
+            chunk_size = static_cast<size_t>(atoi(optarg));
+            break;
+        case 'b':
+            batch_size = static_cast<size_t>(atoi(optarg));
+            break;
+        case 'd':
+            prefetch_distance = static_cast<size_t>(atoi(optarg));
+            break;
+        case 'P':
+            partitions = static_cast<size_t>(atoi(optarg));
+            break;
+        case 'B':
+            partition_budget = util_parse_size(optarg);
+            break;
+        case 'M':
+            memory_budget = util_parse_size(optarg);
+            break;
+        case 'W':
+            workers = static_cast<size_t>(atoi(optarg));
+            break;
+        case 'C':
+            checkpoint_interval = static_cast<size_t>(atoi(optarg));
+            break;
+        case 'R':
+            resume = true;
+            break;
+        case 'I':
+            init_model = optarg;
+            break;
+        case 'N':
+            format = FORMAT_BINARY;
+            break;
+        case 'Y':
+            format = FORMAT_NPY;
+            break;
+        case 'Q':
+            if (!strcmp(optarg, "int8")) {
+                encoding = ENCODING_INT8;
+            } else if (!strcmp(optarg, "pq")) {
+                encoding = ENCODING_PQ;
+            } else {
+                print_usage(argc, argv);
+                exit(-1);
+            }
+            format = FORMAT_BINARY;
+            break;
+        case 'q':
+            pq_subspaces = static_cast<size_t>(atoi(optarg));
+            break;
+        case 'S':
+            stream = true;
+            break;
+        case 'L':
+            stream_block = static_cast<size_t>(atoi(optarg));
+            break;
+        case 'T':
+            snapshot_interval = static_cast<size_t>(atoi(optarg));
+            break;
+        case 'r':
+            hot_targets = static_cast<size_t>(atoi(optarg));
+            break;
+        case 'o':
+            hot_sources = static_cast<size_t>(atoi(optarg));
+            break;
+        case 'y':
+            hot_sync = static_cast<size_t>(atoi(optarg));
+            break;
         case 'h':
         default:
             print_usage(argc, argv);
@@ -124,9 +271,31 @@ int main(int argc, char**argv) {
         exit(-1);
     }
 
+    ThreadPool::InitGlobal(std::max(threads, static_cast<size_t>(1)), pin_cpu);
+
     BiWord2VecTrainer<id_t, real_t> trainer;
+    trainer.options_.chunk_size = chunk_size;
+    trainer.options_.batch_size = batch_size;
+    trainer.options_.prefetch_distance = prefetch_distance;
+    trainer.options_.partitions = partitions;
+    trainer.options_.partition_budget = partition_budget;
+    trainer.options_.memory_budget = memory_budget;
+    trainer.options_.workers = workers;
+    trainer.options_.pin_cpu = pin_cpu;
+    trainer.options_.checkpoint_interval = checkpoint_interval;
+    trainer.options_.resume = resume;
+    trainer.options_.init_model = init_model;
+    trainer.options_.format = format;
+    trainer.options_.encoding = encoding;
+    trainer.options_.pq_subspaces = pq_subspaces;
+    trainer.options_.stream = stream;
+    trainer.options_.stream_block = stream_block;
+    trainer.options_.snapshot_interval = snapshot_interval;
+    trainer.options_.hot_targets = hot_targets;
+    trainer.options_.hot_sources = hot_sources;
+    trainer.options_.hot_sync_interval = hot_sync;
 
-    trainer.Train(
+    bool trained = trainer.Train(
         input_path.c_str(),
         model_path.c_str(),
         alpha,
@@ -141,6 +310,6 @@ int main(int argc, char**argv) {
         seed
     );
 
-    return 0;
+    return trained ? 0 : -1;
 }
 /* vim: set ts=4 sw=4 tw=0 et :*/
@@ -2,16 +2,35 @@
 #define SRC_BIWORD2VEC_H
 
 #include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
 #include <functional>
+#include <mutex>
+#include <new>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "src/checkpoint.h"
 #include "src/data.h"
+#include "src/edge_store.h"
+#include "src/embedding_file.h"
+#include "src/hot_rows.h"
+#include "src/lock.h"
+#include "src/mmap_file.h"
+#include "src/npy_file.h"
+#include "src/partition.h"
 #include "src/sampler.h"
+#include "src/thread_pool.h"
 #include "src/util.h"
 
-typedef std::function<std::string(size_t id)> name_func_t;
+typedef std::function<const std::string&(size_t id)> name_func_t;
 
 template <typename IdType, typename T>
 struct NoiseProbFunctionType {
@@ -20,17 +39,60 @@ struct NoiseProbFunctionType {
 
 enum LossType { LOSS_LINE = 0, LOSS_NCE = 1 };
 
+// How Save() writes the matrices: text rows, mappable embedding files, or
+// .npy matrices with a vocabulary file next to them.
+enum ModelFormat { FORMAT_TEXT = 0, FORMAT_BINARY = 1, FORMAT_NPY = 2 };
+
+const size_t DEF_TRAIN_CHUNK_SIZE = 10000;
+const size_t DEF_HOT_SYNC_INTERVAL = 1000;
+const size_t DEF_STREAM_BLOCK_SIZE = 100000;
+// rows written between releases of a file backed matrix
+const size_t RELEASE_ROW_STRIDE = 65536;
+// bytes of text a thread formats before it writes them out
+const size_t EXPORT_BLOCK_BYTES = 4 << 20;
+
 template <typename T>
 class BiWord2VecModel {
 public:
     BiWord2VecModel(size_t source, size_t target, size_t hidden, T alpha);
 
+    // a view on rows owned by someone else, e.g. one bucket pair of a file
+    // backed model; ids passed to the view are local to those rows
+    BiWord2VecModel(
+        size_t source,
+        size_t target,
+        size_t hidden,
+        T alpha,
+        T* source_hidden,
+        T* target_hidden
+    );
+
     virtual ~BiWord2VecModel();
 
     bool InitModel(unsigned seed = 1);
 
+    // grow heap matrices to source/target rows, new rows are initialized
+    // like InitModel does; capacity doubles, so a stream of new ids costs
+    // amortized O(1) row copies per id
+    bool Grow(size_t source, size_t target, unsigned seed = 1);
+
+    // keep both matrices in a file mapping at path instead of the heap, or
+    // in the POSIX shared memory segment `path` if shared_memory is set
+    bool MapStorage(const char* path, bool shared_memory = false);
+
+    // drop rows [begin, end) of a file backed matrix from memory, or start
+    // reading them ahead; no-ops for heap matrices
+    void ReleaseRows(bool source, size_t begin, size_t end);
+
+    void WillNeedRows(bool source, size_t begin, size_t end);
+
     T Predict(size_t source_id, size_t target_id);
 
+    // issue software prefetches for the row an update is about to touch
+    void PrefetchSource(size_t source_id, HotRowReplica<T>* source_rows = nullptr);
+
+    void PrefetchTarget(size_t target_id, HotRowReplica<T>* target_rows = nullptr);
+
     T PredictRaw(size_t source_id, size_t target_id);
 
     T Update(
@@ -39,13 +101,83 @@ public:
         std::vector<size_t>& negative_targets,
         typename NoiseProbFunctionType<size_t, T>::Type noise_prob_func = nullptr,
         T decay = 1.,
-        T* buffer = nullptr
+        T* buffer = nullptr,
+        HotRowReplica<T>* source_rows = nullptr,
+        HotRowReplica<T>* target_rows = nullptr
+    );
+
+    // update `batch` positive edges which share one set of negatives, every
+    // negative row is loaded once and scored against all sources of the
+    // batch; buffer must hold batch * hidden_size values
+    T UpdateBatch(
+        const size_t* source_ids,
+        const size_t* target_ids,
+        size_t batch,
+        const std::vector<size_t>& negative_targets,
+        typename NoiseProbFunctionType<size_t, T>::Type noise_prob_func = nullptr,
+        T decay = 1.,
+        T* buffer = nullptr,
+        HotRowReplica<T>* source_rows = nullptr,
+        HotRowReplica<T>* target_rows = nullptr
     );
 
-    void Save(
+    // write path.source and path.target as text, as mappable embedding
+    // files of the given encoding (FORMAT_BINARY), or as path.source.npy
+    // and path.source.vocab (FORMAT_NPY, same for target); pq_subspaces is
+    // the requested number of product quantization subspaces; false if a
+    // file could not be written
+    bool Save(
         const char* model_path,
         name_func_t source_name = nullptr,
-        name_func_t target_name = nullptr
+        name_func_t target_name = nullptr,
+        ModelFormat format = FORMAT_TEXT,
+        EmbeddingEncoding encoding = ENCODING_FLOAT32,
+        size_t pq_subspaces = 0
+    );
+
+    bool SaveMatrix(
+        const std::string& path,
+        const T* matrix,
+        size_t rows,
+        name_func_t row_name = nullptr
+    );
+
+    // train the product quantization codebooks of a matrix on evenly
+    // spaced rows, pq_subspaces is the requested number of subspaces
+    bool TrainQuantizer(
+        const T* matrix,
+        size_t rows,
+        size_t pq_subspaces,
+        ProductQuantizer* pq
+    );
+
+    // pq holds the trained codebooks for ENCODING_PQ
+    bool SaveMatrixBinary(
+        const std::string& path,
+        const T* matrix,
+        size_t rows,
+        name_func_t row_name = nullptr,
+        EmbeddingEncoding encoding = ENCODING_FLOAT32,
+        const ProductQuantizer* pq = nullptr
+    );
+
+    // write the raw matrix as path.npy and the row names, one per line, as
+    // path.vocab
+    bool SaveMatrixNpy(
+        const std::string& path,
+        const T* matrix,
+        size_t rows,
+        name_func_t row_name = nullptr
+    );
+
+    // overwrite the rows of the source (or target) matrix with the rows of
+    // a matrix written by SaveMatrix or SaveMatrixBinary, row_id maps a row name to its id and
+    // returns an id >= rows for unknown names; *loaded counts the rows taken
+    bool LoadMatrix(
+        const std::string& path,
+        bool source,
+        std::function<size_t(const std::string&)> row_id,
+        size_t* loaded
     );
 
 public:
@@ -64,35 +196,174 @@ public:
     T* target_hidden_;
 
     SigmoidTable sigmoid_table_;
+
+private:
+    void GrowMatrix(T** matrix, size_t* rows, size_t* capacity, size_t new_rows, unsigned seed);
+
+private:
+    bool owns_memory_;
+    MmapFile* storage_;
+    size_t source_capacity_;
+    size_t target_capacity_;
 };
 
 template <typename IdType, typename T>
 class BiWord2VecTrainer {
 public:
+    struct TrainerOptions {
+        // number of edges a thread takes from the shared cursor at once
+        size_t chunk_size;
+        // number of edges sharing one set of negatives
+        size_t batch_size;
+        // number of batches drawn and prefetched ahead of the current one
+        size_t prefetch_distance;
+        // number of hottest target/source rows replicated per thread
+        size_t hot_targets;
+        size_t hot_sources;
+        // updates between merges of the replicas into the model
+        size_t hot_sync_interval;
+        // number of source/target buckets of partitioned training, or the
+        // bytes one source plus one target bucket may take (0: disabled)
+        size_t partitions;
+        size_t partition_budget;
+        // bytes of memory an out-of-core run may use (0: in-memory run)
+        size_t memory_budget;
+        // number of worker processes sharing the model in shared memory
+        size_t workers;
+        bool pin_cpu;
+        // seconds between checkpoints written next to the model (0: none),
+        // and whether to continue from the last checkpoint
+        size_t checkpoint_interval;
+        bool resume;
+        // model (or checkpoint) the embeddings are initialized from
+        std::string init_model;
+        // save the model as text, .npy matrices, or binary embedding files
+        // of float32, int8 or product quantized rows
+        ModelFormat format;
+        EmbeddingEncoding encoding;
+        size_t pq_subspaces;
+        // train on edges as they arrive on the input stream, in blocks of
+        // stream_block edges, exporting the model every snapshot_interval
+        // seconds (0: only at the end of the stream)
+        bool stream;
+        size_t stream_block;
+        size_t snapshot_interval;
+
+        TrainerOptions() {
+            chunk_size = DEF_TRAIN_CHUNK_SIZE;
+            batch_size = 1;
+            prefetch_distance = 0;
+            hot_targets = 0;
+            hot_sources = 0;
+            hot_sync_interval = DEF_HOT_SYNC_INTERVAL;
+            partitions = 0;
+            partition_budget = 0;
+            memory_budget = 0;
+            workers = 1;
+            pin_cpu = false;
+            checkpoint_interval = 0;
+            resume = false;
+            format = FORMAT_TEXT;
+            encoding = ENCODING_FLOAT32;
+            pq_subspaces = 0;
+            stream = false;
+            stream_block = DEF_STREAM_BLOCK_SIZE;
+            snapshot_interval = 0;
+        }
+    };
+
     struct TrainingContext {
         BiWord2VecModel<T>* model;
+        // edges the edge samplers refer to
+        const Sample<IdType, T>* samples;
         size_t training_words;
-        size_t training_words_actual;
         size_t negative;
         size_t num_threads;
         size_t iteration;
+        size_t chunk_size;
+        size_t batch_size;
+        size_t prefetch_distance;
+        unsigned seed;
+        const std::vector<T>* target_noise_prob;
+        const HotRowSet* hot_targets;
+        const HotRowSet* hot_sources;
+        size_t hot_sync_interval;
+
+        // next edge to hand out, shared by all threads
+        std::atomic<size_t> cursor;
+        std::atomic<size_t> training_words_actual;
+
+        SpinLock stats_lock;
         double logloss;
         size_t logloss_count;
-        const std::unordered_map<IdType, T>* target_noise_prob;
+        std::chrono::steady_clock::time_point start_time;
+        // edges already trained by the run this one resumes
+        size_t resumed_words;
+
+        CheckpointWriter<T>* checkpoint;
+        size_t checkpoint_interval;
+        // checkpoints due so far, claimed by the thread that takes them
+        std::atomic<size_t> checkpoints;
 
-        TrainingContext() {
+        TrainingContext() : cursor(0), training_words_actual(0), checkpoints(0) {
             model = nullptr;
+            samples = nullptr;
             training_words = 0;
-            training_words_actual = 0;
             negative = 0;
             num_threads = 0;
             iteration = 1;
+            chunk_size = DEF_TRAIN_CHUNK_SIZE;
+            batch_size = 1;
+            prefetch_distance = 0;
+            seed = 1;
             logloss = 0;
             logloss_count = 0;
             target_noise_prob = nullptr;
+            hot_targets = nullptr;
+            hot_sources = nullptr;
+            hot_sync_interval = DEF_HOT_SYNC_INTERVAL;
+            start_time = std::chrono::steady_clock::now();
+            resumed_words = 0;
+            checkpoint = nullptr;
+            checkpoint_interval = 0;
         }
     };
 
+    // one batch of edges and its negatives, as it moves through the
+    // prefetch pipeline of a training thread
+    struct PendingBatch {
+        size_t size;
+        std::vector<size_t> sample_ids;
+        std::vector<size_t> source_ids;
+        std::vector<size_t> target_ids;
+        std::vector<size_t> negative_targets;
+
+        PendingBatch(size_t batch_size, size_t negative)
+        : size(0),
+          sample_ids(batch_size),
+          source_ids(batch_size),
+          target_ids(batch_size),
+          negative_targets(negative) {
+        }
+    };
+
+    // training state of one thread that lives across chunks and rounds
+    struct ThreadState {
+        std::default_random_engine rng;
+        T* buffer;
+        HotRowReplica<T>* source_rows;
+        HotRowReplica<T>* target_rows;
+        size_t updates_since_sync;
+        std::vector<PendingBatch> ring;
+        typename NoiseProbFunctionType<size_t, T>::Type noise_prob_func;
+
+        ThreadState(size_t thread_id, TrainingContext* context);
+        ~ThreadState();
+
+        // merge hot-row replicas into the model
+        void Sync();
+    };
+
 public:
     BiWord2VecTrainer();
 
@@ -118,7 +389,92 @@ public:
         TrainingContext* context
     );
 
+    // train with edges and embeddings on disk, within options_.memory_budget
+    bool TrainOutOfCore(
+        const char* input_path,
+        const char* model_path,
+        T alpha,
+        size_t hidden_size,
+        size_t iteration,
+        size_t negative,
+        size_t training_words,
+        size_t num_threads,
+        double weight_neg_sampling,
+        WeightType weight_type,
+        LossType method,
+        unsigned seed
+    );
+
+    // online training on the edges of a pipe or stdin ("-"), vocabularies
+    // and matrices grow as new ids arrive; every block of edges is trained
+    // `iteration` times its size against negatives drawn by the target
+    // popularity seen so far
+    bool TrainStream(
+        const char* input_path,
+        const char* model_path,
+        T alpha,
+        size_t hidden_size,
+        size_t iteration,
+        size_t negative,
+        size_t num_threads,
+        double weight_neg_sampling,
+        WeightType weight_type,
+        LossType method,
+        unsigned seed
+    );
+
+    // fork num_workers processes that train disjoint shards of the edges
+    // against the model and context in shared memory
+    bool TrainWorkers(
+        TrainingContext* context,
+        size_t num_workers,
+        unsigned seed
+    );
+
+    // train bucket pair by bucket pair, see EdgePartition
+    void TrainPartitioned(
+        TrainingContext* context,
+        EdgePartition<IdType, T>* partition
+    );
+
+    // train num_edges edges drawn from edge_sampler, with negatives drawn
+    // from negative_sampler, accumulating the loss into logloss/count
+    void TrainEdges(
+        ThreadState* state,
+        TrainingContext* context,
+        BaseSampler* edge_sampler,
+        BaseSampler* negative_sampler,
+        size_t num_edges,
+        T alpha_decay,
+        double* logloss,
+        size_t* count
+    );
+
+    void ReportProgress(
+        TrainingContext* context,
+        size_t words,
+        double logloss,
+        size_t count
+    );
+
+    // hand a snapshot of the model and the progress to the checkpoint
+    // writer if a checkpoint is due and the previous one is written
+    void TakeCheckpoint(TrainingContext* context, double seconds);
+
+    // continue from the checkpoint at path, rows are matched by word
+    bool Resume(const std::string& path, TrainingContext* context);
+
+    // start from the rows of a model written by Save (path.source and
+    // path.target) or from a checkpoint file; only the ids of words the
+    // old model does not know keep their random initial values
+    bool WarmStart(const std::string& path, BiWord2VecModel<T>* model);
+
+    // copy the rows of a checkpoint into model, matched by word
+    void CopyRows(const CheckpointState<T>& state, BiWord2VecModel<T>* model);
+
 public:
+    TrainerOptions options_;
+
     DataManager<IdType, T>* data_manager_;
 
     BaseSampler* data_sampler_;
@@ -135,20 +491,100 @@ BiWord2VecModel<T>::BiWord2VecModel(
     hidden_size_(hidden),
     source_size_(source),
     target_size_(target),
-    sigmoid_table_() {
+    sigmoid_table_(),
+    owns_memory_(true),
+    storage_(nullptr),
+    source_capacity_(source),
+    target_capacity_(target) {
     source_hidden_ = new T[source_size_ * hidden_size_ + 1];
     target_hidden_ = new T[target_size_ * hidden_size_ + 1];
 }
 
+template <typename T>
+BiWord2VecModel<T>::BiWord2VecModel(
+    size_t source,
+    size_t target,
+    size_t hidden,
+    T alpha,
+    T* source_hidden,
+    T* target_hidden
+) : alpha_(alpha),
+    hidden_size_(hidden),
+    source_size_(source),
+    target_size_(target),
+    source_hidden_(source_hidden),
+    target_hidden_(target_hidden),
+    sigmoid_table_(),
+    owns_memory_(false),
+    storage_(nullptr),
+    source_capacity_(source),
+    target_capacity_(target) {
+}
+
 template <typename T>
 BiWord2VecModel<T>::~BiWord2VecModel() {
-    if (source_hidden_) {
+    if (owns_memory_ && source_hidden_) {
         delete [] source_hidden_;
     }
 
-    if (target_hidden_) {
+    if (owns_memory_ && target_hidden_) {
+        delete [] target_hidden_;
+    }
+
+    if (storage_) {
+        delete storage_;
+    }
+}
+
+template <typename T>
+bool BiWord2VecModel<T>::MapStorage(const char* path, bool shared_memory) {
+    MmapFile* storage = new MmapFile();
+    size_t source_bytes = source_size_ * hidden_size_ * sizeof(T);
+    size_t target_bytes = target_size_ * hidden_size_ * sizeof(T);
+    size_t bytes = source_bytes + target_bytes + sizeof(T);
+    bool ret = shared_memory ?
+        storage->CreateShared(path, bytes) : storage->Create(path, bytes);
+    if (!ret) {
+        delete storage;
+        return false;
+    }
+
+    if (owns_memory_) {
+        delete [] source_hidden_;
         delete [] target_hidden_;
+        owns_memory_ = false;
+    }
+
+    if (storage_) {
+        delete storage_;
+    }
+
+    storage_ = storage;
+    source_hidden_ = reinterpret_cast<T*>(storage_->data());
+    target_hidden_ = reinterpret_cast<T*>(storage_->data() + source_bytes);
+    return true;
+}
+
+template <typename T>
+void BiWord2VecModel<T>::ReleaseRows(bool source, size_t begin, size_t end) {
+    if (storage_ == nullptr || begin >= end) {
+        return;
+    }
+
+    T* matrix = source ? source_hidden_ : target_hidden_;
+    size_t offset = reinterpret_cast<char*>(matrix + begin * hidden_size_) - storage_->data();
+    storage_->Release(offset, (end - begin) * hidden_size_ * sizeof(T));
+}
+
+template <typename T>
+void BiWord2VecModel<T>::WillNeedRows(bool source, size_t begin, size_t end) {
+    if (storage_ == nullptr || begin >= end) {
+        return;
     }
+
+    T* matrix = source ? source_hidden_ : target_hidden_;
+    size_t offset = reinterpret_cast<char*>(matrix + begin * hidden_size_) - storage_->data();
+    storage_->WillNeed(offset, (end - begin) * hidden_size_ * sizeof(T));
 }
 
 template <typename T>
@@ -160,52 +596,344 @@ bool BiWord2VecModel<T>::InitModel(unsigned seed) {
     for (size_t i = 0; i < source_size_ * hidden_size_; ++i) {
         T r = uniform_dist(rand_generator);
         source_hidden_[i] = r / hidden_size_;
+        if ((i + 1) % (RELEASE_ROW_STRIDE * hidden_size_) == 0) {
+            size_t row = (i + 1) / hidden_size_;
+            ReleaseRows(true, row - RELEASE_ROW_STRIDE, row);
+        }
     }
+    ReleaseRows(true, 0, source_size_);
 
     for (size_t i = 0; i < target_size_ * hidden_size_; ++i) {
         T r = uniform_dist(rand_generator);
         target_hidden_[i] = r / hidden_size_;
+        if ((i + 1) % (RELEASE_ROW_STRIDE * hidden_size_) == 0) {
+            size_t row = (i + 1) / hidden_size_;
+            ReleaseRows(false, row - RELEASE_ROW_STRIDE, row);
+        }
+    }
+    ReleaseRows(false, 0, target_size_);
+
+    return true;
+}
+
+template <typename T>
+bool BiWord2VecModel<T>::Grow(size_t source, size_t target, unsigned seed) {
+    if (!owns_memory_) {
+        return false;
     }
 
+    GrowMatrix(&source_hidden_, &source_size_, &source_capacity_, source, seed);
+    GrowMatrix(&target_hidden_, &target_size_, &target_capacity_, target, seed + 1);
     return true;
 }
 
 template <typename T>
-void BiWord2VecModel<T>::Save(const char* path, name_func_t source_name, name_func_t target_name) {
+void BiWord2VecModel<T>::GrowMatrix(
+    T** matrix,
+    size_t* rows,
+    size_t* capacity,
+    size_t new_rows,
+    unsigned seed
+) {
+    if (new_rows <= *rows) {
+        return;
+    }
+
+    if (new_rows > *capacity) {
+        size_t grown_capacity = std::max(new_rows, *capacity * 2);
+        T* grown = new T[grown_capacity * hidden_size_ + 1];
+        std::copy(*matrix, *matrix + *rows * hidden_size_, grown);
+        delete [] *matrix;
+        *matrix = grown;
+        *capacity = grown_capacity;
+    }
+
+    std::default_random_engine rand_generator(seed + *rows);
+    std::uniform_real_distribution<T> uniform_dist(-0.5, 0.5);
+    for (size_t i = *rows * hidden_size_; i < new_rows * hidden_size_; ++i) {
+        (*matrix)[i] = uniform_dist(rand_generator) / hidden_size_;
+    }
+    *rows = new_rows;
+}
+
+template <typename T>
+bool BiWord2VecModel<T>::Save(
+    const char* path,
+    name_func_t source_name,
+    name_func_t target_name,
+    ModelFormat format,
+    EmbeddingEncoding encoding,
+    size_t pq_subspaces
+) {
     std::string source_path = std::string(path) + std::string(".source");
     std::string target_path = std::string(path) + std::string(".target");
 
-    FILE* fp = fopen(source_path.c_str(), "w");
-    fprintf(fp, "%lu %lu\n", source_size_, hidden_size_);
-    for (size_t i = 0; i < source_size_; ++i) {
-        if (source_name != nullptr) {
-            std::string w = source_name(i);
-            fprintf(fp, "%s\t", w.c_str());
+    if (format == FORMAT_TEXT) {
+        // text export formats the rows of one file on the whole pool
+        bool ok = SaveMatrix(source_path, source_hidden_, source_size_, source_name);
+        return SaveMatrix(target_path, target_hidden_, target_size_, target_name) && ok;
+    }
+
+    // the codebooks are trained here, one matrix after the other, so that
+    // their k-means gets the whole pool; on a worker it would run serially
+    ProductQuantizer source_pq, target_pq;
+    if (format == FORMAT_BINARY && encoding == ENCODING_PQ &&
+            (!TrainQuantizer(source_hidden_, source_size_, pq_subspaces, &source_pq) ||
+             !TrainQuantizer(target_hidden_, target_size_, pq_subspaces, &target_pq))) {
+        return false;
+    }
+
+    // both files are independent, write them concurrently
+    auto save_matrix = [&] (bool source) {
+        const std::string& path = source ? source_path : target_path;
+        const T* matrix = source ? source_hidden_ : target_hidden_;
+        size_t rows = source ? source_size_ : target_size_;
+        name_func_t row_name = source ? source_name : target_name;
+        if (format == FORMAT_NPY) {
+            return SaveMatrixNpy(path, matrix, rows, row_name);
+        }
+        return SaveMatrixBinary(path, matrix, rows, row_name, encoding, source ? &source_pq : &target_pq);
+    };
+
+    auto source_done = ThreadPool::Global()->Submit([&] () { return save_matrix(true); });
+    bool ok = save_matrix(false);
+    return source_done.get() && ok;
+}
+
+template <typename T>
+bool BiWord2VecModel<T>::SaveMatrixNpy(
+    const std::string& path,
+    const T* matrix,
+    size_t rows,
+    name_func_t row_name
+) {
+    FILE* fp = fopen((path + ".npy").c_str(), "wb");
+    if (!fp) {
+        return false;
+    }
+
+    // the values are written as they are in memory, a stride of rows at
+    // a time so that the pages of an out of core matrix can be dropped
+    bool ok = WriteNpyHeader(fp, sizeof(T), rows, hidden_size_);
+    for (size_t begin = 0; ok && begin < rows; begin += RELEASE_ROW_STRIDE) {
+        size_t end = std::min(begin + RELEASE_ROW_STRIDE, rows);
+        size_t count = (end - begin) * hidden_size_;
+        ok = fwrite(matrix + begin * hidden_size_, sizeof(T), count, fp) == count;
+        ReleaseRows(matrix == source_hidden_, begin, end);
+    }
+    ok = (fclose(fp) == 0) && ok;
+
+    fp = fopen((path + ".vocab").c_str(), "w");
+    if (!fp) {
+        return false;
+    }
+
+    for (size_t i = 0; i < rows; ++i) {
+        if (row_name != nullptr) {
+            const std::string& name = row_name(i);
+            fwrite(name.data(), 1, name.size(), fp);
+            fputc('\n', fp);
         } else {
-            fprintf(fp, "%lu\t", i);
+            fprintf(fp, "%lu\n", i);
+        }
+    }
+
+    ok = !ferror(fp) && ok;
+    return (fclose(fp) == 0) && ok;
+}
+
+template <typename T>
+bool BiWord2VecModel<T>::TrainQuantizer(
+    const T* matrix,
+    size_t rows,
+    size_t pq_subspaces,
+    ProductQuantizer* pq
+) {
+    size_t subspaces = PQSubspaces(
+        hidden_size_, pq_subspaces > 0 ? pq_subspaces : std::max(hidden_size_ / 4, static_cast<size_t>(1)));
+
+    // k-means runs on evenly spaced rows, not a copy of the matrix
+    size_t sample_rows = std::min(rows, PQ_TRAIN_ROWS);
+    std::vector<float> sample(sample_rows * hidden_size_);
+    for (size_t i = 0; i < sample_rows; ++i) {
+        const T* row = matrix + (i * rows / sample_rows) * hidden_size_;
+        std::copy(row, row + hidden_size_, &sample[i * hidden_size_]);
+    }
+    return pq->Train(sample.data(), sample_rows, hidden_size_, subspaces);
+}
+
+template <typename T>
+bool BiWord2VecModel<T>::SaveMatrixBinary(
+    const std::string& path,
+    const T* matrix,
+    size_t rows,
+    name_func_t row_name,
+    EmbeddingEncoding encoding,
+    const ProductQuantizer* pq
+) {
+    EmbeddingFileWriter writer;
+    if (!writer.Open(path.c_str(), rows, hidden_size_, encoding, pq)) {
+        return false;
+    }
+
+    std::vector<float> row(hidden_size_);
+    for (size_t i = 0; i < rows; ++i) {
+        const T* matrix_row = matrix + i * hidden_size_;
+        std::copy(matrix_row, matrix_row + hidden_size_, row.begin());
+        std::string name = row_name != nullptr ? row_name(i) : std::to_string(i);
+        if (!writer.WriteRow(name, row.data())) {
+            break;
         }
-        for (size_t j = 0; j < hidden_size_; ++j) {
-            const char* tail = (j == hidden_size_ - 1) ? "\n" : " ";
-            fprintf(fp, "%lf%s", source_hidden_[i * hidden_size_ + j], tail);
+        if ((i + 1) % RELEASE_ROW_STRIDE == 0) {
+            ReleaseRows(matrix == source_hidden_, i + 1 - RELEASE_ROW_STRIDE, i + 1);
         }
     }
-    fclose(fp);
 
-    fp = fopen(target_path.c_str(), "w");
-    fprintf(fp, "%lu %lu\n", target_size_, hidden_size_);
-    for (size_t i = 0; i < target_size_; ++i) {
-        if (target_name != nullptr) {
-            std::string w = target_name(i);
-            fprintf(fp, "%s\t", w.c_str());
-        } else {
-            fprintf(fp, "%lu\t", i);
+    return writer.Close();
+}
+
+template <typename T>
+bool BiWord2VecModel<T>::SaveMatrix(
+    const std::string& path,
+    const T* matrix,
+    size_t rows,
+    name_func_t row_name
+) {
+    FILE* fp = fopen(path.c_str(), "w");
+    if (!fp) {
+        return false;
+    }
+
+    bool ok = fprintf(fp, "%lu %lu\n", rows, hidden_size_) > 0;
+
+    // threads format blocks of rows into their own buffers, with the
+    // shortest text that reads back to the same value, and write them out
+    // in block order; a finished block waits for its predecessors
+    size_t block_rows = std::max(EXPORT_BLOCK_BYTES / (hidden_size_ * 16 + 32), static_cast<size_t>(1));
+    size_t num_blocks = (rows + block_rows - 1) / block_rows;
+    std::atomic<size_t> cursor(0);
+    std::mutex write_mutex;
+    std::condition_variable write_cond;
+    size_t next_block = 0;
+
+    ThreadPool* pool = ThreadPool::Global();
+    pool->Run([&] (size_t) {
+        std::string buffer;
+        char number[64];
+        while (true) {
+            size_t block = cursor.fetch_add(1);
+            if (block >= num_blocks) {
+                break;
+            }
+
+            size_t begin = block * block_rows;
+            size_t end = std::min(begin + block_rows, rows);
+            buffer.clear();
+            for (size_t i = begin; i < end; ++i) {
+                if (row_name != nullptr) {
+                    buffer.append(row_name(i));
+                } else {
+                    buffer.append(number, std::to_chars(number, number + sizeof(number), i).ptr);
+                }
+                buffer.push_back('\t');
+
+                const T* row = matrix + i * hidden_size_;
+                for (size_t j = 0; j < hidden_size_; ++j) {
+                    buffer.append(number, std::to_chars(number, number + sizeof(number), row[j]).ptr);
+                    buffer.push_back(j == hidden_size_ - 1 ? '\n' : ' ');
+                }
+            }
+            ReleaseRows(matrix == source_hidden_, begin, end);
+
+            std::unique_lock<std::mutex> lock(write_mutex);
+            write_cond.wait(lock, [&] () { return next_block == block; });
+            ok = ok && fwrite(buffer.data(), 1, buffer.size(), fp) == buffer.size();
+            ++next_block;
+            write_cond.notify_all();
+        }
+    }, pool->size());
+
+    return (fclose(fp) == 0) && ok;
+}
+
+template <typename T>
+bool BiWord2VecModel<T>::LoadMatrix(
+    const std::string& path,
+    bool source,
+    std::function<size_t(const std::string&)> row_id,
+    size_t* loaded
+) {
+    T* matrix = source ? source_hidden_ : target_hidden_;
+    size_t rows = source ? source_size_ : target_size_;
+    *loaded = 0;
+
+    if (EmbeddingFile::IsBinary(path.c_str())) {
+        EmbeddingFile file;
+        if (!file.Open(path.c_str()) || file.hidden_size() != hidden_size_) {
+            return false;
+        }
+
+        std::vector<float> row(hidden_size_);
+        for (size_t i = 0; i < file.rows(); ++i) {
+            size_t id = row_id(file.Name(i));
+            if (id < rows) {
+                file.DecodeRow(i, row.data());
+                std::copy(row.begin(), row.end(), matrix + id * hidden_size_);
+                ++*loaded;
+            }
+        }
+
+        ReleaseRows(source, 0, rows);
+        return true;
+    }
+
+    FILE* fp = fopen(path.c_str(), "r");
+    if (!fp) {
+        return false;
+    }
+
+    enum { BUF_SIZE = 102400 };
+    char* buf = new char[BUF_SIZE];
+
+    size_t num_rows = 0, hidden_size = 0;
+    bool ok = fgets(buf, BUF_SIZE - 1, fp) != nullptr &&
+        sscanf(buf, "%lu %lu", &num_rows, &hidden_size) == 2 &&
+        hidden_size == hidden_size_;
+
+    std::vector<T> row(hidden_size_);
+    char* ptr = nullptr;
+    for (size_t line = 0; ok && line < num_rows; ++line) {
+        if (fgets(buf, BUF_SIZE - 1, fp) == nullptr) {
+            break;
+        }
+        buf[BUF_SIZE - 1] = '\0';
+
+        char* word = strtok_r(buf, "\t\r\n", &ptr);
+        if (word == nullptr) {
+            continue;
+        }
+
+        size_t i = 0;
+        for (; i < hidden_size_; ++i) {
+            char* p = strtok_r(nullptr, " \t\r\n", &ptr);
+            if (p == nullptr) {
+                break;
+            }
+            row[i] = static_cast<T>(atof(p));
         }
-        for (size_t j = 0; j < hidden_size_; ++j) {
-            const char* tail = (j == hidden_size_ - 1) ? "\n" : " ";
-            fprintf(fp, "%lf%s", target_hidden_[i * hidden_size_ + j], tail);
+
+        size_t id = row_id(word);
+        if (i == hidden_size_ && id < rows) {
+            std::copy(row.begin(), row.end(), matrix + id * hidden_size_);
+            ++*loaded;
         }
     }
+
+    delete [] buf;
     fclose(fp);
+
+    ReleaseRows(source, 0, rows);
+    return ok;
 }
 
 template <typename T>
@@ -214,6 +942,20 @@ T BiWord2VecModel<T>::Predict(size_t source_id, size_t target_id) {
     return sigmoid_table_[score];
 }
 
+template <typename T>
+void BiWord2VecModel<T>::PrefetchSource(size_t source_id, HotRowReplica<T>* source_rows) {
+    const T* row = source_rows != nullptr ?
+        source_rows->PeekRow(source_id) : source_hidden_ + source_id * hidden_size_;
+    util_prefetch(row, hidden_size_ * sizeof(T));
+}
+
+template <typename T>
+void BiWord2VecModel<T>::PrefetchTarget(size_t target_id, HotRowReplica<T>* target_rows) {
+    const T* row = target_rows != nullptr ?
+        target_rows->PeekRow(target_id) : target_hidden_ + target_id * hidden_size_;
+    util_prefetch(row, hidden_size_ * sizeof(T));
+}
+
 template <typename T>
 T BiWord2VecModel<T>::PredictRaw(size_t source_id, size_t target_id) {
     if (source_id >= source_size_ || target_id >= target_size_) {
@@ -237,57 +979,118 @@ T BiWord2VecModel<T>::Update(
     std::vector<size_t>& negative_targets,
     typename NoiseProbFunctionType<size_t, T>::Type noise_prob_func,
     T decay,
-    T* buffer
+    T* buffer,
+    HotRowReplica<T>* source_rows,
+    HotRowReplica<T>* target_rows
+) {
+    return UpdateBatch(
+        &source_id,
+        &target_id,
+        1,
+        negative_targets,
+        noise_prob_func,
+        decay,
+        buffer,
+        source_rows,
+        target_rows
+    );
+}
+
+template <typename T>
+T BiWord2VecModel<T>::UpdateBatch(
+    const size_t* source_ids,
+    const size_t* target_ids,
+    size_t batch,
+    const std::vector<size_t>& negative_targets,
+    typename NoiseProbFunctionType<size_t, T>::Type noise_prob_func,
+    T decay,
+    T* buffer,
+    HotRowReplica<T>* source_rows,
+    HotRowReplica<T>* target_rows
 ) {
     bool delete_buffer = false;
     if (buffer == nullptr) {
-        buffer = new T[hidden_size_ + 1];
+        buffer = new T[batch * hidden_size_ + 1];
         delete_buffer = true;
     }
 
-    auto update_target = [&] (size_t source_id, size_t target_id, T grad) {
-        for (size_t i = 0; i < hidden_size_; ++i) {
-            buffer[i] -= grad * target_hidden_[target_id * hidden_size_ + i];
-            target_hidden_[target_id * hidden_size_ + i] -=
-                grad * source_hidden_[source_id * hidden_size_ + i];
-        }
+    // hot rows are read and written through the thread's replica
+    auto get_source_row = [&] (size_t source_id) {
+        return source_rows != nullptr ?
+            source_rows->Row(source_id) : source_hidden_ + source_id * hidden_size_;
     };
 
-    auto update_source = [&] (size_t source_id, T* buffer) {
+    auto get_target_row = [&] (size_t target_id) {
+        return target_rows != nullptr ?
+            target_rows->Row(target_id) : target_hidden_ + target_id * hidden_size_;
+    };
+
+    auto predict_raw = [&] (const T* source_row, const T* target_row) {
+        T sum = 0;
         for (size_t i = 0; i < hidden_size_; ++i) {
-            source_hidden_[source_id * hidden_size_ + i] += buffer[i];
+            sum += source_row[i] * target_row[i];
         }
+        return sum;
     };
 
-    std::fill(buffer, buffer + hidden_size_, 0);
+    std::fill(buffer, buffer + batch * hidden_size_, 0);
 
     T logloss = 0;
-    // T pred = Predict(source_id, target_id);
-    // update_target(source_id, target_id, alpha_ * decay * (pred - 1.));
-    // logloss += -safe_log<T>(pred);
-    T pred_raw = PredictRaw(source_id, target_id);
-    if (noise_prob_func != nullptr) {
-        pred_raw -= noise_prob_func(target_id);
+    for (size_t b = 0; b < batch; ++b) {
+        // T pred = Predict(source_id, target_id);
+        // update_target(source_id, target_id, alpha_ * decay * (pred - 1.));
+        // logloss += -safe_log<T>(pred);
+        T* source_row = get_source_row(source_ids[b]);
+        T* target_row = get_target_row(target_ids[b]);
+        T* grad_row = buffer + b * hidden_size_;
+
+        T pred_raw = predict_raw(source_row, target_row);
+        if (noise_prob_func != nullptr) {
+            pred_raw -= noise_prob_func(target_ids[b]);
+        }
+        T pred = sigmoid_table_[pred_raw];
+        logloss += -sigmoid_table_.LogSigmoid(pred_raw);
+
+        T grad = alpha_ * decay * (pred - 1.);
+        for (size_t i = 0; i < hidden_size_; ++i) {
+            grad_row[i] -= grad * target_row[i];
+            target_row[i] -= grad * source_row[i];
+        }
     }
-    T pred = sigmoid_table_[pred_raw];
-    logloss += -sigmoid_table_.LogSigmoid(pred_raw);
-    update_target(source_id, target_id, alpha_ * decay * (pred - 1.));
 
+    // every negative row is loaded once and stays in cache while it is
+    // scored against, and updated by, each source of the batch in turn
     for (size_t j = 0; j < negative_targets.size(); ++j) {
         size_t negative_id = negative_targets[j];
-        // pred = Predict(source_id, negative_id);
-        // update_target(source_id, negative_id, alpha_ * decay * pred);
-        // logloss += -safe_log<T>(1. - pred);
-        pred_raw = PredictRaw(source_id, negative_id);
-        if (noise_prob_func != nullptr) {
-            pred_raw -= noise_prob_func(negative_id);
+        T* negative_row = get_target_row(negative_id);
+        T noise = noise_prob_func != nullptr ? noise_prob_func(negative_id) : 0;
+
+        for (size_t b = 0; b < batch; ++b) {
+            // pred = Predict(source_id, negative_id);
+            // update_target(source_id, negative_id, alpha_ * decay * pred);
+            // logloss += -safe_log<T>(1. - pred);
+            const T* source_row = get_source_row(source_ids[b]);
+            T* grad_row = buffer + b * hidden_size_;
+
+            T pred_raw = predict_raw(source_row, negative_row) - noise;
+            T pred = sigmoid_table_[pred_raw];
+            logloss += -sigmoid_table_.LogSigmoid(-pred_raw);
+
+            T grad = alpha_ * decay * pred;
+            for (size_t i = 0; i < hidden_size_; ++i) {
+                grad_row[i] -= grad * negative_row[i];
+                negative_row[i] -= grad * source_row[i];
+            }
         }
-        pred = sigmoid_table_[pred_raw];
-        logloss += -sigmoid_table_.LogSigmoid(-pred_raw);
-        update_target(source_id, negative_id, alpha_ * decay * pred);
     }
 
-    update_source(source_id, buffer);
+    for (size_t b = 0; b < batch; ++b) {
+        T* source_row = get_source_row(source_ids[b]);
+        T* grad_row = buffer + b * hidden_size_;
+        for (size_t i = 0; i < hidden_size_; ++i) {
+            source_row[i] += grad_row[i];
+        }
+    }
 
     if (delete_buffer) {
         delete [] buffer;
@@ -332,9 +1135,98 @@ bool BiWord2VecTrainer<IdType, T>::Train(
     LossType method,
     unsigned seed
 ) {
+    if (options_.stream) {
+        if (options_.checkpoint_interval > 0 || options_.resume || !options_.init_model.empty() ||
+                options_.memory_budget > 0 || options_.workers > 1 || options_.partitions > 0) {
+            fprintf(stderr, "streaming training runs in memory in one process, "
+                "ignoring checkpoint, resume, init_model, partition and worker options\n");
+        }
+        return TrainStream(
+            input_path,
+            model_path,
+            alpha,
+            hidden_size,
+            iteration,
+            negative,
+            num_threads,
+            weight_neg_sampling,
+            weight_type,
+            method,
+            seed
+        );
+    }
+
+    if (options_.memory_budget > 0) {
+        if (options_.checkpoint_interval > 0 || options_.resume) {
+            fprintf(stderr, "checkpoints need in-memory training in one process, ignoring them\n");
+        }
+        if (options_.hot_targets > 0 || options_.hot_sources > 0) {
+            fprintf(stderr, "hot rows need in-memory training, "
+                "ignoring hot_rows, hot_sources and hot_sync\n");
+        }
+        return TrainOutOfCore(
+            input_path,
+            model_path,
+            alpha,
+            hidden_size,
+            iteration,
+            negative,
+            training_words,
+            num_threads,
+            weight_neg_sampling,
+            weight_type,
+            method,
+            seed
+        );
+    }
+
+    ThreadPool* pool = ThreadPool::Global();
+
     data_manager_->load_data(input_path, num_threads);
-    data_sampler_ = data_manager_->build_data_sampler(seed);
-    target_sampler_ = data_manager_->build_target_sampler(seed, weight_neg_sampling, weight_type);
+    if (data_manager_->size() == 0) {
+        fprintf(stderr, "no edges in %s\n", input_path);
+        return false;
+    }
+
+    size_t num_buckets = options_.partitions;
+    if (num_buckets == 0) {
+        num_buckets = EdgePartition<IdType, T>::BucketsForBudget(
+            data_manager_->source_size(),
+            data_manager_->target_size(),
+            hidden_size * sizeof(T),
+            options_.partition_budget
+        );
+    }
+
+    size_t num_workers = std::max(options_.workers, static_cast<size_t>(1));
+    if (num_workers > 1 && num_buckets > 1) {
+        fprintf(stderr, "partitioned training runs in one process, ignoring workers\n");
+        num_workers = 1;
+    }
+
+    EdgePartition<IdType, T>* partition = nullptr;
+    if (num_buckets > 1) {
+        std::vector<double> noise_weights = data_manager_->target_weights(weight_type);
+        for (size_t i = 0; i < noise_weights.size(); ++i) {
+            noise_weights[i] = pow(noise_weights[i], weight_neg_sampling);
+        }
+
+        partition = new EdgePartition<IdType, T>(num_buckets);
+        partition->Build(data_manager_, noise_weights, seed);
+        if (!(partition->total_weight() > 0)) {
+            fprintf(stderr, "the edges of %s have no positive weight\n", input_path);
+            delete partition;
+            return false;
+        }
+        printf("Partitioned training: %lu x %lu buckets\n", num_buckets, num_buckets);
+    } else {
+        // one after the other from this thread, so that the inner loops of
+        // both get the whole pool; from a worker they would run serially
+        if (num_workers == 1) {
+            data_sampler_ = data_manager_->build_data_sampler(seed);
+        }
+        target_sampler_ = data_manager_->build_target_sampler(seed, weight_neg_sampling, weight_type);
+    }
 
     BiWord2VecModel<T>* model = new BiWord2VecModel<T> (
         data_manager_->source_size(),
@@ -343,71 +1235,761 @@ bool BiWord2VecTrainer<IdType, T>::Train(
         alpha
     );
 
+    // worker processes share the model and the training context through
+    // POSIX shared memory segments
+    MmapFile* context_storage = nullptr;
+    std::string segment = "/biword2vec." + std::to_string(getpid());
+    if (num_workers > 1) {
+        context_storage = new MmapFile();
+        if (!model->MapStorage((segment + ".model").c_str(), true) ||
+                !context_storage->CreateShared((segment + ".context").c_str(), sizeof(TrainingContext))) {
+            fprintf(stderr, "failed to create shared memory segments %s.*\n", segment.c_str());
+            delete context_storage;
+            delete model;
+            return false;
+        }
+    }
+
     model->InitModel(seed);
+    if (!options_.init_model.empty() && !WarmStart(options_.init_model, model)) {
+        delete context_storage;
+        delete model;
+        return false;
+    }
 
     if (training_words == 0) {
         training_words = data_manager_->size();
     }
 
-    std::unordered_map<IdType, T> target_unigram_prob;
+    std::vector<T> target_unigram_prob;
     if (method == LOSS_NCE) {
-        T total_weight = 0;
-        for (size_t i = 0; i < data_manager_->size(); ++i) {
-            const Sample<IdType, T>* sample = data_manager_->SampleAt(i);
-            target_unigram_prob[sample->target()] += sample->weight();
-            total_weight += sample->weight();
+        std::vector<double> target_weights = data_manager_->target_weights(WEIGHT_FREQ);
+        double total_weight = 0;
+        for (size_t i = 0; i < target_weights.size(); ++i) {
+            total_weight += target_weights[i];
         }
 
         // for Noise-Constrastive Estimation: log(k * P_n(w))
-        for (auto iter = target_unigram_prob.begin(); iter != target_unigram_prob.end(); ++iter) {
-            iter->second = log(negative * iter->second / total_weight);
-        }
+        target_unigram_prob.resize(target_weights.size());
+        pool->ParallelFor(0, target_weights.size(), [&] (size_t, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                target_unigram_prob[i] = log(negative * target_weights[i] / total_weight);
+            }
+        });
     }
 
-    TrainingContext* context = new TrainingContext();
+    TrainingContext* context = nullptr;
+    if (context_storage != nullptr) {
+        context = new (context_storage->data()) TrainingContext();
+    } else {
+        context = new TrainingContext();
+    }
     context->model = model;
+    context->samples = data_manager_->SampleAt(0);
     context->training_words = training_words;
-    context->training_words_actual = 0;
     context->negative = negative;
     context->num_threads = num_threads;
     context->iteration = iteration;
+    context->chunk_size = std::max(options_.chunk_size, static_cast<size_t>(1));
+    context->batch_size = std::max(options_.batch_size, static_cast<size_t>(1));
+    context->prefetch_distance = options_.prefetch_distance;
+    context->seed = seed;
 
     if (method == LOSS_NCE) {
         context->target_noise_prob = &target_unigram_prob;
     }
 
-    num_threads = std::max(num_threads, static_cast<size_t>(1));
+    // a row is hot by its expected number of touches per edge: its share
+    // of the positives plus `negative` times its share of the negatives
+    HotRowSet hot_targets, hot_sources;
+    if (options_.hot_targets > 0) {
+        std::vector<double> positive = data_manager_->target_weights(WEIGHT_FREQ);
+        std::vector<double> noise = data_manager_->target_weights(weight_type);
+        double positive_total = 0, noise_total = 0;
+        for (size_t i = 0; i < noise.size(); ++i) {
+            noise[i] = pow(noise[i], weight_neg_sampling);
+            positive_total += positive[i];
+            noise_total += noise[i];
+        }
 
-    std::thread *threads = new std::thread[num_threads];
-    for (size_t i = 0; i < num_threads; ++i) {
-        threads[i] = std::thread(
-            &BiWord2VecTrainer<IdType, T>::TrainThread,
-            this,
-            i,
-            context
+        for (size_t i = 0; i < noise.size(); ++i) {
+            positive[i] = positive[i] / positive_total + negative * noise[i] / noise_total;
+        }
+
+        hot_targets.Build(positive, options_.hot_targets);
+        context->hot_targets = &hot_targets;
+    }
+
+    if (options_.hot_sources > 0) {
+        hot_sources.Build(data_manager_->source_weights(WEIGHT_FREQ), options_.hot_sources);
+        context->hot_sources = &hot_sources;
+    }
+    context->hot_sync_interval = std::max(options_.hot_sync_interval, static_cast<size_t>(1));
+
+    num_threads = std::max(num_threads, static_cast<size_t>(1));
+
+    std::string checkpoint_path = std::string(model_path) + ".ckpt";
+    CheckpointWriter<T>* checkpoint = nullptr;
+    if (options_.checkpoint_interval > 0 || options_.resume) {
+        if (partition != nullptr || num_workers > 1) {
+            fprintf(stderr, "checkpoints need in-memory training in one process, ignoring them\n");
+        } else {
+            if (options_.resume) {
+                Resume(checkpoint_path, context);
+            }
+
+            if (options_.checkpoint_interval > 0) {
+                checkpoint = new CheckpointWriter<T>(checkpoint_path);
+                CheckpointState<T>* state = checkpoint->state();
+                state->hidden_size = hidden_size;
+                state->training_words = training_words;
+                state->iteration = iteration;
+                state->seed = context->seed;
+                state->source_words.resize(data_manager_->source_size());
+                state->target_words.resize(data_manager_->target_size());
+                for (size_t i = 0; i < state->source_words.size(); ++i) {
+                    state->source_words[i] = data_manager_->SourceWordRef(i);
+                }
+                for (size_t i = 0; i < state->target_words.size(); ++i) {
+                    state->target_words[i] = data_manager_->TargetWordRef(i);
+                }
+
+                context->checkpoint = checkpoint;
+                context->checkpoint_interval = options_.checkpoint_interval;
+            }
+        }
+    }
+
+    bool trained = true;
+    if (partition != nullptr) {
+        TrainPartitioned(context, partition);
+        delete partition;
+    } else if (num_workers > 1) {
+        trained = TrainWorkers(context, num_workers, seed);
+    } else {
+        pool->Run([&] (size_t thread_id) {
+            TrainThread(thread_id, context);
+        }, num_threads);
+    }
+
+    if (trained) {
+        double loss = context->logloss / context->logloss_count;
+        printf("%cProgress: 100.00%%  Log-loss: %.4lf\n", 13, loss);
+    } else {
+        fprintf(stderr, "training failed, %s is not saved\n", model_path);
+    }
+
+    auto source_name = [&] (size_t sid) -> const std::string& {
+        return data_manager_->SourceWordRef(sid);
+    };
+
+    auto target_name = [&] (size_t tid) -> const std::string& {
+        return data_manager_->TargetWordRef(tid);
+    };
+
+    if (checkpoint != nullptr) {
+        checkpoint->Wait();
+        delete checkpoint;
+    }
+
+    if (trained) {
+        trained = model->Save(model_path, source_name, target_name,
+            options_.format, options_.encoding, options_.pq_subspaces);
+        if (!trained) {
+            fprintf(stderr, "failed to save %s\n", model_path);
+        } else if (options_.checkpoint_interval > 0 || options_.resume) {
+            // the run is complete, a later --resume must not pick it up again
+            remove(checkpoint_path.c_str());
+        }
+    }
+
+    if (context_storage != nullptr) {
+        context->~TrainingContext();
+        delete context_storage;
+    } else {
+        delete context;
+    }
+    delete model;
+    return trained;
+}
+
+template <typename IdType, typename T>
+bool BiWord2VecTrainer<IdType, T>::TrainStream(
+    const char* input_path,
+    const char* model_path,
+    T alpha,
+    size_t hidden_size,
+    size_t iteration,
+    size_t negative,
+    size_t num_threads,
+    double weight_neg_sampling,
+    WeightType weight_type,
+    LossType method,
+    unsigned seed
+) {
+    typedef Sample<IdType, T> sample_t;
+
+    bool from_stdin = strcmp(input_path, "-") == 0;
+    FILE* file_desc = from_stdin ? stdin : fopen(input_path, "r");
+    if (!file_desc) {
+        fprintf(stderr, "failed to open %s\n", input_path);
+        return false;
+    }
+
+    ThreadPool* pool = ThreadPool::Global();
+    num_threads = std::max(num_threads, static_cast<size_t>(1));
+    size_t block_size = std::max(options_.stream_block, static_cast<size_t>(1));
+    iteration = std::max(iteration, static_cast<size_t>(1));
+
+    BiWord2VecModel<T>* model = new BiWord2VecModel<T>(0, 0, hidden_size, alpha);
+
+    // popularity of every target seen so far, and the negative sampler
+    // drawing by popularity^weight_neg_sampling
+    std::vector<std::pair<size_t, double> > no_weights;
+    FenwickSampler negative_sampler(no_weights);
+    std::vector<double> popularity;
+    double total_popularity = 0;
+    std::vector<T> target_unigram_prob;
+
+    TrainingContext* context = new TrainingContext();
+    context->model = model;
+    context->negative = negative;
+    context->num_threads = num_threads;
+    context->chunk_size = std::max(options_.chunk_size, static_cast<size_t>(1));
+    context->batch_size = std::max(options_.batch_size, static_cast<size_t>(1));
+    context->prefetch_distance = options_.prefetch_distance;
+    context->hot_sync_interval = std::max(options_.hot_sync_interval, static_cast<size_t>(1));
+    if (method == LOSS_NCE) {
+        context->target_noise_prob = &target_unigram_prob;
+    }
+
+    auto source_name = [&] (size_t sid) -> const std::string& {
+        return data_manager_->SourceWordRef(sid);
+    };
+
+    auto target_name = [&] (size_t tid) -> const std::string& {
+        return data_manager_->TargetWordRef(tid);
+    };
+
+    // write to a temporary prefix and rename, so readers of the model
+    // never see a half written file; the files are renamed one at a time,
+    // a reader between two renames sees a torn pair (see --snapshot)
+    auto export_model = [&] () {
+        std::string tmp_path = std::string(model_path) + ".tmp";
+        bool saved = model->Save(tmp_path.c_str(), source_name, target_name,
+            options_.format, options_.encoding, options_.pq_subspaces);
+        std::vector<std::string> suffixes = {".source", ".target"};
+        if (options_.format == FORMAT_NPY) {
+            suffixes = {".source.npy", ".source.vocab", ".target.npy", ".target.vocab"};
+        }
+        for (const std::string& suffix : suffixes) {
+            if (saved) {
+                saved = rename((tmp_path + suffix).c_str(), (std::string(model_path) + suffix).c_str()) == 0;
+            } else {
+                remove((tmp_path + suffix).c_str());
+            }
+        }
+        if (!saved) {
+            fprintf(stderr, "\nfailed to save %s\n", model_path);
+        }
+        return saved;
+    };
+
+    std::vector<sample_t> block;
+    size_t num_blocks = 0;
+    size_t snapshots = 0;
+    size_t edges_read = 0;
+    while (data_manager_->read_samples(file_desc, block_size, &block) > 0) {
+        edges_read += block.size();
+        model->Grow(data_manager_->source_size(), data_manager_->target_size(), seed + num_blocks);
+
+        popularity.resize(data_manager_->target_size(), 0);
+        std::vector<std::pair<size_t, double> > data_weights(block.size());
+        for (size_t i = 0; i < block.size(); ++i) {
+            size_t target = block[i].target();
+            double weight = weight_type == WEIGHT_FREQ ? block[i].weight() : 1.;
+            popularity[target] += weight;
+            total_popularity += weight;
+            negative_sampler.Set(target, pow(popularity[target], weight_neg_sampling));
+            data_weights[i] = std::pair<size_t, double>(i, block[i].weight());
+        }
+
+        if (method == LOSS_NCE) {
+            // for Noise-Constrastive Estimation: log(k * P_n(w))
+            target_unigram_prob.resize(popularity.size());
+            pool->ParallelFor(0, popularity.size(), [&] (size_t, size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i) {
+                    target_unigram_prob[i] = log(negative * popularity[i] / total_popularity);
+                }
+            });
+        }
+
+        AliasSampler edge_sampler(data_weights);
+        size_t block_edges = block.size() * iteration;
+
+        context->samples = block.data();
+        context->seed = seed + num_blocks * 104729;
+        context->cursor = 0;
+        double block_logloss = 0;
+        size_t block_count = 0;
+
+        auto start = std::chrono::steady_clock::now();
+        pool->Run([&] (size_t thread_id) {
+            ThreadState state(thread_id, context);
+            double logloss = 0;
+            size_t count = 0;
+            while (true) {
+                size_t chunk_begin = context->cursor.fetch_add(context->chunk_size);
+                if (chunk_begin >= block_edges) {
+                    break;
+                }
+                size_t chunk_end = std::min(chunk_begin + context->chunk_size, block_edges);
+
+                TrainEdges(
+                    &state,
+                    context,
+                    &edge_sampler,
+                    &negative_sampler,
+                    chunk_end - chunk_begin,
+                    1.,
+                    &logloss,
+                    &count
+                );
+            }
+
+            std::lock_guard<SpinLock> lock(context->stats_lock);
+            block_logloss += logloss;
+            block_count += count;
+        }, num_threads);
+
+        double seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start
+        ).count();
+        printf(
+            "%cEdges: %lu  Sources: %lu  Targets: %lu  Log-loss: %.4lf  Words/sec: %.2lfk",
+            13, edges_read, model->source_size(), model->target_size(),
+            block_logloss / std::max(block_count, static_cast<size_t>(1)),
+            block_edges / std::max(seconds, 1e-6) / 1000
         );
+        fflush(stdout);
+
+        ++num_blocks;
+        if (options_.snapshot_interval > 0) {
+            double elapsed = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - context->start_time
+            ).count();
+            size_t due = static_cast<size_t>(elapsed / options_.snapshot_interval);
+            if (due > snapshots) {
+                snapshots = due;
+                export_model();
+            }
+        }
+    }
+
+    printf("\n");
+    if (!from_stdin) {
+        fclose(file_desc);
+    }
+
+    bool saved = export_model();
+
+    delete context;
+    delete model;
+    return saved;
+}
+
+template <typename IdType, typename T>
+bool BiWord2VecTrainer<IdType, T>::TrainWorkers(
+    TrainingContext* context,
+    size_t num_workers,
+    unsigned seed
+) {
+    size_t num_threads = std::max(context->num_threads, static_cast<size_t>(1));
+    std::vector<pid_t> pids;
+
+    // nothing buffered may be written twice by the children
+    fflush(stdout);
+    fflush(stderr);
+
+    for (size_t worker = 0; worker < num_workers; ++worker) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            break;
+        }
+
+        if (pid == 0) {
+            // the child has its own copy of the samples and samplers, and
+            // shares the model rows, the cursor and the stats with the others
+            ThreadPool* pool = ThreadPool::ResetGlobalAfterFork(num_threads, options_.pin_cpu);
+            data_sampler_ = data_manager_->build_data_sampler(seed + worker, worker, num_workers);
+
+            if (data_sampler_ != nullptr) {
+                pool->Run([&] (size_t thread_id) {
+                    TrainThread(worker * num_threads + thread_id, context);
+                }, num_threads);
+            }
+
+            fflush(stdout);
+            _exit(0);
+        }
+
+        pids.push_back(pid);
+    }
+
+    bool ret = pids.size() == num_workers;
+    for (size_t i = 0; i < pids.size(); ++i) {
+        int status = 0;
+        if (waitpid(pids[i], &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "worker %lu failed\n", i);
+            ret = false;
+        }
+    }
+
+    return ret;
+}
+
+template <typename IdType, typename T>
+BiWord2VecTrainer<IdType, T>::ThreadState::ThreadState(
+    size_t thread_id,
+    TrainingContext* context
+) : rng(context->seed + thread_id * 7919),
+    buffer(nullptr),
+    source_rows(nullptr),
+    target_rows(nullptr),
+    updates_since_sync(0),
+    noise_prob_func(nullptr) {
+    size_t hidden_size = context->model->hidden_size();
+    buffer = new T[context->batch_size * hidden_size + 1];
+
+    // batches are drawn `distance` steps ahead and resolved `resolve` steps
+    // ahead, one ring slot per batch in flight
+    ring.assign(
+        context->prefetch_distance + 1,
+        PendingBatch(context->batch_size, context->negative)
+    );
+
+    if (context->hot_targets != nullptr) {
+        target_rows = new HotRowReplica<T>(
+            context->hot_targets, context->model->target_hidden_, hidden_size);
+    }
+    if (context->hot_sources != nullptr) {
+        source_rows = new HotRowReplica<T>(
+            context->hot_sources, context->model->source_hidden_, hidden_size);
     }
 
+    if (context->target_noise_prob != nullptr) {
+        const std::vector<T>* noise_prob = context->target_noise_prob;
+        noise_prob_func = [noise_prob] (size_t id) {
+            if (id < noise_prob->size()) {
+                return (*noise_prob)[id];
+            }
+
+            return T();
+        };
+    }
+}
+
+template <typename IdType, typename T>
+BiWord2VecTrainer<IdType, T>::ThreadState::~ThreadState() {
+    Sync();
+    if (target_rows != nullptr) {
+        delete target_rows;
+    }
+    if (source_rows != nullptr) {
+        delete source_rows;
+    }
+
+    delete [] buffer;
+}
+
+template <typename IdType, typename T>
+void BiWord2VecTrainer<IdType, T>::ThreadState::Sync() {
+    if (target_rows != nullptr) {
+        target_rows->Sync();
+    }
+    if (source_rows != nullptr) {
+        source_rows->Sync();
+    }
+    updates_since_sync = 0;
+}
+
+template <typename IdType, typename T>
+bool BiWord2VecTrainer<IdType, T>::TrainOutOfCore(
+    const char* input_path,
+    const char* model_path,
+    T alpha,
+    size_t hidden_size,
+    size_t iteration,
+    size_t negative,
+    size_t training_words,
+    size_t num_threads,
+    double weight_neg_sampling,
+    WeightType weight_type,
+    LossType method,
+    unsigned seed
+) {
+    typedef Sample<IdType, T> sample_t;
+
+    ThreadPool* pool = ThreadPool::Global();
+    num_threads = std::max(num_threads, static_cast<size_t>(1));
+    size_t budget = options_.memory_budget;
+
+    // 1. build the vocabularies and the target weights, keep no edges
+    std::vector<std::vector<double> > freq_parts(num_threads);
+    std::vector<std::vector<double> > degree_parts(num_threads);
+    std::vector<size_t> edge_parts(num_threads, 0);
+    bool ret = data_manager_->scan_data(input_path, num_threads, [&] (size_t i, const sample_t& sample) {
+        size_t id = sample.target();
+        if (id >= freq_parts[i].size()) {
+            size_t size = std::max(id + 1, freq_parts[i].size() * 2);
+            freq_parts[i].resize(size, 0);
+            degree_parts[i].resize(size, 0);
+        }
+        freq_parts[i][id] += sample.weight();
+        degree_parts[i][id] += 1;
+        ++edge_parts[i];
+    });
+    if (!ret) {
+        return false;
+    }
+
+    size_t source_size = data_manager_->source_size();
+    size_t target_size = data_manager_->target_size();
+    size_t num_edges = 0;
+    std::vector<double> target_freq(target_size, 0);
+    std::vector<double> noise_weights(target_size, 0);
     for (size_t i = 0; i < num_threads; ++i) {
-        threads[i].join();
+        num_edges += edge_parts[i];
+        for (size_t id = 0; id < freq_parts[i].size() && id < target_size; ++id) {
+            target_freq[id] += freq_parts[i][id];
+            noise_weights[id] += degree_parts[i][id];
+        }
+        std::vector<double>().swap(freq_parts[i]);
+        std::vector<double>().swap(degree_parts[i]);
+    }
+
+    // pair shares and NCE noise are divided by the total weight
+    double total_weight = 0;
+    for (size_t id = 0; id < target_size; ++id) {
+        total_weight += target_freq[id];
+    }
+    if (num_edges == 0 || !(total_weight > 0)) {
+        fprintf(stderr, "the edges of %s have no positive weight\n", input_path);
+        return false;
+    }
+
+    if (weight_type == WEIGHT_FREQ) {
+        noise_weights = target_freq;
+    }
+    for (size_t id = 0; id < target_size; ++id) {
+        noise_weights[id] = pow(noise_weights[id], weight_neg_sampling);
+    }
+
+    // 2. half of the budget holds one source and one target bucket, a
+    // quarter the edges of the active chunk, a quarter the write buffers
+    size_t row_bytes = hidden_size * sizeof(T);
+    size_t num_buckets = std::max(
+        options_.partitions,
+        EdgePartition<IdType, T>::BucketsForBudget(source_size, target_size, row_bytes, budget / 2)
+    );
+    BucketRange source_range(source_size, num_buckets);
+    BucketRange target_range(target_size, num_buckets);
+    size_t chunk_edges = std::max(budget / 4 / sizeof(sample_t), static_cast<size_t>(1));
+
+    printf("Out-of-core training: %lu edges, %lu x %lu buckets\n",
+        num_edges, num_buckets, num_buckets);
+
+    EdgeStore<IdType, T> edge_store;
+    std::string edge_path = std::string(model_path) + ".edges";
+    if (!edge_store.Build(data_manager_, input_path, edge_path, num_threads,
+            source_range, target_range, budget / 4)) {
+        fprintf(stderr, "failed to write edge store %s\n", edge_path.c_str());
+        return false;
+    }
+
+    BiWord2VecModel<T>* model = new BiWord2VecModel<T> (
+        source_size,
+        target_size,
+        hidden_size,
+        alpha
+    );
+
+    std::string store_path = std::string(model_path) + ".store";
+    if (!model->MapStorage(store_path.c_str())) {
+        fprintf(stderr, "failed to map model store %s\n", store_path.c_str());
+        delete model;
+        return false;
+    }
+    model->InitModel(seed);
+    if (!options_.init_model.empty() && !WarmStart(options_.init_model, model)) {
+        delete model;
+        return false;
+    }
+
+    if (training_words == 0) {
+        training_words = num_edges;
+    }
+
+    std::vector<T> target_unigram_prob;
+    if (method == LOSS_NCE) {
+        // for Noise-Constrastive Estimation: log(k * P_n(w))
+        target_unigram_prob.resize(target_size);
+        for (size_t id = 0; id < target_size; ++id) {
+            target_unigram_prob[id] = log(negative * target_freq[id] / edge_store.total_weight());
+        }
+    }
+
+    TrainingContext* context = new TrainingContext();
+    context->model = model;
+    context->training_words = training_words;
+    context->negative = negative;
+    context->num_threads = num_threads;
+    context->iteration = iteration;
+    size_t total_words = training_words * iteration;
+
+    // edges per pass of every bucket pair, proportional to its weight
+    size_t num_pairs = num_buckets * num_buckets;
+    std::vector<size_t> pair_words(num_pairs, 0);
+    double cumulative = 0;
+    size_t assigned = 0;
+    for (size_t p = 0; p < num_pairs; ++p) {
+        cumulative += edge_store.pair_weight(p);
+        size_t until = static_cast<size_t>(training_words * cumulative / edge_store.total_weight());
+        if (p == num_pairs - 1) {
+            until = training_words;
+        }
+        pair_words[p] = until - std::min(until, assigned);
+        assigned = std::max(until, assigned);
+    }
+
+    std::vector<sample_t> edges;
+    std::vector<T> local_noise_prob;
+    size_t num_chunks = 0;
+    for (size_t iter = 0; iter < iteration; ++iter) {
+        for (size_t sb = 0; sb < num_buckets; ++sb) {
+            size_t source_begin = source_range.begin(sb);
+            size_t source_end = source_range.end(sb);
+            model->WillNeedRows(true, source_begin, source_end);
+
+            // snake through the target buckets, so that the last target
+            // bucket of one source bucket is the first of the next one
+            for (size_t k = 0; k < num_buckets; ++k) {
+                size_t tb = (sb % 2 == 0) ? k : num_buckets - 1 - k;
+                size_t p = sb * num_buckets + tb;
+                size_t target_begin = target_range.begin(tb);
+                size_t target_end = target_range.end(tb);
+
+                if (pair_words[p] > 0 && edge_store.pair_edges(p) > 0) {
+                    model->WillNeedRows(false, target_begin, target_end);
+
+                    BiWord2VecModel<T> view(
+                        source_end - source_begin,
+                        target_end - target_begin,
+                        hidden_size,
+                        alpha,
+                        model->source_hidden_ + source_begin * hidden_size,
+                        model->target_hidden_ + target_begin * hidden_size
+                    );
+
+                    std::vector<std::pair<size_t, double> > negative_weights;
+                    for (size_t id = target_begin; id < target_end; ++id) {
+                        negative_weights.push_back(
+                            std::pair<size_t, double>(id - target_begin, noise_weights[id]));
+                    }
+                    AliasSampler negative_sampler(negative_weights);
+
+                    if (method == LOSS_NCE) {
+                        local_noise_prob.assign(
+                            target_unigram_prob.begin() + target_begin,
+                            target_unigram_prob.begin() + target_end
+                        );
+                    }
+
+                    // stream the pair's edges in chunks that fit the budget
+                    size_t pair_edges = edge_store.pair_edges(p);
+                    size_t words_done = 0;
+                    for (size_t offset = 0; offset < pair_edges; offset += chunk_edges) {
+                        edges.resize(std::min(chunk_edges, pair_edges - offset));
+                        edges.resize(edge_store.Read(p, offset, edges.size(), edges.data()));
+
+                        std::vector<std::pair<size_t, double> > edge_weights(edges.size());
+                        for (size_t i = 0; i < edges.size(); ++i) {
+                            edge_weights[i] = std::pair<size_t, double>(i, edges[i].weight());
+                        }
+                        AliasSampler edge_sampler(edge_weights);
+
+                        size_t until = pair_words[p] * std::min(offset + chunk_edges, pair_edges) / pair_edges;
+                        size_t words = until - words_done;
+                        words_done = until;
+
+                        TrainingContext local;
+                        local.model = &view;
+                        local.samples = edges.data();
+                        local.negative = negative;
+                        local.chunk_size = std::max(options_.chunk_size, static_cast<size_t>(1));
+                        local.batch_size = std::max(options_.batch_size, static_cast<size_t>(1));
+                        local.prefetch_distance = options_.prefetch_distance;
+                        local.seed = seed + (num_chunks++) * 104729;
+                        if (method == LOSS_NCE) {
+                            local.target_noise_prob = &local_noise_prob;
+                        }
+
+                        pool->Run([&] (size_t thread_id) {
+                            ThreadState state(thread_id, &local);
+                            while (true) {
+                                size_t begin = local.cursor.fetch_add(local.chunk_size);
+                                if (begin >= words) {
+                                    break;
+                                }
+                                size_t n = std::min(local.chunk_size, words - begin);
+
+                                T alpha_decay = 1. - context->training_words_actual * 1. / (total_words + 1.);
+                                alpha_decay = std::max(static_cast<T>(0.0001), alpha_decay);
+
+                                double logloss = 0;
+                                size_t count = 0;
+                                TrainEdges(&state, &local, &edge_sampler, &negative_sampler,
+                                    n, alpha_decay, &logloss, &count);
+                                ReportProgress(context, n, logloss, count);
+                            }
+                        }, num_threads);
+                    }
+                }
+
+                if (k + 1 < num_buckets) {
+                    model->ReleaseRows(false, target_begin, target_end);
+                }
+            }
+
+            model->ReleaseRows(true, source_begin, source_end);
+        }
     }
+    std::vector<sample_t>().swap(edges);
+    edge_store.Remove();
 
-    double loss = context->logloss / context->logloss_count;
+    double loss = context->logloss / std::max(context->logloss_count, static_cast<size_t>(1));
     printf("%cProgress: 100.00%%  Log-loss: %.4lf\n", 13, loss);
 
-    auto source_name = [&] (size_t sid) {
-        return data_manager_->SourceWord(sid);
+    auto source_name = [&] (size_t sid) -> const std::string& {
+        return data_manager_->SourceWordRef(sid);
     };
 
-    auto target_name = [&] (size_t tid) {
-        return data_manager_->TargetWord(tid);
+    auto target_name = [&] (size_t tid) -> const std::string& {
+        return data_manager_->TargetWordRef(tid);
     };
 
-    model->Save(model_path, source_name, target_name);
+    bool saved = model->Save(model_path, source_name, target_name,
+        options_.format, options_.encoding, options_.pq_subspaces);
+    if (!saved) {
+        fprintf(stderr, "failed to save %s\n", model_path);
+    }
+    printf("Peak RSS: %.2lfMB\n", util_peak_rss() / 1048576.);
 
     delete context;
     delete model;
-    return true;
+    unlink(store_path.c_str());
+    return saved;
 }
 
 template <typename IdType, typename T>
@@ -415,73 +1997,414 @@ void BiWord2VecTrainer<IdType, T>::TrainThread(
     size_t thread_id,
     TrainingContext* context
 ) {
-    size_t hidden_size = context->model->hidden_size();
-    T* buffer = new T[hidden_size + 1];
+    ThreadState state(thread_id, context);
+    size_t total_words = context->training_words * context->iteration;
+    size_t chunk_size = context->chunk_size;
+
+    while (true) {
+        // take the next chunk from the shared cursor, so that slow threads
+        // simply process fewer chunks instead of holding up the others
+        size_t chunk_begin = context->cursor.fetch_add(chunk_size);
+        if (chunk_begin >= total_words) {
+            break;
+        }
+        size_t chunk_end = std::min(chunk_begin + chunk_size, total_words);
+
+        // decay by global position, which covers the work of all threads
+        T alpha_decay = 1. - chunk_begin * 1. / (total_words + 1.);
+        alpha_decay = std::max(static_cast<T>(0.0001), alpha_decay);
+
+        double logloss = 0;
+        size_t count = 0;
+        TrainEdges(
+            &state,
+            context,
+            data_sampler_,
+            target_sampler_,
+            chunk_end - chunk_begin,
+            alpha_decay,
+            &logloss,
+            &count
+        );
 
-    size_t iteration = context->iteration;
-    size_t num_threads = context->num_threads;
-    size_t training_words = context->training_words;
-    size_t local_training_words = (training_words * iteration + num_threads - 1) / num_threads;
-    size_t negative = context->negative;
+        ReportProgress(context, chunk_end - chunk_begin, logloss, count);
+    }
+}
 
-    typename NoiseProbFunctionType<size_t, T>::Type noise_prob_func = nullptr;
-    if (context->target_noise_prob != nullptr) {
-        noise_prob_func = [&] (size_t id) {
-            auto iter = context->target_noise_prob->find(id);
-            if (iter != context->target_noise_prob->end()) {
-                return iter->second;
+template <typename IdType, typename T>
+void BiWord2VecTrainer<IdType, T>::TrainPartitioned(
+    TrainingContext* context,
+    EdgePartition<IdType, T>* partition
+) {
+    ThreadPool* pool = ThreadPool::Global();
+    size_t num_threads = std::max(context->num_threads, static_cast<size_t>(1));
+    size_t num_buckets = partition->num_buckets();
+    size_t num_pairs = num_buckets * num_buckets;
+    size_t total_words = context->training_words * context->iteration;
+
+    // edges per pass of every bucket pair, proportional to its weight
+    std::vector<size_t> pair_words(num_pairs, 0);
+    double cumulative = 0;
+    size_t assigned = 0;
+    for (size_t p = 0; p < num_pairs; ++p) {
+        cumulative += partition->pair_weight(p);
+        size_t until = static_cast<size_t>(
+            context->training_words * cumulative / partition->total_weight());
+        if (p == num_pairs - 1) {
+            until = context->training_words;
+        }
+        pair_words[p] = until - std::min(until, assigned);
+        assigned = std::max(until, assigned);
+    }
+
+    std::vector<ThreadState*> states(num_threads, nullptr);
+    pool->Run([&] (size_t thread_id) {
+        states[thread_id] = new ThreadState(thread_id, context);
+    }, num_threads);
+
+    for (size_t iter = 0; iter < context->iteration; ++iter) {
+        // round r trains the pairs (b, b + r), which share no source and no
+        // target bucket; a pair is trained by one thread, chunk by chunk, so
+        // concurrent threads never touch the same rows. The heaviest pairs
+        // are taken first
+        for (size_t round = 0; round < num_buckets; ++round) {
+            std::vector<size_t> pairs;
+            for (size_t b = 0; b < num_buckets; ++b) {
+                size_t p = partition->pair(b, (b + round) % num_buckets);
+                if (partition->edge_sampler(p) != nullptr && pair_words[p] > 0) {
+                    pairs.push_back(p);
+                }
+            }
+            std::sort(pairs.begin(), pairs.end(), [&] (size_t a, size_t b) {
+                return pair_words[a] > pair_words[b];
+            });
+            if (pairs.empty()) {
+                continue;
             }
 
-            return T();
-        };
+            std::atomic<size_t> next_pair(0);
+            pool->Run([&] (size_t thread_id) {
+                while (true) {
+                    size_t k = next_pair.fetch_add(1);
+                    if (k >= pairs.size()) {
+                        break;
+                    }
+
+                    size_t p = pairs[k];
+                    for (size_t done = 0; done < pair_words[p]; done += context->chunk_size) {
+                        size_t words = std::min(context->chunk_size, pair_words[p] - done);
+                        T alpha_decay = 1. - context->training_words_actual * 1. / (total_words + 1.);
+                        alpha_decay = std::max(static_cast<T>(0.0001), alpha_decay);
+
+                        double logloss = 0;
+                        size_t count = 0;
+                        TrainEdges(
+                            states[thread_id],
+                            context,
+                            partition->edge_sampler(p),
+                            partition->negative_sampler(p % num_buckets),
+                            words,
+                            alpha_decay,
+                            &logloss,
+                            &count
+                        );
+
+                        ReportProgress(context, words, logloss, count);
+                    }
+                }
+            }, std::min(num_threads, pairs.size()));
+        }
     }
 
-    size_t last_word_count = 0;
-    T alpha_decay = 1;
-    T logloss = 0;
-    size_t count = 0;
-    for (size_t i = 0; i < local_training_words; ++i) {
-        size_t sample_id = data_sampler_->sampling();
-        const Sample<IdType, T>* sample = data_manager_->SampleAt(sample_id);
-        size_t source_id = sample->source();
-        size_t target_id = sample->target();
-
-        if (i - last_word_count > 10000 || i == local_training_words - 1) {
-            context->logloss += logloss;
-            context->logloss_count += count;
-            context->training_words_actual += i - last_word_count;
-            last_word_count = i;
-            count = 0;
-            logloss = 0;
-            alpha_decay = 1. - context->training_words_actual * 1. /
-                (context->training_words * iteration + 1.);
-            alpha_decay = std::max(static_cast<T>(0.0001), alpha_decay);
-
-            double progress = context->training_words_actual * 1. /
-                (context->training_words * iteration);
-            double loss = context->logloss / context->logloss_count;
-            printf("%cProgress: %.2lf%%  Log-loss: %.4lf", 13, progress * 100, loss);
-            fflush(stdout);
+    for (size_t i = 0; i < num_threads; ++i) {
+        delete states[i];
+    }
+}
+
+template <typename IdType, typename T>
+void BiWord2VecTrainer<IdType, T>::TrainEdges(
+    ThreadState* state,
+    TrainingContext* context,
+    BaseSampler* edge_sampler,
+    BaseSampler* negative_sampler,
+    size_t num_edges,
+    T alpha_decay,
+    double* logloss,
+    size_t* count
+) {
+    BiWord2VecModel<T>* model = context->model;
+    size_t batch_size = context->batch_size;
+    size_t negative = context->negative;
+    std::vector<PendingBatch>& ring = state->ring;
+
+    // batches are drawn `distance` steps ahead, which prefetches their
+    // samples and negative rows, and resolved `resolve` steps ahead, which
+    // reads the samples and prefetches the source and target rows
+    size_t distance = context->prefetch_distance;
+    size_t resolve = (distance + 1) / 2;
+    bool prefetch = distance > 0;
+    size_t num_batches = (num_edges + batch_size - 1) / batch_size;
+
+    auto draw = [&] (size_t n) {
+        PendingBatch& pending = ring[n % ring.size()];
+        pending.size = std::min(batch_size, num_edges - n * batch_size);
+        for (size_t b = 0; b < pending.size; ++b) {
+            pending.sample_ids[b] = edge_sampler->sampling(state->rng);
+            if (prefetch) {
+                util_prefetch(
+                    context->samples + pending.sample_ids[b],
+                    sizeof(Sample<IdType, T>)
+                );
+            }
         }
 
-        std::vector<size_t> negative_targets;
+        // with batch_size > 1 all edges of the batch share the negatives
         for (size_t j = 0; j < negative; ++j) {
-            size_t negative_id = target_sampler_->sampling();
-            negative_targets.push_back(negative_id);
+            pending.negative_targets[j] = negative_sampler->sampling(state->rng);
+            if (prefetch) {
+                model->PrefetchTarget(pending.negative_targets[j], state->target_rows);
+            }
+        }
+    };
+
+    auto resolve_samples = [&] (size_t n) {
+        PendingBatch& pending = ring[n % ring.size()];
+        for (size_t b = 0; b < pending.size; ++b) {
+            const Sample<IdType, T>* sample = context->samples + pending.sample_ids[b];
+            pending.source_ids[b] = sample->source();
+            pending.target_ids[b] = sample->target();
+            if (prefetch) {
+                model->PrefetchSource(pending.source_ids[b], state->source_rows);
+                model->PrefetchTarget(pending.target_ids[b], state->target_rows);
+            }
         }
+    };
 
-        logloss += context->model->Update(
-            source_id,
-            target_id,
-            negative_targets,
-            noise_prob_func,
+    for (size_t n = 0; n < std::min(distance, num_batches); ++n) {
+        draw(n);
+    }
+    for (size_t n = 0; n < std::min(resolve, num_batches); ++n) {
+        resolve_samples(n);
+    }
+
+    for (size_t n = 0; n < num_batches; ++n) {
+        if (n + distance < num_batches) {
+            draw(n + distance);
+        }
+        if (n + resolve < num_batches) {
+            resolve_samples(n + resolve);
+        }
+
+        PendingBatch& pending = ring[n % ring.size()];
+        *logloss += model->UpdateBatch(
+            pending.source_ids.data(),
+            pending.target_ids.data(),
+            pending.size,
+            pending.negative_targets,
+            state->noise_prob_func,
             alpha_decay,
-            buffer
+            state->buffer,
+            state->source_rows,
+            state->target_rows
         );
-        count += 1 + negative;
+        *count += pending.size * (1 + negative);
+
+        state->updates_since_sync += pending.size;
+        if (state->updates_since_sync >= context->hot_sync_interval) {
+            state->Sync();
+        }
     }
+}
 
-    delete [] buffer;
+template <typename IdType, typename T>
+void BiWord2VecTrainer<IdType, T>::ReportProgress(
+    TrainingContext* context,
+    size_t words,
+    double logloss,
+    size_t count
+) {
+    size_t words_actual = context->training_words_actual.fetch_add(words) + words;
+
+    double loss = 0;
+    {
+        std::lock_guard<SpinLock> lock(context->stats_lock);
+        context->logloss += logloss;
+        context->logloss_count += count;
+        loss = context->logloss / std::max(context->logloss_count, static_cast<size_t>(1));
+    }
+
+    double progress = words_actual * 1. /
+        (context->training_words * context->iteration);
+    double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - context->start_time
+    ).count();
+    double words_per_sec = (words_actual - context->resumed_words) / std::max(seconds, 1e-6);
+
+    printf(
+        "%cProgress: %.2lf%%  Log-loss: %.4lf  Words/sec: %.2lfk",
+        13, progress * 100, loss, words_per_sec / 1000
+    );
+    fflush(stdout);
+
+    TakeCheckpoint(context, seconds);
+}
+
+template <typename IdType, typename T>
+void BiWord2VecTrainer<IdType, T>::TakeCheckpoint(TrainingContext* context, double seconds) {
+    if (context->checkpoint == nullptr) {
+        return;
+    }
+
+    size_t due = static_cast<size_t>(seconds / context->checkpoint_interval);
+    size_t taken = context->checkpoints.load();
+    if (due <= taken || !context->checkpoints.compare_exchange_strong(taken, due)) {
+        return;
+    }
+
+    // skipped while the previous checkpoint is still being written
+    CheckpointState<T>* state = context->checkpoint->Acquire();
+    if (state == nullptr) {
+        return;
+    }
+
+    // the copy is taken Hogwild style while the other threads keep
+    // training, the disk write happens on the writer thread
+    BiWord2VecModel<T>* model = context->model;
+    state->words_done = context->training_words_actual.load();
+    {
+        std::lock_guard<SpinLock> lock(context->stats_lock);
+        state->logloss = context->logloss;
+        state->logloss_count = context->logloss_count;
+    }
+
+    size_t hidden_size = model->hidden_size();
+    state->source_hidden.assign(
+        model->source_hidden_, model->source_hidden_ + model->source_size() * hidden_size);
+    state->target_hidden.assign(
+        model->target_hidden_, model->target_hidden_ + model->target_size() * hidden_size);
+
+    context->checkpoint->Commit();
+}
+
+template <typename IdType, typename T>
+bool BiWord2VecTrainer<IdType, T>::Resume(const std::string& path, TrainingContext* context) {
+    CheckpointState<T> state;
+    if (!LoadCheckpoint(path, &state)) {
+        fprintf(stderr, "no usable checkpoint at %s, training from scratch\n", path.c_str());
+        return false;
+    }
+
+    BiWord2VecModel<T>* model = context->model;
+    size_t hidden_size = model->hidden_size();
+    if (state.hidden_size != hidden_size ||
+            state.training_words != context->training_words ||
+            state.iteration != context->iteration) {
+        fprintf(stderr, "checkpoint %s was written with other --hidden/--words/--iter, "
+            "training from scratch\n", path.c_str());
+        return false;
+    }
+
+    CopyRows(state, model);
+
+    context->cursor = state.words_done;
+    context->training_words_actual = state.words_done;
+    context->resumed_words = state.words_done;
+    context->logloss = state.logloss;
+    context->logloss_count = state.logloss_count;
+    // fresh random streams, instead of replaying the draws of the first run
+    context->seed = state.seed + static_cast<unsigned>(state.words_done);
+
+    printf("Resumed from %s at %.2lf%%\n", path.c_str(),
+        state.words_done * 100. / (state.training_words * state.iteration));
+    return true;
+}
+
+template <typename IdType, typename T>
+void BiWord2VecTrainer<IdType, T>::CopyRows(
+    const CheckpointState<T>& state,
+    BiWord2VecModel<T>* model
+) {
+    size_t hidden_size = model->hidden_size();
+
+    // ids depend on the order the parser threads met the words in, so
+    // rows are matched by word rather than by id
+    ThreadPool* pool = ThreadPool::Global();
+    pool->ParallelFor(0, state.source_words.size(), [&] (size_t, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            size_t id = data_manager_->SourceId(state.source_words[i]);
+            if (id < model->source_size()) {
+                std::copy(
+                    &state.source_hidden[i * hidden_size],
+                    &state.source_hidden[(i + 1) * hidden_size],
+                    model->source_hidden_ + id * hidden_size
+                );
+            }
+        }
+    });
+
+    pool->ParallelFor(0, state.target_words.size(), [&] (size_t, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            size_t id = data_manager_->TargetId(state.target_words[i]);
+            if (id < model->target_size()) {
+                std::copy(
+                    &state.target_hidden[i * hidden_size],
+                    &state.target_hidden[(i + 1) * hidden_size],
+                    model->target_hidden_ + id * hidden_size
+                );
+            }
+        }
+    });
+
+    model->ReleaseRows(true, 0, model->source_size());
+    model->ReleaseRows(false, 0, model->target_size());
+}
+
+template <typename IdType, typename T>
+bool BiWord2VecTrainer<IdType, T>::WarmStart(
+    const std::string& path,
+    BiWord2VecModel<T>* model
+) {
+    size_t source_loaded = 0, target_loaded = 0;
+
+    CheckpointState<T> state;
+    if (LoadCheckpoint(path, &state)) {
+        if (state.hidden_size != model->hidden_size()) {
+            fprintf(stderr, "%s has hidden size %lu, not %lu\n",
+                path.c_str(), state.hidden_size, model->hidden_size());
+            return false;
+        }
+
+        CopyRows(state, model);
+        for (size_t i = 0; i < state.source_words.size(); ++i) {
+            source_loaded += data_manager_->SourceId(state.source_words[i]) != WordTable::npos;
+        }
+        for (size_t i = 0; i < state.target_words.size(); ++i) {
+            target_loaded += data_manager_->TargetId(state.target_words[i]) != WordTable::npos;
+        }
+    } else {
+        auto source_id = [&] (const std::string& word) {
+            return data_manager_->SourceId(word);
+        };
+
+        auto target_id = [&] (const std::string& word) {
+            return data_manager_->TargetId(word);
+        };
+
+        // both files are independent, read them concurrently
+        auto source_done = ThreadPool::Global()->Submit([&] () {
+            return model->LoadMatrix(path + ".source", true, source_id, &source_loaded);
+        });
+        bool ok = model->LoadMatrix(path + ".target", false, target_id, &target_loaded);
+        if (!source_done.get() || !ok) {
+            fprintf(stderr, "failed to load %s.source/.target with hidden size %lu\n",
+                path.c_str(), model->hidden_size());
+            return false;
+        }
+    }
+
+    printf("Warm start from %s: %lu of %lu sources, %lu of %lu targets\n",
+        path.c_str(), source_loaded, model->source_size(), target_loaded, model->target_size());
+    return true;
 }
 
 #endif // SRC_BIWORD2VEC_H
@@ -0,0 +1,307 @@
+#ifndef SRC_CHECKPOINT_H
+#define SRC_CHECKPOINT_H
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+static const char CHECKPOINT_MAGIC[8] = {'B', 'W', '2', 'V', 'C', 'K', 'P', '1'};
+
+// Everything needed to continue an interrupted training run: both
+// matrices, the vocabularies their rows belong to, and the progress.
+template <typename T>
+struct CheckpointState {
+    size_t hidden_size;
+    size_t training_words;
+    size_t iteration;
+    unsigned seed;
+    // edges trained so far, counted over all iterations
+    size_t words_done;
+    double logloss;
+    size_t logloss_count;
+
+    std::vector<std::string> source_words;
+    std::vector<std::string> target_words;
+    std::vector<T> source_hidden;
+    std::vector<T> target_hidden;
+
+    CheckpointState()
+    : hidden_size(0),
+      training_words(0),
+      iteration(1),
+      seed(1),
+      words_done(0),
+      logloss(0),
+      logloss_count(0) {
+    }
+};
+
+// write state to path.tmp and rename it to path, so that a crash while
+// writing never destroys the previous checkpoint
+template <typename T>
+bool SaveCheckpoint(const std::string& path, const CheckpointState<T>& state);
+
+template <typename T>
+bool LoadCheckpoint(const std::string& path, CheckpointState<T>* state);
+
+// Writes checkpoints on a background thread. Training threads fill the
+// snapshot returned by Acquire() and hand it over with Commit(); while a
+// snapshot is being written Acquire() returns nullptr and the checkpoint
+// is simply skipped, so training never waits for the disk.
+template <typename T>
+class CheckpointWriter {
+public:
+    explicit CheckpointWriter(const std::string& path);
+    virtual ~CheckpointWriter();
+
+    CheckpointState<T>* Acquire();
+
+    void Commit();
+
+    // wait until the last committed snapshot is on disk
+    void Wait();
+
+public:
+    // the snapshot buffer, its vocabularies are filled once by the owner
+    inline CheckpointState<T>* state() {
+        return &state_;
+    }
+
+private:
+    void WriterLoop();
+
+private:
+    std::string path_;
+    CheckpointState<T> state_;
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    bool busy_;
+    bool committed_;
+    bool stop_;
+};
+
+namespace checkpoint_io {
+
+template <typename V>
+inline bool Write(FILE* fp, const V& value) {
+    return fwrite(&value, sizeof(V), 1, fp) == 1;
+}
+
+template <typename V>
+inline bool Read(FILE* fp, V* value) {
+    return fread(value, sizeof(V), 1, fp) == 1;
+}
+
+inline bool WriteWords(FILE* fp, const std::vector<std::string>& words) {
+    if (!Write(fp, static_cast<uint64_t>(words.size()))) {
+        return false;
+    }
+    for (size_t i = 0; i < words.size(); ++i) {
+        uint32_t len = static_cast<uint32_t>(words[i].size());
+        if (!Write(fp, len) || fwrite(words[i].data(), 1, len, fp) != len) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// bytes between the position of fp and the end of its file, so that no
+// count read from a corrupt file allocates more than the file could hold
+inline uint64_t Remaining(FILE* fp) {
+    struct stat st;
+    long pos = ftell(fp);
+    if (pos < 0 || fstat(fileno(fp), &st) != 0 || st.st_size < pos) {
+        return 0;
+    }
+    return static_cast<uint64_t>(st.st_size - pos);
+}
+
+inline bool ReadWords(FILE* fp, std::vector<std::string>* words) {
+    uint64_t size = 0;
+    if (!Read(fp, &size) || size > Remaining(fp) / sizeof(uint32_t)) {
+        return false;
+    }
+    words->resize(size);
+    for (size_t i = 0; i < size; ++i) {
+        uint32_t len = 0;
+        if (!Read(fp, &len) || len > Remaining(fp)) {
+            return false;
+        }
+        (*words)[i].resize(len);
+        if (len > 0 && fread(&(*words)[i][0], 1, len, fp) != len) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template <typename T>
+inline bool WriteMatrix(FILE* fp, const std::vector<T>& matrix) {
+    return fwrite(matrix.data(), sizeof(T), matrix.size(), fp) == matrix.size();
+}
+
+template <typename T>
+inline bool ReadMatrix(FILE* fp, uint64_t rows, uint64_t cols, std::vector<T>* matrix) {
+    uint64_t remaining = Remaining(fp) / sizeof(T);
+    if (cols > remaining || (cols > 0 && rows > remaining / cols)) {
+        return false;
+    }
+    matrix->resize(rows * cols);
+    return fread(matrix->data(), sizeof(T), matrix->size(), fp) == matrix->size();
+}
+
+} // namespace checkpoint_io
+
+template <typename T>
+bool SaveCheckpoint(const std::string& path, const CheckpointState<T>& state) {
+    using namespace checkpoint_io;
+
+    std::string tmp_path = path + ".tmp";
+    FILE* fp = fopen(tmp_path.c_str(), "wb");
+    if (!fp) {
+        return false;
+    }
+
+    bool ok = fwrite(CHECKPOINT_MAGIC, 1, sizeof(CHECKPOINT_MAGIC), fp) == sizeof(CHECKPOINT_MAGIC) &&
+        Write(fp, static_cast<uint32_t>(sizeof(T))) &&
+        Write(fp, static_cast<uint64_t>(state.hidden_size)) &&
+        Write(fp, static_cast<uint64_t>(state.training_words)) &&
+        Write(fp, static_cast<uint64_t>(state.iteration)) &&
+        Write(fp, static_cast<uint32_t>(state.seed)) &&
+        Write(fp, static_cast<uint64_t>(state.words_done)) &&
+        Write(fp, state.logloss) &&
+        Write(fp, static_cast<uint64_t>(state.logloss_count)) &&
+        WriteWords(fp, state.source_words) &&
+        WriteWords(fp, state.target_words) &&
+        WriteMatrix(fp, state.source_hidden) &&
+        WriteMatrix(fp, state.target_hidden);
+
+    // on disk before the rename, a crash must not leave an empty checkpoint
+    ok = ok && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        remove(tmp_path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+template <typename T>
+bool LoadCheckpoint(const std::string& path, CheckpointState<T>* state) {
+    using namespace checkpoint_io;
+
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (!fp) {
+        return false;
+    }
+
+    char magic[sizeof(CHECKPOINT_MAGIC)];
+    uint32_t value_size = 0, seed = 0;
+    uint64_t hidden_size = 0, training_words = 0, iteration = 0;
+    uint64_t words_done = 0, logloss_count = 0;
+
+    bool ok = fread(magic, 1, sizeof(magic), fp) == sizeof(magic) &&
+        memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic)) == 0 &&
+        Read(fp, &value_size) && value_size == sizeof(T) &&
+        Read(fp, &hidden_size) &&
+        Read(fp, &training_words) &&
+        Read(fp, &iteration) &&
+        Read(fp, &seed) &&
+        Read(fp, &words_done) &&
+        Read(fp, &state->logloss) &&
+        Read(fp, &logloss_count) &&
+        ReadWords(fp, &state->source_words) &&
+        ReadWords(fp, &state->target_words) &&
+        ReadMatrix(fp, state->source_words.size(), hidden_size, &state->source_hidden) &&
+        ReadMatrix(fp, state->target_words.size(), hidden_size, &state->target_hidden);
+
+    fclose(fp);
+    if (!ok) {
+        return false;
+    }
+
+    state->hidden_size = hidden_size;
+    state->training_words = training_words;
+    state->iteration = iteration;
+    state->seed = seed;
+    state->words_done = words_done;
+    state->logloss_count = logloss_count;
+    return true;
+}
+
+template <typename T>
+CheckpointWriter<T>::CheckpointWriter(const std::string& path)
+: path_(path), busy_(false), committed_(false), stop_(false) {
+    thread_ = std::thread(&CheckpointWriter<T>::WriterLoop, this);
+}
+
+template <typename T>
+CheckpointWriter<T>::~CheckpointWriter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cond_.notify_all();
+    thread_.join();
+}
+
+template <typename T>
+CheckpointState<T>* CheckpointWriter<T>::Acquire() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (busy_) {
+        return nullptr;
+    }
+
+    busy_ = true;
+    return &state_;
+}
+
+template <typename T>
+void CheckpointWriter<T>::Commit() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        committed_ = true;
+    }
+    cond_.notify_all();
+}
+
+template <typename T>
+void CheckpointWriter<T>::Wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [this] () { return !busy_; });
+}
+
+template <typename T>
+void CheckpointWriter<T>::WriterLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        cond_.wait(lock, [this] () { return stop_ || committed_; });
+        if (!committed_) {
+            break;
+        }
+
+        // the snapshot is owned by this thread until busy_ is cleared
+        lock.unlock();
+        if (!SaveCheckpoint(path_, state_)) {
+            fprintf(stderr, "\nfailed to write checkpoint %s\n", path_.c_str());
+        }
+        lock.lock();
+
+        committed_ = false;
+        busy_ = false;
+        cond_.notify_all();
+    }
+}
+
+#endif // SRC_CHECKPOINT_H
+/* vim: set ts=4 sw=4 tw=0 et :*/
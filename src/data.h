@@ -2,12 +2,14 @@
 #define SRC_DATA_H
 
 #include <cstring>
+#include <functional>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include "src/lock.h"
 #include "src/sampler.h"
+#include "src/thread_pool.h"
 #include "src/util.h"
 #include "src/word_table.h"
 
@@ -62,13 +64,47 @@ public:
 
     bool load_data(const std::string& path, size_t num_threads = 1);
 
+    // parse every line of path and pass the sample to func(thread_id, sample)
+    // without keeping it, the vocabularies are still built
+    bool scan_data(
+        const std::string& path,
+        size_t num_threads,
+        std::function<void(size_t, const Sample<IdType, T>&)> func
+    );
+
+    // parse up to max_samples lines of an open stream (e.g. stdin) into
+    // samples, which replaces its content; the vocabularies grow as new
+    // words arrive, the samples are not kept. Returns the number read,
+    // 0 at the end of the stream
+    size_t read_samples(
+        FILE* file_desc,
+        size_t max_samples,
+        std::vector<Sample<IdType, T> >* samples
+    );
+
     const Sample<IdType, T>* SampleAt(size_t pos);
 
     std::string SourceWord(IdType pos);
 
     std::string TargetWord(IdType pos);
 
-    BaseSampler* build_data_sampler(unsigned seed = 1);
+    // lock-free views for readers that run after the vocabularies are
+    // complete, e.g. model export
+    const std::string& SourceWordRef(IdType pos) const;
+
+    const std::string& TargetWordRef(IdType pos) const;
+
+    // id of a known word, WordTable::npos otherwise
+    size_t SourceId(const std::string& word) const;
+
+    size_t TargetId(const std::string& word) const;
+
+    // samples the edges i with i % num_shards == shard
+    BaseSampler* build_data_sampler(
+        unsigned seed = 1,
+        size_t shard = 0,
+        size_t num_shards = 1
+    );
 
     BaseSampler* build_target_sampler(
         unsigned seed = 1,
@@ -76,6 +112,12 @@ public:
         WeightType weight_type = WEIGHT_FREQ
     );
 
+    // total weight (or in-degree) of every target id, indexed by id
+    std::vector<double> target_weights(WeightType weight_type = WEIGHT_FREQ);
+
+    // total weight (or out-degree) of every source id, indexed by id
+    std::vector<double> source_weights(WeightType weight_type = WEIGHT_FREQ);
+
     inline size_t size() {
         return samples_.size();
     }
@@ -91,6 +133,8 @@ public:
 private:
     bool parse_data(char* input_buf, Sample<IdType, T>* sample);
 
+    std::vector<double> vertex_weights(bool by_target, WeightType weight_type);
+
 private:
     std::vector<Sample<IdType, T> > samples_;
     WordTable source_words_;
@@ -110,19 +154,33 @@ bool DataManager<IdType, T>::load_data(
         const std::string& path,
         size_t num_threads
     ) {
+    size_t num_of_lines = count_file_lines(path.c_str());
+    samples_.reserve(num_of_lines);
+    source_words_.reserve(num_of_lines);
+    target_words_.reserve(num_of_lines);
+
+    SpinLock sample_lock;
+    auto add_sample = [&] (size_t, const Sample<IdType, T>& sample) {
+        std::lock_guard<SpinLock> lock(sample_lock);
+        samples_.push_back(sample);
+    };
+
+    return scan_data(path, num_threads, add_sample);
+}
+
+template <typename IdType, typename T>
+bool DataManager<IdType, T>::scan_data(
+    const std::string& path,
+    size_t num_threads,
+    std::function<void(size_t, const Sample<IdType, T>&)> func
+) {
     FILE* file_desc = fopen(path.c_str(), "r");
 
     if (!file_desc) {
         return false;
     }
 
-    size_t num_of_lines = count_file_lines(path.c_str());
-    samples_.reserve(num_of_lines);
-    source_words_.reserve(num_of_lines);
-    target_words_.reserve(num_of_lines);
-
     SpinLock file_lock;
-    SpinLock sample_lock;
     auto parser_thread = [&] (size_t i) {
         char* thread_buf = new char[BUF_SIZE];
         char* ptr = nullptr;
@@ -142,8 +200,7 @@ bool DataManager<IdType, T>::load_data(
             bool ret = parse_data(thread_buf, &sample);
 
             if (ret) {
-                std::lock_guard<SpinLock> lock(sample_lock);
-                samples_.push_back(std::move(sample));
+                func(i, sample);
             }
         }
 
@@ -155,6 +212,31 @@ bool DataManager<IdType, T>::load_data(
     return true;
 }
 
+template <typename IdType, typename T>
+size_t DataManager<IdType, T>::read_samples(
+    FILE* file_desc,
+    size_t max_samples,
+    std::vector<Sample<IdType, T> >* samples
+) {
+    samples->clear();
+
+    char* buf = new char[BUF_SIZE];
+    while (samples->size() < max_samples) {
+        if (fgets(buf, BUF_SIZE - 1, file_desc) == nullptr) {
+            break;
+        }
+
+        buf[BUF_SIZE - 1] = 0;
+        Sample<IdType, T> sample;
+        if (parse_data(buf, &sample)) {
+            samples->push_back(sample);
+        }
+    }
+
+    delete [] buf;
+    return samples->size();
+}
+
 template <typename IdType, typename T>
 const Sample<IdType, T>* DataManager<IdType, T>::SampleAt(size_t pos) {
     if (pos >= samples_.size()) {
@@ -165,20 +247,24 @@ const Sample<IdType, T>* DataManager<IdType, T>::SampleAt(size_t pos) {
 }
 
 template <typename IdType, typename T>
-BaseSampler* DataManager<IdType, T>::build_data_sampler(unsigned seed) {
-    if (samples_.size() == 0) {
+BaseSampler* DataManager<IdType, T>::build_data_sampler(
+    unsigned seed,
+    size_t shard,
+    size_t num_shards
+) {
+    num_shards = std::max(num_shards, static_cast<size_t>(1));
+    if (samples_.size() <= shard) {
         return nullptr;
     }
 
-    std::vector<std::pair<size_t, double> > data_weights;
-    for (size_t i = 0; i < samples_.size(); ++i) {
-        data_weights.push_back(
-            std::pair<size_t, double> (
-                i,
-                samples_[i].weight()
-            )
-        );
-    }
+    size_t shard_size = (samples_.size() - shard + num_shards - 1) / num_shards;
+    std::vector<std::pair<size_t, double> > data_weights(shard_size);
+    ThreadPool::Global()->ParallelFor(0, shard_size, [&] (size_t, size_t begin, size_t end) {
+        for (size_t k = begin; k < end; ++k) {
+            size_t i = k * num_shards + shard;
+            data_weights[k] = std::pair<size_t, double> (i, samples_[i].weight());
+        }
+    });
 
     AliasSampler* sampler = new AliasSampler(data_weights);
     sampler->seed(seed);
@@ -195,28 +281,13 @@ BaseSampler* DataManager<IdType, T>::build_target_sampler(
         return nullptr;
     }
 
-    std::unordered_map<IdType, double> target_weights;
-    std::vector<std::pair<size_t, double> > data_weights;
-    for (size_t i = 0; i < samples_.size(); ++i) {
-        if (weight_type == WEIGHT_FREQ) {
-            // use frequency as sampling weight
-            target_weights[samples_[i].target()] += samples_[i].weight();
-        } else {
-            // use in-degree as sampling weight
-            target_weights[samples_[i].target()] += 1;
+    std::vector<double> weights = target_weights(weight_type);
+    std::vector<std::pair<size_t, double> > data_weights(weights.size());
+    ThreadPool::Global()->ParallelFor(0, weights.size(), [&] (size_t, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            data_weights[i] = std::pair<size_t, double>(i, pow(weights[i], weight_exp));
         }
-    }
-
-    for (
-        auto iter = target_weights.begin();
-        iter != target_weights.end();
-        ++iter
-    ) {
-        double weight = pow(iter->second, weight_exp);
-        data_weights.push_back(
-            std::pair<size_t, double>(iter->first, weight)
-        );
-    }
+    });
 
     if (util_equal<double> (weight_exp, 0)) {
         RandomSampler* sampler = new RandomSampler(data_weights);
@@ -229,6 +300,58 @@ BaseSampler* DataManager<IdType, T>::build_target_sampler(
     }
 }
 
+template <typename IdType, typename T>
+std::vector<double> DataManager<IdType, T>::target_weights(WeightType weight_type) {
+    return vertex_weights(true, weight_type);
+}
+
+template <typename IdType, typename T>
+std::vector<double> DataManager<IdType, T>::source_weights(WeightType weight_type) {
+    return vertex_weights(false, weight_type);
+}
+
+template <typename IdType, typename T>
+std::vector<double> DataManager<IdType, T>::vertex_weights(
+    bool by_target,
+    WeightType weight_type
+) {
+    ThreadPool* pool = ThreadPool::Global();
+    size_t num_ids = by_target ? target_size() : source_size();
+
+    // one partial table per worker, bounded by the memory of samples_
+    size_t num_parts = samples_.size() / std::max(num_ids, static_cast<size_t>(1));
+    num_parts = std::max(std::min(num_parts, pool->size()), static_cast<size_t>(1));
+
+    std::vector<std::vector<double> > parts(num_parts);
+    pool->Run([&] (size_t part) {
+        std::vector<double>& weights = parts[part];
+        weights.assign(num_ids, 0);
+
+        size_t begin = samples_.size() * part / num_parts;
+        size_t end = samples_.size() * (part + 1) / num_parts;
+        for (size_t i = begin; i < end; ++i) {
+            size_t id = by_target ? samples_[i].target() : samples_[i].source();
+            if (weight_type == WEIGHT_FREQ) {
+                // use frequency as sampling weight
+                weights[id] += samples_[i].weight();
+            } else {
+                // use degree as sampling weight
+                weights[id] += 1;
+            }
+        }
+    }, num_parts);
+
+    pool->ParallelFor(0, num_ids, [&] (size_t, size_t begin, size_t end) {
+        for (size_t part = 1; part < num_parts; ++part) {
+            for (size_t i = begin; i < end; ++i) {
+                parts[0][i] += parts[part][i];
+            }
+        }
+    });
+
+    return std::move(parts[0]);
+}
+
 template <typename IdType, typename T>
 std::string DataManager<IdType, T>::SourceWord(IdType pos) {
     return source_words_.WordAt(pos);
@@ -239,6 +362,26 @@ std::string DataManager<IdType, T>::TargetWord(IdType pos) {
     return target_words_.WordAt(pos);
 }
 
+template <typename IdType, typename T>
+const std::string& DataManager<IdType, T>::SourceWordRef(IdType pos) const {
+    return source_words_.WordRef(pos);
+}
+
+template <typename IdType, typename T>
+const std::string& DataManager<IdType, T>::TargetWordRef(IdType pos) const {
+    return target_words_.WordRef(pos);
+}
+
+template <typename IdType, typename T>
+size_t DataManager<IdType, T>::SourceId(const std::string& word) const {
+    return source_words_.SearchWord(word);
+}
+
+template <typename IdType, typename T>
+size_t DataManager<IdType, T>::TargetId(const std::string& word) const {
+    return target_words_.SearchWord(word);
+}
+
 template <typename IdType, typename T>
 bool DataManager<IdType, T>::parse_data(char* input_buf, Sample<IdType, T>* sample) {
     if (!input_buf || !sample) {
@@ -1,168 +1,27 @@
 #include <getopt.h>
 #include <unistd.h>
 
-#include <cmath>
+#include <cctype>
+#include <chrono>
 #include <cstring>
-#include <functional>
+#include <fstream>
 #include <iostream>
-#include <queue>
-#include <unordered_map>
+#include <sstream>
+#include <unordered_set>
 #include <vector>
 
+#include "src/embedding_model.h"
+#include "src/hnsw_index.h"
+#include "src/ivf_index.h"
+#include "src/query_server.h"
+#include "src/result_cache.h"
+#include "src/thread_pool.h"
 #include "src/util.h"
 
-typedef std::function<double(double*, double*, size_t n)> score_func_t;
-typedef std::pair<std::string, double> pair_t;
-
 enum SearchSpace { SPACE_SOURCE = 0, SPACE_TARGET = 1, SPACE_ALIGNMENT = 2 };
 
-double dot(double* v1, double* v2, size_t n) {
-    double sum = 0;
-    for (size_t i = 0; i < n; ++i) {
-        sum += v1[i] * v2[i];
-    }
-    return sum;
-}
-
-double l2norm(double* v1, size_t n) {
-    double sum = 0;
-    for (size_t i = 0; i < n; ++i) {
-        sum += v1[i] * v1[i];
-    }
-
-    return sqrt(sum);
-}
-
-double cosine(double* v1, double* v2, size_t n) {
-    double numerator = dot(v1, v2, n);
-    double denominator = l2norm(v1, n) * l2norm(v2, n);
-    if (util_equal<double> (denominator, 0)) {
-        return 0;
-    }
-
-    return numerator / denominator;
-}
-
-class EmbeddingModel {
-public:
-    EmbeddingModel() : num_feat_ {0}, hidden_size_ {0}, model_ {nullptr}, init_ {false} {}
-
-    virtual ~EmbeddingModel() {
-        if (model_ != nullptr) {
-            delete [] model_;
-        }
-        init_ = false;
-    }
-
-    bool LoadModel(const char* path) {
-        FILE* file_desc = fopen(path, "r");
-
-        if (!file_desc) {
-            return false;
-        }
-
-        enum { BUF_SIZE = 102400 };
-        char* buf = new char[BUF_SIZE];
-
-        size_t line_num = 0;
-        bool error_flag = false;
-        char *ptr = nullptr;
-        while (true) {
-            if (fgets(buf, BUF_SIZE - 1, file_desc) == nullptr) {
-                break;
-            }
-            buf[BUF_SIZE - 1] = '\0';
-
-            if (line_num == 0) {
-                if (sscanf(buf, "%lu %lu", &num_feat_, &hidden_size_) != 2) {
-                    error_flag = true;
-                    break;
-                }
-                model_ = new double[num_feat_ * hidden_size_ + 1];
-                std::fill(model_, model_ + num_feat_ * hidden_size_ + 1, 0);
-            } else if (line_num <= num_feat_) {
-                char *word = strtok_r(buf, "\t\r\n", &ptr);
-                if (word == nullptr) {
-                    error_flag = true;
-                    break;
-                }
-                size_t feat_id = line_num - 1;
-                id_map_[word] = feat_id;
-                feat_name_.push_back(word);
-                for (size_t i = 0; i < hidden_size_; ++i) {
-                    char *p = strtok_r(NULL, " \t\r\n", &ptr);
-                    if (p == nullptr) {
-                        break;
-                    }
-                    model_[feat_id * hidden_size_ + i] = atof(p);
-                }
-            } else {
-                break;
-            }
-            ++line_num;
-        }
-
-        delete [] buf;
-        fclose(file_desc);
-
-        if (!error_flag || line_num <= num_feat_ || feat_name_.size() != num_feat_) {
-            init_ = true;
-        }
-        return init_;
-    }
-
-    double* Embedding(const std::string& word) {
-        auto iter = id_map_.find(word);
-        if (iter == id_map_.end()) {
-            return nullptr;
-        }
-
-        size_t feat_id = iter->second;
-        if (feat_id >= num_feat_) {
-            return nullptr;
-        }
-
-        return model_ + feat_id * hidden_size_;
-    }
-
-    std::vector<pair_t> Match(
-        double* embedding,
-        score_func_t score_func = cosine,
-        size_t topn = 20
-    ) {
-        auto cmp = [] (const pair_t& left, const pair_t& right) {
-            return left.second > right.second;
-        };
-
-        std::priority_queue<pair_t, std::vector<pair_t>, decltype(cmp)> q(cmp);
-        for (size_t i = 0; i < num_feat_; ++i) {
-            double* embedding_i = model_ + i * hidden_size_;
-            double score = score_func(embedding, embedding_i, hidden_size_);
-            q.push(pair_t(feat_name_[i], score));
-            while (q.size() > topn) {
-                q.pop();
-            }
-        }
-
-        std::vector<pair_t> vec;
-        while (q.size() > 0) {
-            vec.push_back(q.top());
-            q.pop();
-        }
-
-        std::sort(vec.begin(), vec.end(), cmp);
-
-        return vec;
-    }
-
-protected:
-    std::unordered_map<std::string, size_t> id_map_;
-    std::vector<std::string> feat_name_;
-    size_t num_feat_;
-    size_t hidden_size_;
-    double* model_;
-    bool init_;
-};
+// queries read from a batch file and matched at once
+const size_t BATCH_SIZE = 16384;
 
 void print_usage(int argc, char **argv) {
     printf("Usage: %s --model model_path [options]\n"
@@ -170,6 +29,41 @@ void print_usage(int argc, char **argv) {
         "--topn n : set number of results returned, default 20\n"
         "--space source|target|alignment : set search method, default alignment\n"
         "--score-func cosine|dot : set scoring function, default cosine\n"
+        "--reference path : report the memory size of the model and its "
+        "recall@topn against the model at path, e.g. the float model of a "
+        "quantized one\n"
+        "--queries n : set number of queries of --reference and --latency, default 100\n"
+        "--batch path : match every word of path (one per line) and write "
+        "query, result and score as tab separated lines to stdout\n"
+        "--latency : report the latency of queries at topn 10, 100 and 1000, "
+        "and the recall of the index against brute force\n"
+        "--build-index : build an HNSW index of the matched rows, save it next "
+        "to them (e.g. model.target.hnsw) and use it\n"
+        "--hnsw-m m : set number of links per row of a built index, default 16\n"
+        "--ef-construction n : set number of candidates while building, default 200\n"
+        "--ef n : set number of candidates while searching, default 64\n"
+        "--build-ivf nlist : build an inverted file index of nlist k-means lists "
+        "of the matched rows, save it next to them (e.g. model.target.ivf) and "
+        "use it unless there is an HNSW index\n"
+        "--ivf-codes m : keep m byte product quantization codes of every row of "
+        "a built inverted file, scan the codes and re-rank the best exactly\n"
+        "--nprobe n : set number of inverted lists scanned, default 8\n"
+        "--rerank n : set number of candidates of the codes scored exactly, "
+        "default 4 * topn\n"
+        "--brute-force : scan all rows even if an index exists\n"
+        "--serve address : load the model once and answer requests on a unix "
+        "socket path or on host:port (TCP, e.g. 127.0.0.1:7000); a request is a "
+        "line, 'knn word [topn]' answered by 'OK n' and n lines of result and "
+        "score, 'score source_word target_word' by 'OK score', errors by "
+        "'ERR message', 'stats' by the hits and misses of the result cache, "
+        "'quit' closes the connection\n"
+        "--cache n : keep the results of the last n distinct queries (word, "
+        "space, score function and topn) of --serve and stdin, default 0\n"
+        "--threads n : set number of threads answering requests, default all cores\n"
+        "--match-threads n : split the rows scanned for one query of the stdin "
+        "loop or --latency into n ranges matched concurrently, default --threads; "
+        "the results are those of a serial scan. --serve requests run on pool "
+        "workers and scan serially\n"
         "--help : print this help\n", argv[0]
     );
 }
@@ -183,13 +77,47 @@ int main(int argc, char* argv[]) {
         {"topn", required_argument, nullptr, 'n'},
         {"score-func", required_argument, nullptr, 's'},
         {"space", required_argument, nullptr, 'x'},
+        {"reference", required_argument, nullptr, 'r'},
+        {"queries", required_argument, nullptr, 'q'},
+        {"latency", no_argument, nullptr, 'l'},
+        {"batch", required_argument, nullptr, 'b'},
+        {"build-index", no_argument, nullptr, 'i'},
+        {"hnsw-m", required_argument, nullptr, 'M'},
+        {"ef-construction", required_argument, nullptr, 'c'},
+        {"ef", required_argument, nullptr, 'e'},
+        {"build-ivf", required_argument, nullptr, 'I'},
+        {"ivf-codes", required_argument, nullptr, 'C'},
+        {"nprobe", required_argument, nullptr, 'p'},
+        {"rerank", required_argument, nullptr, 'R'},
+        {"brute-force", no_argument, nullptr, 'f'},
+        {"serve", required_argument, nullptr, 'S'},
+        {"threads", required_argument, nullptr, 't'},
+        {"cache", required_argument, nullptr, 'K'},
+        {"match-threads", required_argument, nullptr, 'T'},
         {"help", no_argument, nullptr, 'h'},
         {nullptr, 0, nullptr, 0}
     };
 
     std::string model_path;
+    std::string reference_path;
+    std::string batch_path;
+    std::string serve_address;
+    size_t threads = 0;
+    size_t cache_size = 0;
+    size_t match_threads = 0;
+    size_t num_queries = 100;
+    bool latency = false;
+    bool build_index = false;
+    bool brute_force = false;
+    size_t hnsw_m = DEF_HNSW_M;
+    size_t ef_construction = DEF_HNSW_EF_CONSTRUCTION;
+    size_t ef = DEF_HNSW_EF;
+    size_t ivf_nlist = 0;
+    size_t ivf_codes = 0;
+    size_t nprobe = DEF_IVF_NPROBE;
+    size_t rerank = 0;
     size_t topn = 20;
-    score_func_t score_func = cosine;
+    ScoreType score_type = SCORE_COSINE;
     SearchSpace space = SPACE_ALIGNMENT;
 
     while ((opt = getopt_long(argc, argv, "h", long_options, &opt_idx)) != -1) {
@@ -214,14 +142,65 @@ int main(int argc, char* argv[]) {
             break;
         case 's':
             if (!strcmp(optarg, "cosine")) {
-                score_func = cosine;
+                score_type = SCORE_COSINE;
             } else if (!strcmp(optarg, "dot")) {
-                score_func = dot;
+                score_type = SCORE_DOT;
             } else {
                 print_usage(argc, argv);
                 exit(-1);
             }
             break;
+        case 'r':
+            reference_path = optarg;
+            break;
+        case 'q':
+            num_queries = static_cast<size_t>(atoi(optarg));
+            break;
+        case 'l':
+            latency = true;
+            break;
+        case 'b':
+            batch_path = optarg;
+            break;
+        case 'i':
+            build_index = true;
+            break;
+        case 'M':
+            hnsw_m = static_cast<size_t>(atoi(optarg));
+            break;
+        case 'c':
+            ef_construction = static_cast<size_t>(atoi(optarg));
+            break;
+        case 'e':
+            ef = static_cast<size_t>(atoi(optarg));
+            break;
+        case 'I':
+            ivf_nlist = static_cast<size_t>(atoi(optarg));
+            break;
+        case 'C':
+            ivf_codes = static_cast<size_t>(atoi(optarg));
+            break;
+        case 'p':
+            nprobe = static_cast<size_t>(atoi(optarg));
+            break;
+        case 'R':
+            rerank = static_cast<size_t>(atoi(optarg));
+            break;
+        case 'f':
+            brute_force = true;
+            break;
+        case 'S':
+            serve_address = optarg;
+            break;
+        case 't':
+            threads = static_cast<size_t>(atoi(optarg));
+            break;
+        case 'K':
+            cache_size = static_cast<size_t>(atoi(optarg));
+            break;
+        case 'T':
+            match_threads = static_cast<size_t>(atoi(optarg));
+            break;
         case 'h':
         default:
             print_usage(argc, argv);
@@ -234,33 +213,347 @@ int main(int argc, char* argv[]) {
         exit(-1);
     }
 
-    std::string source_path = model_path + std::string(".source");
-    std::string target_path = model_path + std::string(".target");
+    if (threads > 0) {
+        ThreadPool::InitGlobal(threads);
+    }
+
+    // load both sides of a model concurrently on the shared pool
+    auto load_model = [&] (const std::string& path, EmbeddingModel* source, EmbeddingModel* target) {
+        std::string source_path = path + std::string(".source");
+        std::string target_path = path + std::string(".target");
+        if (space == SPACE_SOURCE) {
+            target_path = source_path;
+        } else if (space == SPACE_TARGET) {
+            source_path = target_path;
+        }
+
+        auto source_loaded = ThreadPool::Global()->Submit([&] () {
+            return source->LoadModel(source_path.c_str());
+        });
+        bool ret = target->LoadModel(target_path.c_str());
+        return source_loaded.get() && ret;
+    };
 
     EmbeddingModel model_source, model_target;
+    if (!load_model(model_path, &model_source, &model_target)) {
+        fprintf(stderr, "failed to load %s\n", model_path.c_str());
+        return -1;
+    }
+    model_target.set_match_threads(match_threads);
+
+    // the index belongs to the matched rows and to one scoring function
+    std::string matrix_path = model_path + (space == SPACE_SOURCE ? ".source" : ".target");
+    std::string index_path = matrix_path + ".hnsw";
+    HnswIndex index;
+    bool use_index = false;
+    if (build_index) {
+        auto start = std::chrono::steady_clock::now();
+        use_index = index.Build(&model_target, score_type, hnsw_m, ef_construction);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if (!use_index || !index.Save(index_path.c_str())) {
+            fprintf(stderr, "failed to build %s\n", index_path.c_str());
+        } else {
+            printf("Built %s of %lu rows in %.2lfs\n", index_path.c_str(), index.size(), elapsed.count());
+        }
+    } else if (!brute_force && access(index_path.c_str(), F_OK) == 0) {
+        if (!index.Load(index_path.c_str(), &model_target)) {
+            fprintf(stderr, "%s is stale or corrupt, ignored, rebuild it with --build-index\n",
+                index_path.c_str());
+        } else {
+            use_index = index.score_type() == score_type;
+            if (!use_index) {
+                fprintf(stderr, "%s was built for another --score-func, ignored\n", index_path.c_str());
+            }
+        }
+    }
+
+    std::string ivf_path = matrix_path + ".ivf";
+    IvfIndex ivf;
+    bool use_ivf = false;
+    if (ivf_nlist > 0) {
+        auto start = std::chrono::steady_clock::now();
+        use_ivf = ivf.Build(&model_target, score_type, ivf_nlist, ivf_codes);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if (!use_ivf || !ivf.Save(ivf_path.c_str())) {
+            fprintf(stderr, "failed to build %s\n", ivf_path.c_str());
+        } else {
+            printf("Built %s of %lu lists, %lu code bytes per row, in %.2lfs\n", ivf_path.c_str(),
+                ivf.nlist(), ivf.code_subspaces(), elapsed.count());
+        }
+    } else if (!brute_force && access(ivf_path.c_str(), F_OK) == 0) {
+        if (!ivf.Load(ivf_path.c_str(), &model_target)) {
+            fprintf(stderr, "%s is stale or corrupt, ignored, rebuild it with --build-ivf\n",
+                ivf_path.c_str());
+        } else {
+            use_ivf = ivf.score_type() == score_type;
+            if (!use_ivf) {
+                fprintf(stderr, "%s was built for another --score-func, ignored\n", ivf_path.c_str());
+            }
+        }
+    }
+
+    auto match = [&] (const float* query, size_t n) {
+        if (!use_index && !use_ivf) {
+            return model_target.Match(query, score_type, n);
+        }
+
+        auto best = use_index ? index.Search(query, n, ef) : ivf.Search(query, n, nprobe, rerank);
+        std::vector<pair_t> res;
+        for (size_t i = 0; i < best.size(); ++i) {
+            res.push_back(pair_t(model_target.Name(best[i].second), best[i].first));
+        }
+        return res;
+    };
+
+    // results of a word are kept as long as the model that produced them,
+    // which is loaded once per process
+    ResultCache cache(cache_size);
+    auto lookup = [&] (const std::string& word, const float* query, size_t n) {
+        std::string key = word + '\t' + std::to_string(space) + '\t' +
+            std::to_string(score_type) + '\t' + std::to_string(n);
+        std::vector<pair_t> res;
+        if (!cache.Get(key, &res)) {
+            res = match(query, n);
+            cache.Put(key, res);
+        }
+        return res;
+    };
+
+    if (reference_path.size() > 0) {
+        EmbeddingModel reference_source, reference_target;
+        if (!load_model(reference_path, &reference_source, &reference_target)) {
+            fprintf(stderr, "failed to load %s\n", reference_path.c_str());
+            return -1;
+        }
+        reference_target.set_match_threads(match_threads);
+
+        printf("%s: %s, %.2lf MB\n", model_path.c_str(), model_target.EncodingName(),
+            (model_source.bytes() + model_target.bytes()) / 1048576.);
+        printf("%s: %s, %.2lf MB\n", reference_path.c_str(), reference_target.EncodingName(),
+            (reference_source.bytes() + reference_target.bytes()) / 1048576.);
+
+        // evenly spaced source words are the queries, a hit is a word of
+        // the reference top n that the model returns in its top n
+        size_t num_sources = model_source.size();
+        num_queries = std::min(num_queries, num_sources);
+        size_t hits = 0, total = 0;
+        for (size_t i = 0; i < num_queries; ++i) {
+            std::string word = model_source.Name(i * num_sources / num_queries);
+            const float* query = model_source.Embedding(word);
+            const float* reference_query = reference_source.Embedding(word);
+            if (query == nullptr || reference_query == nullptr) {
+                continue;
+            }
+
+            auto res = model_target.Match(query, score_type, topn);
+            auto expected = reference_target.Match(reference_query, score_type, topn);
+            for (size_t j = 0; j < expected.size(); ++j) {
+                for (size_t k = 0; k < res.size(); ++k) {
+                    if (res[k].first == expected[j].first) {
+                        ++hits;
+                        break;
+                    }
+                }
+            }
+            total += expected.size();
+        }
+
+        printf("Recall@%lu: %.4lf over %lu queries\n", topn,
+            hits * 1. / std::max(total, static_cast<size_t>(1)), num_queries);
+        return 0;
+    }
+
+    if (latency) {
+        // the same evenly spaced source words at every topn, with the
+        // index a hit is a brute force result it returns as well
+        size_t num_sources = model_source.size();
+        num_queries = std::min(num_queries, num_sources);
+        for (size_t n : {10, 100, 1000}) {
+            std::vector<double> scan_millis, index_millis;
+            size_t hits = 0, total = 0;
+            for (size_t i = 0; i < num_queries; ++i) {
+                const float* query = model_source.Embedding(model_source.Name(i * num_sources / num_queries));
+                auto start = std::chrono::steady_clock::now();
+                auto expected = model_target.Match(query, score_type, n);
+                std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+                scan_millis.push_back(elapsed.count());
+                if (!use_index && !use_ivf) {
+                    continue;
+                }
+
+                start = std::chrono::steady_clock::now();
+                auto res = match(query, n);
+                elapsed = std::chrono::steady_clock::now() - start;
+                index_millis.push_back(elapsed.count());
+
+                std::unordered_set<std::string> found;
+                for (size_t j = 0; j < res.size(); ++j) {
+                    found.insert(res[j].first);
+                }
+                for (size_t j = 0; j < expected.size(); ++j) {
+                    hits += found.count(expected[j].first);
+                }
+                total += expected.size();
+            }
+
+            auto report = [&] (const char* name, std::vector<double>* millis) {
+                std::sort(millis->begin(), millis->end());
+                double sum = 0;
+                for (size_t i = 0; i < millis->size(); ++i) {
+                    sum += (*millis)[i];
+                }
+                size_t count = std::max(millis->size(), static_cast<size_t>(1));
+                printf("topn %lu %s: mean %.3lf ms, p50 %.3lf ms, p99 %.3lf ms over %lu queries",
+                    n, name, sum / count, millis->empty() ? 0 : (*millis)[millis->size() / 2],
+                    millis->empty() ? 0 : (*millis)[millis->size() * 99 / 100], millis->size());
+            };
+
+            report("brute force", &scan_millis);
+            printf("\n");
+            if (use_index) {
+                report("hnsw", &index_millis);
+                printf(", ef %lu, recall %.4lf\n", std::max(ef, n),
+                    hits * 1. / std::max(total, static_cast<size_t>(1)));
+            } else if (use_ivf) {
+                report("ivf", &index_millis);
+                printf(", nprobe %lu, recall %.4lf\n", nprobe,
+                    hits * 1. / std::max(total, static_cast<size_t>(1)));
+            }
+        }
+        if (use_ivf && !use_index) {
+            printf("ivf: %.2lf MB of %lu lists, %lu code bytes per row; rows %.2lf MB\n",
+                ivf.bytes() / 1048576., ivf.nlist(), ivf.code_subspaces(), model_target.bytes() / 1048576.);
+        }
+        return 0;
+    }
+
+    if (batch_path.size() > 0) {
+        std::ifstream batch_file(batch_path);
+        if (!batch_file) {
+            fprintf(stderr, "failed to open %s\n", batch_path.c_str());
+            return -1;
+        }
+
+        // known words are matched in batches of BATCH_SIZE
+        std::string word;
+        std::vector<std::string> words;
+        std::vector<std::vector<float> > embeddings;
+        while (true) {
+            bool more = static_cast<bool>(batch_file >> word);
+            if (more) {
+                const float* embedding = model_source.Embedding(word);
+                if (embedding == nullptr) {
+                    fprintf(stderr, "%s do not exist!\n", word.c_str());
+                    continue;
+                }
+                words.push_back(word);
+                embeddings.emplace_back(embedding, embedding + model_source.hidden_size());
+                if (words.size() < BATCH_SIZE) {
+                    continue;
+                }
+            }
 
-    if (space == SPACE_SOURCE) {
-        model_source.LoadModel(source_path.c_str());
-        model_target.LoadModel(source_path.c_str());
-    } else if (space == SPACE_TARGET) {
-        model_source.LoadModel(target_path.c_str());
-        model_target.LoadModel(target_path.c_str());
-    } else {
-        model_source.LoadModel(source_path.c_str());
-        model_target.LoadModel(target_path.c_str());
+            std::vector<const float*> queries;
+            for (size_t i = 0; i < embeddings.size(); ++i) {
+                queries.push_back(embeddings[i].data());
+            }
+            auto res = model_target.MatchBatch(queries, score_type, topn);
+            for (size_t i = 0; i < res.size(); ++i) {
+                for (size_t j = 0; j < res[i].size(); ++j) {
+                    printf("%s\t%s\t%g\n", words[i].c_str(), res[i][j].first.c_str(), res[i][j].second);
+                }
+            }
+
+            words.clear();
+            embeddings.clear();
+            if (!more) {
+                break;
+            }
+        }
+        return 0;
+    }
+
+    if (serve_address.size() > 0) {
+        // requests run concurrently, so every one decodes into its own buffers
+        auto answer = [&] (const std::string& request) {
+            std::istringstream in(request);
+            std::string command, word, other;
+            in >> command;
+            char line[128];
+
+            if (command == "knn" && in >> word) {
+                size_t n = topn;
+                if (in >> other) {
+                    char* end = nullptr;
+                    n = isdigit(static_cast<unsigned char>(other[0])) ?
+                        static_cast<size_t>(strtoul(other.c_str(), &end, 10)) : 0;
+                    if (n == 0 || *end != '\0') {
+                        return "ERR bad topn " + other + "\n";
+                    }
+                }
+                n = std::min(n, model_target.size());
+                std::vector<float> buffer;
+                const float* query = model_source.Embedding(word, &buffer);
+                if (query == nullptr) {
+                    return "ERR " + word + " do not exist\n";
+                }
+
+                auto res = lookup(word, query, n);
+                std::string response = "OK " + std::to_string(res.size()) + "\n";
+                for (size_t i = 0; i < res.size(); ++i) {
+                    snprintf(line, sizeof(line), "\t%g\n", res[i].second);
+                    response += res[i].first + line;
+                }
+                return response;
+            }
+
+            if (command == "score" && in >> word >> other) {
+                std::vector<float> source_buffer, target_buffer;
+                const float* source = model_source.Embedding(word, &source_buffer);
+                const float* target = model_target.Embedding(other, &target_buffer);
+                if (source == nullptr || target == nullptr) {
+                    return "ERR " + (source == nullptr ? word : other) + " do not exist\n";
+                }
+
+                float score = util_dot(source, target, model_target.hidden_size());
+                if (score_type == SCORE_COSINE) {
+                    score *= model_source.InverseNorm(source) * model_target.InverseNorm(target);
+                }
+                snprintf(line, sizeof(line), "OK %g\n", score);
+                return std::string(line);
+            }
+
+            if (command == "stats") {
+                snprintf(line, sizeof(line), "OK hits %lu misses %lu entries %lu capacity %lu\n",
+                    cache.hits(), cache.misses(), cache.size(), cache.capacity());
+                return std::string(line);
+            }
+
+            return std::string("ERR expected knn word [topn], score source_word target_word or stats\n");
+        };
+
+        QueryServer server;
+        if (!server.Listen(serve_address)) {
+            fprintf(stderr, "failed to listen on %s\n", serve_address.c_str());
+            return -1;
+        }
+        printf("Serving %s with %lu threads\n", serve_address.c_str(), ThreadPool::Global()->size());
+        fflush(stdout);
+        server.Serve(answer);
+        return 0;
     }
 
     std::string word;
     std::cout << "Please Input:" << std::flush;
     while (std::cin >> word) {
-        double* source_embedding = model_source.Embedding(word);
+        const float* source_embedding = model_source.Embedding(word);
         if (source_embedding == nullptr) {
             std::cout << std::endl << word << " do not exist!" << std::endl;
             std::cout << "Please Input:" << std::flush;
             continue;
         }
 
-        auto res = model_target.Match(source_embedding, score_func, topn);
+        auto res = lookup(word, source_embedding, topn);
         std::cout << std::endl;
         for (size_t i = 0; i < res.size(); ++i) {
             std::cout << res[i].first << "\t" << res[i].second << std::endl;
@@ -270,5 +563,8 @@ int main(int argc, char* argv[]) {
         std::cout << "Please Input:" << std::flush;
     }
 
+    if (cache.capacity() > 0) {
+        fprintf(stderr, "cache: %lu hits, %lu misses\n", cache.hits(), cache.misses());
+    }
     return 0;
 }
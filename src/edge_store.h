@@ -0,0 +1,259 @@
+#ifndef SRC_EDGE_STORE_H
+#define SRC_EDGE_STORE_H
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "src/data.h"
+#include "src/partition.h"
+#include "src/thread_pool.h"
+
+// On-disk edges of an out-of-core run, grouped by (source bucket, target
+// bucket) and stored with ids local to their buckets, so one bucket pair
+// can be streamed back in bounded chunks and trained on its own.
+template <typename IdType, typename T>
+class EdgeStore {
+public:
+    EdgeStore();
+    virtual ~EdgeStore();
+
+    // parse input_path again (the vocabularies of data_manager must be
+    // complete) and write its edges to `path`, using at most buffer_bytes
+    // of write buffers
+    bool Build(
+        DataManager<IdType, T>* data_manager,
+        const std::string& input_path,
+        const std::string& path,
+        size_t num_threads,
+        const BucketRange& source_range,
+        const BucketRange& target_range,
+        size_t buffer_bytes
+    );
+
+    // read up to count edges of pair p, starting at its edge `offset`
+    size_t Read(size_t p, size_t offset, size_t count, Sample<IdType, T>* out);
+
+    // close and delete the store
+    void Remove();
+
+public:
+    inline size_t pair_edges(size_t p) {
+        return offsets_[p + 1] - offsets_[p];
+    }
+
+    inline double pair_weight(size_t p) {
+        return weights_[p];
+    }
+
+    inline double total_weight() {
+        return total_weight_;
+    }
+
+private:
+    std::string path_;
+    int fd_;
+    std::vector<size_t> offsets_;
+    std::vector<double> weights_;
+    double total_weight_;
+};
+
+template <typename IdType, typename T>
+EdgeStore<IdType, T>::EdgeStore() : fd_ {-1}, total_weight_ {0} {
+}
+
+template <typename IdType, typename T>
+EdgeStore<IdType, T>::~EdgeStore() {
+    if (fd_ != -1) {
+        close(fd_);
+    }
+}
+
+template <typename IdType, typename T>
+bool EdgeStore<IdType, T>::Build(
+    DataManager<IdType, T>* data_manager,
+    const std::string& input_path,
+    const std::string& path,
+    size_t num_threads,
+    const BucketRange& source_range,
+    const BucketRange& target_range,
+    size_t buffer_bytes
+) {
+    typedef Sample<IdType, T> sample_t;
+
+    size_t num_buckets = source_range.num_buckets();
+    size_t num_pairs = num_buckets * num_buckets;
+    num_threads = std::max(num_threads, static_cast<size_t>(1));
+    path_ = path;
+
+    // 1. spill the edges in input order, one file per parser thread, and
+    // count the edges of every pair
+    std::vector<FILE*> spills(num_threads, nullptr);
+    std::vector<std::vector<size_t> > counts(num_threads);
+    std::vector<std::vector<double> > weights(num_threads);
+    for (size_t i = 0; i < num_threads; ++i) {
+        std::string spill_path = path_ + ".spill." + std::to_string(i);
+        spills[i] = fopen(spill_path.c_str(), "w+");
+        if (spills[i] == nullptr) {
+            return false;
+        }
+        unlink(spill_path.c_str());
+        counts[i].assign(num_pairs, 0);
+        weights[i].assign(num_pairs, 0);
+    }
+
+    auto pair_of = [&] (const sample_t& sample) {
+        return source_range.bucket(sample.source()) * num_buckets +
+            target_range.bucket(sample.target());
+    };
+
+    // a short write, e.g. of a full disk, fails the build: the store
+    // would be left with zero edges where counts promise real ones
+    std::vector<char> spilled(num_threads, 1);
+    data_manager->scan_data(input_path, num_threads, [&] (size_t i, const sample_t& sample) {
+        size_t p = pair_of(sample);
+        ++counts[i][p];
+        weights[i][p] += sample.weight();
+        if (spilled[i] && fwrite(&sample, sizeof(sample_t), 1, spills[i]) != 1) {
+            spilled[i] = 0;
+        }
+    });
+
+    bool spill_ok = true;
+    for (size_t i = 0; i < num_threads; ++i) {
+        spill_ok = spilled[i] && fflush(spills[i]) == 0 && spill_ok;
+    }
+    if (!spill_ok) {
+        for (size_t i = 0; i < num_threads; ++i) {
+            fclose(spills[i]);
+        }
+        return false;
+    }
+
+    offsets_.assign(num_pairs + 1, 0);
+    weights_.assign(num_pairs, 0);
+    for (size_t p = 0; p < num_pairs; ++p) {
+        size_t count = 0;
+        for (size_t i = 0; i < num_threads; ++i) {
+            count += counts[i][p];
+            weights_[p] += weights[i][p];
+        }
+        offsets_[p + 1] = offsets_[p] + count;
+        total_weight_ += weights_[p];
+    }
+
+    fd_ = open(path_.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd_ == -1) {
+        for (size_t i = 0; i < num_threads; ++i) {
+            fclose(spills[i]);
+        }
+        return false;
+    }
+    unlink(path_.c_str());
+
+    // 2. scatter every spill file into the pair-ordered store, buffered
+    // per pair; positions are reserved with an atomic cursor per pair
+    std::unique_ptr<std::atomic<size_t>[]> cursors(new std::atomic<size_t>[num_pairs]);
+    for (size_t p = 0; p < num_pairs; ++p) {
+        cursors[p] = offsets_[p];
+    }
+
+    size_t buffer_edges = std::max(
+        buffer_bytes / (num_threads * num_pairs * sizeof(sample_t)),
+        static_cast<size_t>(1)
+    );
+
+    std::atomic<bool> ok(true);
+    ThreadPool::Global()->Run([&] (size_t i) {
+        std::vector<sample_t> buffers(num_pairs * buffer_edges);
+        std::vector<size_t> fill(num_pairs, 0);
+
+        auto flush = [&] (size_t p) {
+            size_t pos = cursors[p].fetch_add(fill[p]);
+            ssize_t bytes = fill[p] * sizeof(sample_t);
+            if (pwrite(fd_, &buffers[p * buffer_edges], bytes, pos * sizeof(sample_t)) != bytes) {
+                ok = false;
+            }
+            fill[p] = 0;
+        };
+
+        size_t expected = 0;
+        for (size_t p = 0; p < num_pairs; ++p) {
+            expected += counts[i][p];
+        }
+
+        rewind(spills[i]);
+        sample_t sample;
+        size_t read = 0;
+        while (fread(&sample, sizeof(sample_t), 1, spills[i]) == 1) {
+            ++read;
+            size_t source_bucket = source_range.bucket(sample.source());
+            size_t target_bucket = target_range.bucket(sample.target());
+            size_t p = source_bucket * num_buckets + target_bucket;
+
+            sample.set_source(sample.source() - source_range.begin(source_bucket));
+            sample.set_target(sample.target() - target_range.begin(target_bucket));
+            buffers[p * buffer_edges + fill[p]++] = sample;
+            if (fill[p] == buffer_edges) {
+                flush(p);
+            }
+        }
+
+        for (size_t p = 0; p < num_pairs; ++p) {
+            if (fill[p] > 0) {
+                flush(p);
+            }
+        }
+        if (read != expected) {
+            ok = false;
+        }
+        fclose(spills[i]);
+    }, num_threads);
+
+    return ok;
+}
+
+template <typename IdType, typename T>
+size_t EdgeStore<IdType, T>::Read(
+    size_t p,
+    size_t offset,
+    size_t count,
+    Sample<IdType, T>* out
+) {
+    if (fd_ == -1 || offset >= pair_edges(p)) {
+        return 0;
+    }
+
+    count = std::min(count, pair_edges(p) - offset);
+    size_t bytes = count * sizeof(Sample<IdType, T>);
+    off_t pos = (offsets_[p] + offset) * sizeof(Sample<IdType, T>);
+
+    size_t done = 0;
+    while (done < bytes) {
+        ssize_t n = pread(fd_, reinterpret_cast<char*>(out) + done, bytes - done, pos + done);
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+
+    return done / sizeof(Sample<IdType, T>);
+}
+
+template <typename IdType, typename T>
+void EdgeStore<IdType, T>::Remove() {
+    if (fd_ != -1) {
+        close(fd_);
+        fd_ = -1;
+    }
+    offsets_.clear();
+    weights_.clear();
+}
+
+#endif // SRC_EDGE_STORE_H
+/* vim: set ts=4 sw=4 tw=0 et :*/
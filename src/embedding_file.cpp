@@ -0,0 +1,312 @@
+#include "src/embedding_file.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+
+EmbeddingFileWriter::EmbeddingFileWriter() : fp_ {nullptr}, pq_ {nullptr}, ok_ {false} {
+    memset(&header_, 0, sizeof(header_));
+}
+
+EmbeddingFileWriter::~EmbeddingFileWriter() {
+    if (fp_ != nullptr) {
+        fclose(fp_);
+    }
+}
+
+size_t EmbeddingFileWriter::row_bytes() const {
+    switch (header_.encoding) {
+    case ENCODING_INT8:
+        return header_.hidden_size;
+    case ENCODING_PQ:
+        return header_.subspaces;
+    default:
+        return header_.hidden_size * sizeof(float);
+    }
+}
+
+bool EmbeddingFileWriter::Open(
+    const char* path,
+    size_t rows,
+    size_t hidden_size,
+    EmbeddingEncoding encoding,
+    const ProductQuantizer* pq
+) {
+    if (encoding == ENCODING_PQ && (pq == nullptr || pq->dim() != hidden_size)) {
+        return false;
+    }
+
+    fp_ = fopen(path, "wb");
+    if (fp_ == nullptr) {
+        return false;
+    }
+
+    memcpy(header_.magic, EMBEDDING_FILE_MAGIC, sizeof(header_.magic));
+    header_.version = EMBEDDING_FILE_VERSION;
+    header_.value_size = sizeof(float);
+    header_.rows = rows;
+    header_.hidden_size = hidden_size;
+    header_.matrix_offset = (sizeof(header_) + EMBEDDING_FILE_ALIGN - 1) /
+        EMBEDDING_FILE_ALIGN * EMBEDDING_FILE_ALIGN;
+    header_.encoding = encoding;
+    header_.subspaces = encoding == ENCODING_PQ ? pq->subspaces() : 0;
+    pq_ = pq;
+
+    // the header is written again by Close(), once all offsets are known
+    char pad[EMBEDDING_FILE_ALIGN] = {0};
+    ok_ = fwrite(&header_, sizeof(header_), 1, fp_) == 1 &&
+        fwrite(pad, 1, header_.matrix_offset - sizeof(header_), fp_) ==
+            header_.matrix_offset - sizeof(header_);
+
+    names_.clear();
+    names_.reserve(rows);
+    scales_.clear();
+    codes_.resize(row_bytes());
+    return ok_;
+}
+
+bool EmbeddingFileWriter::WriteRow(const std::string& name, const float* row) {
+    if (!ok_ || names_.size() >= header_.rows) {
+        return false;
+    }
+
+    names_.push_back(name);
+    const void* data = row;
+    if (header_.encoding == ENCODING_INT8) {
+        scales_.push_back(ScalarQuantize(
+            row, header_.hidden_size, reinterpret_cast<int8_t*>(codes_.data())));
+        data = codes_.data();
+    } else if (header_.encoding == ENCODING_PQ) {
+        pq_->Encode(row, codes_.data());
+        data = codes_.data();
+    }
+
+    ok_ = fwrite(data, 1, codes_.size(), fp_) == codes_.size();
+    return ok_;
+}
+
+bool EmbeddingFileWriter::Close() {
+    if (fp_ == nullptr) {
+        return false;
+    }
+
+    // rows that were never written are left zero
+    std::vector<float> zero(header_.hidden_size, 0);
+    while (ok_ && names_.size() < header_.rows) {
+        WriteRow(std::to_string(names_.size()), zero.data());
+    }
+
+    header_.names_offset = header_.matrix_offset + header_.rows * row_bytes();
+
+    std::vector<uint64_t> name_offsets(names_.size());
+    uint64_t offset = 0;
+    for (size_t i = 0; ok_ && i < names_.size(); ++i) {
+        name_offsets[i] = offset;
+        size_t bytes = names_[i].size() + 1;
+        ok_ = fwrite(names_[i].c_str(), 1, bytes, fp_) == bytes;
+        offset += bytes;
+    }
+
+    // keep the index arrays 8 byte aligned
+    char pad[8] = {0};
+    size_t padding = (8 - offset % 8) % 8;
+    ok_ = ok_ && fwrite(pad, 1, padding, fp_) == padding;
+    header_.name_offsets_offset = header_.names_offset + offset + padding;
+
+    std::vector<uint64_t> sorted(names_.size());
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        sorted[i] = i;
+    }
+    std::sort(sorted.begin(), sorted.end(), [&] (uint64_t left, uint64_t right) {
+        return names_[left] < names_[right];
+    });
+    header_.sorted_offset = header_.name_offsets_offset + names_.size() * sizeof(uint64_t);
+    header_.extra_offset = header_.sorted_offset + names_.size() * sizeof(uint64_t);
+
+    ok_ = ok_ &&
+        fwrite(name_offsets.data(), sizeof(uint64_t), name_offsets.size(), fp_) == name_offsets.size() &&
+        fwrite(sorted.data(), sizeof(uint64_t), sorted.size(), fp_) == sorted.size();
+
+    if (header_.encoding == ENCODING_INT8) {
+        ok_ = ok_ && fwrite(scales_.data(), sizeof(float), scales_.size(), fp_) == scales_.size();
+    } else if (header_.encoding == ENCODING_PQ) {
+        const std::vector<float>& centroids = pq_->centroids();
+        ok_ = ok_ && fwrite(centroids.data(), sizeof(float), centroids.size(), fp_) == centroids.size();
+    }
+
+    ok_ = ok_ &&
+        fseek(fp_, 0, SEEK_SET) == 0 &&
+        fwrite(&header_, sizeof(header_), 1, fp_) == 1;
+
+    ok_ = (fclose(fp_) == 0) && ok_;
+    fp_ = nullptr;
+    names_.clear();
+    scales_.clear();
+    return ok_;
+}
+
+EmbeddingFile::EmbeddingFile()
+: rows_ {0},
+  hidden_size_ {0},
+  encoding_ {ENCODING_FLOAT32},
+  subspaces_ {0},
+  matrix_ {nullptr},
+  names_ {nullptr},
+  name_offsets_ {nullptr},
+  sorted_ {nullptr},
+  extra_ {nullptr} {
+}
+
+EmbeddingFile::~EmbeddingFile() {
+}
+
+bool EmbeddingFile::IsBinary(const char* path) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == nullptr) {
+        return false;
+    }
+
+    char magic[sizeof(EMBEDDING_FILE_MAGIC)];
+    bool ret = fread(magic, 1, sizeof(magic), fp) == sizeof(magic) &&
+        memcmp(magic, EMBEDDING_FILE_MAGIC, sizeof(magic)) == 0;
+    fclose(fp);
+    return ret;
+}
+
+// count items of item_bytes each at offset lie within a file of size bytes
+static bool InFile(uint64_t offset, uint64_t count, uint64_t item_bytes, size_t size) {
+    return offset <= size && (count == 0 || item_bytes <= (size - offset) / count);
+}
+
+bool EmbeddingFile::Open(const char* path) {
+    Close();
+    if (!file_.Open(path)) {
+        return false;
+    }
+
+    const EmbeddingFileHeader* header =
+        reinterpret_cast<const EmbeddingFileHeader*>(file_.data());
+    if (file_.size() < sizeof(EmbeddingFileHeader) ||
+            memcmp(header->magic, EMBEDDING_FILE_MAGIC, sizeof(header->magic)) != 0 ||
+            header->version < 1 || header->version > EMBEDDING_FILE_VERSION ||
+            header->value_size != sizeof(float) ||
+            header->hidden_size == 0 || header->hidden_size > file_.size()) {
+        file_.Close();
+        return false;
+    }
+
+    rows_ = header->rows;
+    hidden_size_ = header->hidden_size;
+    if (header->version >= 2) {
+        encoding_ = static_cast<EmbeddingEncoding>(header->encoding);
+        subspaces_ = header->subspaces;
+    }
+
+    // bytes of a row in the matrix and of the region after the sorted ids
+    uint64_t row_bytes = 0;
+    uint64_t extra_bytes = 0;
+    switch (encoding_) {
+    case ENCODING_FLOAT32:
+        row_bytes = hidden_size_ * sizeof(float);
+        break;
+    case ENCODING_INT8:
+        row_bytes = hidden_size_;
+        extra_bytes = rows_ * sizeof(float);
+        break;
+    case ENCODING_PQ:
+        if (subspaces_ == 0 || hidden_size_ % subspaces_ != 0) {
+            Close();
+            return false;
+        }
+        row_bytes = subspaces_;
+        extra_bytes = PQ_CENTROIDS * hidden_size_ * sizeof(float);
+        break;
+    default:
+        Close();
+        return false;
+    }
+
+    size_t size = file_.size();
+    if (!InFile(header->matrix_offset, rows_, row_bytes, size) ||
+            header->names_offset > header->name_offsets_offset ||
+            !InFile(header->names_offset, header->name_offsets_offset - header->names_offset, 1, size) ||
+            !InFile(header->name_offsets_offset, rows_, sizeof(uint64_t), size) ||
+            !InFile(header->sorted_offset, rows_, sizeof(uint64_t), size) ||
+            (extra_bytes > 0 && (rows_ > size || !InFile(header->extra_offset, 1, extra_bytes, size)))) {
+        Close();
+        return false;
+    }
+
+    matrix_ = file_.data() + header->matrix_offset;
+    names_ = file_.data() + header->names_offset;
+    name_offsets_ = reinterpret_cast<const uint64_t*>(file_.data() + header->name_offsets_offset);
+    sorted_ = reinterpret_cast<const uint64_t*>(file_.data() + header->sorted_offset);
+    if (extra_bytes > 0) {
+        extra_ = reinterpret_cast<const float*>(file_.data() + header->extra_offset);
+    }
+
+    // every name starts inside the names region, which ends with a '\0',
+    // and every sorted id is a row
+    uint64_t names_bytes = header->name_offsets_offset - header->names_offset;
+    bool valid = rows_ == 0 || (names_bytes > 0 && names_[names_bytes - 1] == '\0');
+    for (size_t i = 0; valid && i < rows_; ++i) {
+        valid = name_offsets_[i] < names_bytes && sorted_[i] < rows_;
+    }
+    if (!valid) {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+void EmbeddingFile::Close() {
+    file_.Close();
+    rows_ = 0;
+    hidden_size_ = 0;
+    encoding_ = ENCODING_FLOAT32;
+    subspaces_ = 0;
+    matrix_ = nullptr;
+    names_ = nullptr;
+    name_offsets_ = nullptr;
+    sorted_ = nullptr;
+    extra_ = nullptr;
+}
+
+size_t EmbeddingFile::Find(const char* word) const {
+    size_t low = 0, high = rows_;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        int cmp = strcmp(Name(sorted_[mid]), word);
+        if (cmp == 0) {
+            return sorted_[mid];
+        } else if (cmp < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return npos;
+}
+
+void EmbeddingFile::DecodeRow(size_t id, float* out) const {
+    if (encoding_ == ENCODING_INT8) {
+        const int8_t* codes = reinterpret_cast<const int8_t*>(matrix_) + id * hidden_size_;
+        float scale = extra_[id];
+        for (size_t i = 0; i < hidden_size_; ++i) {
+            out[i] = codes[i] * scale;
+        }
+    } else if (encoding_ == ENCODING_PQ) {
+        const uint8_t* codes = reinterpret_cast<const uint8_t*>(matrix_) + id * subspaces_;
+        size_t sub_dim = hidden_size_ / subspaces_;
+        for (size_t m = 0; m < subspaces_; ++m) {
+            const float* c = extra_ + (m * PQ_CENTROIDS + codes[m]) * sub_dim;
+            std::copy(c, c + sub_dim, out + m * sub_dim);
+        }
+    } else {
+        const float* row = Row(id);
+        std::copy(row, row + hidden_size_, out);
+    }
+}
+
+/* vim: set ts=4 sw=4 tw=0 et :*/
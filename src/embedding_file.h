@@ -0,0 +1,153 @@
+#ifndef SRC_EMBEDDING_FILE_H
+#define SRC_EMBEDDING_FILE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "src/mmap_file.h"
+#include "src/quantizer.h"
+
+// How the rows of an embedding file are stored.
+enum EmbeddingEncoding {
+    // hidden_size float32 values per row
+    ENCODING_FLOAT32 = 0,
+    // hidden_size int8 codes per row and one float32 scale per row
+    ENCODING_INT8 = 1,
+    // one byte per subspace per row and a float32 codebook
+    ENCODING_PQ = 2
+};
+
+// Binary embedding matrix, one file per matrix:
+//
+//   header | rows, 64 byte aligned | NUL terminated names | uint64 offset
+//   of every name | uint64 row ids sorted by name | row scales (int8) or
+//   codebook (pq)
+//
+// Offsets are relative to the start of the file, so a mapped file is used
+// as it is, without parsing a single value. Version 1 files hold float32
+// rows and end their header after sorted_offset.
+struct EmbeddingFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t value_size;
+    uint64_t rows;
+    uint64_t hidden_size;
+    uint64_t matrix_offset;
+    uint64_t names_offset;
+    uint64_t name_offsets_offset;
+    uint64_t sorted_offset;
+    // since version 2
+    uint32_t encoding;
+    uint32_t subspaces;
+    uint64_t extra_offset;
+};
+
+static const char EMBEDDING_FILE_MAGIC[8] = {'B', 'W', '2', 'V', 'E', 'M', 'B', '1'};
+static const uint32_t EMBEDDING_FILE_VERSION = 2;
+static const size_t EMBEDDING_FILE_ALIGN = 64;
+
+// Writes an embedding file row by row, names (and int8 scales) are kept in
+// memory until Close() writes the tables that follow the rows.
+class EmbeddingFileWriter {
+public:
+    EmbeddingFileWriter();
+    virtual ~EmbeddingFileWriter();
+
+    // pq must be trained for ENCODING_PQ
+    bool Open(
+        const char* path,
+        size_t rows,
+        size_t hidden_size,
+        EmbeddingEncoding encoding = ENCODING_FLOAT32,
+        const ProductQuantizer* pq = nullptr
+    );
+
+    // append the next row, rows are written in id order
+    bool WriteRow(const std::string& name, const float* row);
+
+    bool Close();
+
+private:
+    size_t row_bytes() const;
+
+private:
+    FILE* fp_;
+    EmbeddingFileHeader header_;
+    const ProductQuantizer* pq_;
+    std::vector<std::string> names_;
+    std::vector<float> scales_;
+    std::vector<uint8_t> codes_;
+    bool ok_;
+};
+
+// A read-only mapped embedding file.
+class EmbeddingFile {
+public:
+    EmbeddingFile();
+    virtual ~EmbeddingFile();
+
+    // true if path is an embedding file rather than a text model
+    static bool IsBinary(const char* path);
+
+    bool Open(const char* path);
+
+    void Close();
+
+    // row id of word by binary search over the sorted index, npos if absent
+    size_t Find(const char* word) const;
+
+    // the (approximate) float values of a row of any encoding
+    void DecodeRow(size_t id, float* out) const;
+
+public:
+    inline size_t rows() const {
+        return rows_;
+    }
+
+    inline size_t hidden_size() const {
+        return hidden_size_;
+    }
+
+    inline EmbeddingEncoding encoding() const {
+        return encoding_;
+    }
+
+    inline size_t subspaces() const {
+        return subspaces_;
+    }
+
+    // bytes of the mapped file
+    inline size_t bytes() {
+        return file_.size();
+    }
+
+    // float32 files only, see DecodeRow
+    inline const float* Row(size_t id) const {
+        return reinterpret_cast<const float*>(matrix_) + id * hidden_size_;
+    }
+
+    inline const char* Name(size_t id) const {
+        return names_ + name_offsets_[id];
+    }
+
+public:
+    static const size_t npos = -1;
+
+private:
+    MmapFile file_;
+    size_t rows_;
+    size_t hidden_size_;
+    EmbeddingEncoding encoding_;
+    size_t subspaces_;
+    const char* matrix_;
+    const char* names_;
+    const uint64_t* name_offsets_;
+    const uint64_t* sorted_;
+    // int8 row scales or pq codebook
+    const float* extra_;
+};
+
+#endif // SRC_EMBEDDING_FILE_H
+/* vim: set ts=4 sw=4 tw=0 et :*/
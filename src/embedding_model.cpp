@@ -0,0 +1,370 @@
+#include "src/embedding_model.h"
+
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#include "src/thread_pool.h"
+#include "src/util.h"
+
+EmbeddingModel::EmbeddingModel()
+: num_feat_ {0},
+  hidden_size_ {0},
+  match_threads_ {0},
+  model_ {nullptr},
+  init_ {false} {
+}
+
+EmbeddingModel::~EmbeddingModel() {
+    init_ = false;
+}
+
+bool EmbeddingModel::LoadModel(const char* path) {
+    if (EmbeddingFile::IsBinary(path)) {
+        init_ = file_.Open(path);
+        num_feat_ = file_.rows();
+        hidden_size_ = file_.hidden_size();
+        model_ = file_.Row(0);
+        if (init_) {
+            ComputeNorms();
+        }
+        return init_;
+    }
+
+    FILE* file_desc = fopen(path, "r");
+
+    if (!file_desc) {
+        return false;
+    }
+
+    enum { BUF_SIZE = 102400 };
+    char* buf = new char[BUF_SIZE];
+
+    size_t line_num = 0;
+    bool error_flag = false;
+    char *ptr = nullptr;
+    while (true) {
+        if (fgets(buf, BUF_SIZE - 1, file_desc) == nullptr) {
+            break;
+        }
+        buf[BUF_SIZE - 1] = '\0';
+
+        if (line_num == 0) {
+            if (sscanf(buf, "%lu %lu", &num_feat_, &hidden_size_) != 2) {
+                error_flag = true;
+                break;
+            }
+            values_.assign(num_feat_ * hidden_size_ + 1, 0);
+            model_ = values_.data();
+        } else if (line_num <= num_feat_) {
+            char *word = strtok_r(buf, "\t\r\n", &ptr);
+            if (word == nullptr) {
+                error_flag = true;
+                break;
+            }
+            size_t feat_id = line_num - 1;
+            id_map_[word] = feat_id;
+            feat_name_.push_back(word);
+            for (size_t i = 0; i < hidden_size_; ++i) {
+                char *p = strtok_r(NULL, " \t\r\n", &ptr);
+                if (p == nullptr) {
+                    break;
+                }
+                values_[feat_id * hidden_size_ + i] = atof(p);
+            }
+        } else {
+            break;
+        }
+        ++line_num;
+    }
+
+    delete [] buf;
+    fclose(file_desc);
+
+    if (!error_flag || line_num <= num_feat_ || feat_name_.size() != num_feat_) {
+        init_ = true;
+        ComputeNorms();
+    }
+    return init_;
+}
+
+size_t EmbeddingModel::bytes() {
+    if (values_.empty()) {
+        return file_.bytes();
+    }
+
+    size_t name_bytes = 0;
+    for (size_t i = 0; i < feat_name_.size(); ++i) {
+        name_bytes += feat_name_[i].size() + 1;
+    }
+    return values_.size() * sizeof(float) + name_bytes;
+}
+
+const char* EmbeddingModel::EncodingName() {
+    if (!values_.empty()) {
+        return "text";
+    }
+
+    switch (file_.encoding()) {
+    case ENCODING_INT8:
+        return "int8";
+    case ENCODING_PQ:
+        return "pq";
+    default:
+        return "float32";
+    }
+}
+
+const float* EmbeddingModel::Embedding(const std::string& word) {
+    return Embedding(word, &query_);
+}
+
+size_t EmbeddingModel::Find(const char* word) {
+    if (values_.empty()) {
+        return file_.Find(word);
+    }
+
+    auto iter = id_map_.find(word);
+    return iter != id_map_.end() ? iter->second : EmbeddingFile::npos;
+}
+
+const float* EmbeddingModel::Embedding(const std::string& word, std::vector<float>* buffer) {
+    size_t feat_id = Find(word.c_str());
+    if (feat_id >= num_feat_) {
+        return nullptr;
+    }
+
+    return Row(feat_id, buffer);
+}
+
+uint64_t EmbeddingModel::Fingerprint() {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    auto update = [&] (const void* data, size_t bytes) {
+        const unsigned char* p = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < bytes; ++i) {
+            hash = (hash ^ p[i]) * 1099511628211ULL;
+        }
+    };
+
+    uint64_t shape[2] = {num_feat_, hidden_size_};
+    update(shape, sizeof(shape));
+    std::vector<float> buffer;
+    size_t count = std::min(num_feat_, FINGERPRINT_ROWS);
+    for (size_t i = 0; i < count; ++i) {
+        size_t id = i * num_feat_ / count;
+        update(Name(id), strlen(Name(id)));
+        update(Row(id, &buffer), hidden_size_ * sizeof(float));
+    }
+    return hash;
+}
+
+const float* EmbeddingModel::Row(size_t feat_id, std::vector<float>* buffer) {
+    if (!values_.empty() || file_.encoding() == ENCODING_FLOAT32) {
+        return model_ + feat_id * hidden_size_;
+    }
+
+    buffer->resize(hidden_size_);
+    file_.DecodeRow(feat_id, buffer->data());
+    return buffer->data();
+}
+
+const char* EmbeddingModel::Name(size_t feat_id) {
+    return values_.empty() ? file_.Name(feat_id) : feat_name_[feat_id].c_str();
+}
+
+std::vector<pair_t> EmbeddingModel::Match(
+    const float* embedding,
+    ScoreType score_type,
+    size_t topn
+) {
+    float query_scale = 1;
+    if (score_type == SCORE_COSINE) {
+        query_scale = InverseNorm(embedding);
+    }
+
+    // every range scores its rows exactly as a serial scan would
+    auto scan = [&] (size_t begin, size_t end, TopK* top) {
+        std::vector<float> row;
+        for (size_t i = begin; i < end; ++i) {
+            const float* embedding_i = Row(i, &row);
+            float score = util_dot(embedding, embedding_i, hidden_size_);
+            if (score_type == SCORE_COSINE) {
+                score *= query_scale * inv_norms_[i];
+            }
+            top->Push(score, i);
+        }
+    };
+
+    ThreadPool* pool = ThreadPool::Global();
+    size_t num_parts = match_threads_ == 0 ? pool->size() : match_threads_;
+    if (num_feat_ < MATCH_PARALLEL_MIN_ROWS || ThreadPool::InWorker()) {
+        num_parts = 1;
+    }
+
+    TopK top(topn);
+    if (num_parts <= 1) {
+        scan(0, num_feat_, &top);
+    } else {
+        std::vector<TopK> tops(num_parts, TopK(topn));
+        pool->Run([&] (size_t part) {
+            scan(num_feat_ * part / num_parts, num_feat_ * (part + 1) / num_parts, &tops[part]);
+        }, num_parts);
+
+        for (size_t part = 0; part < num_parts; ++part) {
+            const std::vector<TopK::entry_t>& best = tops[part].Sorted();
+            for (size_t i = 0; i < best.size(); ++i) {
+                top.Push(best[i].first, best[i].second);
+            }
+        }
+    }
+
+    // names are only looked up for the rows that made it
+    const std::vector<TopK::entry_t>& best = top.Sorted();
+    std::vector<pair_t> vec;
+    vec.reserve(best.size());
+    for (size_t i = 0; i < best.size(); ++i) {
+        vec.push_back(pair_t(Name(best[i].second), best[i].first));
+    }
+
+    return vec;
+}
+
+std::vector<std::vector<TopK::entry_t> > EmbeddingModel::MatchBatchIds(
+    const std::vector<const float*>& queries,
+    ScoreType score_type,
+    size_t topn
+) {
+    size_t num_queries = queries.size();
+    std::vector<float> block(num_queries * hidden_size_);
+    for (size_t q = 0; q < num_queries; ++q) {
+        float scale = score_type == SCORE_COSINE ? InverseNorm(queries[q]) : 1;
+        for (size_t j = 0; j < hidden_size_; ++j) {
+            block[q * hidden_size_ + j] = queries[q][j] * scale;
+        }
+    }
+
+    size_t row_bytes = std::max(hidden_size_, static_cast<size_t>(1)) * sizeof(float);
+    size_t block_queries = std::max(BATCH_QUERY_BYTES / row_bytes, static_cast<size_t>(1));
+    size_t tile_rows = std::max(BATCH_TILE_BYTES / row_bytes, static_cast<size_t>(1));
+    size_t num_blocks = (num_queries + block_queries - 1) / block_queries;
+    size_t num_tiles = (num_feat_ + tile_rows - 1) / tile_rows;
+
+    // with fewer query blocks than threads the rows are split as well
+    ThreadPool* pool = ThreadPool::Global();
+    size_t num_parts = (pool->size() + num_blocks - 1) / std::max(num_blocks, static_cast<size_t>(1));
+    num_parts = std::max(std::min(num_parts, num_tiles), static_cast<size_t>(1));
+
+    std::vector<TopK> tops(num_parts * num_queries, TopK(topn));
+    std::atomic<size_t> cursor(0);
+    pool->Run([&] (size_t) {
+        std::vector<float> buffer;
+        while (true) {
+            size_t task = cursor.fetch_add(1);
+            if (task >= num_blocks * num_parts) {
+                break;
+            }
+
+            size_t part = task % num_parts;
+            size_t query_begin = task / num_parts * block_queries;
+            size_t query_end = std::min(query_begin + block_queries, num_queries);
+            size_t row_begin = num_tiles * part / num_parts * tile_rows;
+            size_t row_end = std::min(num_tiles * (part + 1) / num_parts * tile_rows, num_feat_);
+            TopK* top = &tops[part * num_queries];
+
+            for (size_t begin = row_begin; begin < row_end; begin += tile_rows) {
+                size_t end = std::min(begin + tile_rows, row_end);
+                const float* tile = Tile(begin, end, &buffer);
+                for (size_t i = begin; i < end; ++i) {
+                    const float* row = tile + (i - begin) * hidden_size_;
+                    float row_scale = score_type == SCORE_COSINE ? inv_norms_[i] : 1;
+                    for (size_t q = query_begin; q < query_end; ++q) {
+                        top[q].Push(util_dot(&block[q * hidden_size_], row, hidden_size_) * row_scale, i);
+                    }
+                }
+            }
+        }
+    }, pool->size());
+
+    std::vector<std::vector<TopK::entry_t> > results(num_queries);
+    for (size_t q = 0; q < num_queries; ++q) {
+        if (num_parts == 1) {
+            results[q] = tops[q].Sorted();
+            continue;
+        }
+
+        TopK merged(topn);
+        for (size_t part = 0; part < num_parts; ++part) {
+            const std::vector<TopK::entry_t>& best = tops[part * num_queries + q].Sorted();
+            for (size_t i = 0; i < best.size(); ++i) {
+                merged.Push(best[i].first, best[i].second);
+            }
+        }
+        results[q] = merged.Sorted();
+    }
+
+    return results;
+}
+
+std::vector<std::vector<pair_t> > EmbeddingModel::MatchBatch(
+    const std::vector<const float*>& queries,
+    ScoreType score_type,
+    size_t topn
+) {
+    auto best = MatchBatchIds(queries, score_type, topn);
+    std::vector<std::vector<pair_t> > results(best.size());
+    for (size_t q = 0; q < best.size(); ++q) {
+        results[q].reserve(best[q].size());
+        for (size_t i = 0; i < best[q].size(); ++i) {
+            results[q].push_back(pair_t(Name(best[q][i].second), best[q][i].first));
+        }
+    }
+
+    return results;
+}
+
+const float* EmbeddingModel::Tile(size_t begin, size_t end, std::vector<float>* buffer) {
+    if (!values_.empty() || file_.encoding() == ENCODING_FLOAT32) {
+        return model_ + begin * hidden_size_;
+    }
+
+    buffer->resize((end - begin) * hidden_size_);
+    for (size_t i = begin; i < end; ++i) {
+        file_.DecodeRow(i, buffer->data() + (i - begin) * hidden_size_);
+    }
+    return buffer->data();
+}
+
+float EmbeddingModel::InverseNorm(const float* embedding) {
+    float norm = sqrt(util_dot(embedding, embedding, hidden_size_));
+    return norm > 0 ? 1 / norm : 0;
+}
+
+const float* EmbeddingModel::ScaleQuery(
+    const float* embedding,
+    ScoreType score_type,
+    std::vector<float>* buffer
+) {
+    if (score_type != SCORE_COSINE) {
+        return embedding;
+    }
+
+    float scale = InverseNorm(embedding);
+    buffer->resize(hidden_size_);
+    for (size_t j = 0; j < hidden_size_; ++j) {
+        (*buffer)[j] = embedding[j] * scale;
+    }
+    return buffer->data();
+}
+
+void EmbeddingModel::ComputeNorms() {
+    inv_norms_.resize(num_feat_);
+    ThreadPool::Global()->ParallelFor(0, num_feat_, [&] (size_t, size_t begin, size_t end) {
+        std::vector<float> buffer;
+        for (size_t i = begin; i < end; ++i) {
+            inv_norms_[i] = InverseNorm(Row(i, &buffer));
+        }
+    });
+}
+/* vim: set ts=4 sw=4 tw=0 et :*/
@@ -0,0 +1,194 @@
+#ifndef SRC_EMBEDDING_MODEL_H
+#define SRC_EMBEDDING_MODEL_H
+
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "src/embedding_file.h"
+#include "src/util.h"
+
+typedef std::pair<std::string, double> pair_t;
+
+enum ScoreType { SCORE_COSINE = 0, SCORE_DOT = 1 };
+
+// bytes of the query block (L1) and of the row tile (L2) of a batch scan
+const size_t BATCH_QUERY_BYTES = 16384;
+const size_t BATCH_TILE_BYTES = 262144;
+
+// entries a TopK allocates up front, a larger k grows as rows arrive
+const size_t TOPK_RESERVE = 1024;
+
+// rows hashed by Fingerprint()
+const size_t FINGERPRINT_ROWS = 64;
+
+// rows below which a single query is not split across threads
+const size_t MATCH_PARALLEL_MIN_ROWS = 32768;
+
+// The k best (score, row id) pairs of a scan, a heap with the worst kept
+// entry on top in a buffer of fixed size: once it is full a row below the
+// k-th score costs a single comparison and nothing is allocated. Equal
+// scores prefer the smaller id, so the result does not depend on the order
+// of the pushes and the top k of row ranges merge into the top k of all.
+class TopK {
+public:
+    typedef std::pair<float, size_t> entry_t;
+
+    // a ranks before b
+    struct Better {
+        inline bool operator()(const entry_t& a, const entry_t& b) const {
+            return a.first > b.first || (a.first == b.first && a.second < b.second);
+        }
+    };
+
+    explicit TopK(size_t k) : k_ {k} {
+        heap_.reserve(std::min(k, TOPK_RESERVE));
+    }
+
+    inline void Push(float score, size_t id) {
+        if (heap_.size() < k_) {
+            heap_.push_back(entry_t(score, id));
+            std::push_heap(heap_.begin(), heap_.end(), Better());
+        } else if (k_ > 0 && Better()(entry_t(score, id), heap_.front())) {
+            std::pop_heap(heap_.begin(), heap_.end(), Better());
+            heap_.back() = entry_t(score, id);
+            std::push_heap(heap_.begin(), heap_.end(), Better());
+        }
+    }
+
+    // the entries best first, Push() must not be called afterwards
+    const std::vector<entry_t>& Sorted() {
+        std::sort_heap(heap_.begin(), heap_.end(), Better());
+        return heap_;
+    }
+
+private:
+    size_t k_;
+    std::vector<entry_t> heap_;
+};
+
+// Rows of a text model are parsed into memory, a binary embedding file is
+// mapped and used in place; int8 and product quantized rows are decoded
+// one at a time while scoring. The inverse norm of every row is cached at
+// load time, so cosine is a dot product scaled by two factors.
+class EmbeddingModel {
+public:
+    EmbeddingModel();
+    virtual ~EmbeddingModel();
+
+    bool LoadModel(const char* path);
+
+    // bytes the rows and names take in memory, or in the mapped file
+    size_t bytes();
+
+    const char* EncodingName();
+
+    // hash of the shape and of evenly spaced rows and names, an index built
+    // on other rows does not match
+    uint64_t Fingerprint();
+
+    // row id of word, EmbeddingFile::npos if absent
+    size_t Find(const char* word);
+
+    const float* Embedding(const std::string& word);
+
+    // Embedding() decoding into buffer, safe to call concurrently
+    const float* Embedding(const std::string& word, std::vector<float>* buffer);
+
+    // the values of row feat_id, decoded into buffer for quantized files
+    const float* Row(size_t feat_id, std::vector<float>* buffer);
+
+    // rows [begin, end) as one array, decoded into buffer for quantized files
+    const float* Tile(size_t begin, size_t end, std::vector<float>* buffer);
+
+    const char* Name(size_t feat_id);
+
+    // 1 / l2 norm of embedding, 0 for a zero vector
+    float InverseNorm(const float* embedding);
+
+    // embedding scaled to unit length for cosine, as it is for dot
+    const float* ScaleQuery(const float* embedding, ScoreType score_type, std::vector<float>* buffer);
+
+    // start loading row feat_id (and its norm) ahead of Score()
+    inline void Prefetch(size_t feat_id) {
+        if (!values_.empty() || file_.encoding() == ENCODING_FLOAT32) {
+            const char* row = reinterpret_cast<const char*>(model_ + feat_id * hidden_size_);
+            for (size_t offset = 0; offset < hidden_size_ * sizeof(float); offset += 64) {
+                __builtin_prefetch(row + offset, 0, 3);
+            }
+        }
+        __builtin_prefetch(&inv_norms_[feat_id], 0, 3);
+    }
+
+    // score of row feat_id as Match() computes it, for a query that went
+    // through ScaleQuery()
+    inline float Score(const float* query, size_t feat_id, ScoreType score_type, std::vector<float>* buffer) {
+        float score = util_dot(query, Row(feat_id, buffer), hidden_size_);
+        return score_type == SCORE_COSINE ? score * inv_norms_[feat_id] : score;
+    }
+
+    // top n rows of one query; with more than MATCH_PARALLEL_MIN_ROWS rows
+    // the rows are split into match_threads() ranges scanned on the global
+    // pool and their top n merged, the result is the one of a serial scan
+    std::vector<pair_t> Match(
+        const float* embedding,
+        ScoreType score_type = SCORE_COSINE,
+        size_t topn = 20
+    );
+
+    // top n rows of every query, scored a block of queries against a tile
+    // of rows at a time so both stay in cache; a task is one query block
+    // and one range of rows, the top n of the ranges are merged
+    std::vector<std::vector<TopK::entry_t> > MatchBatchIds(
+        const std::vector<const float*>& queries,
+        ScoreType score_type = SCORE_COSINE,
+        size_t topn = 20
+    );
+
+    std::vector<std::vector<pair_t> > MatchBatch(
+        const std::vector<const float*>& queries,
+        ScoreType score_type = SCORE_COSINE,
+        size_t topn = 20
+    );
+
+public:
+    inline size_t size() {
+        return num_feat_;
+    }
+
+    inline size_t hidden_size() {
+        return hidden_size_;
+    }
+
+    // ranges a single Match() is split into, 0 for the threads of the
+    // global pool, 1 for a serial scan
+    inline size_t match_threads() {
+        return match_threads_;
+    }
+
+    inline void set_match_threads(size_t match_threads) {
+        match_threads_ = match_threads;
+    }
+
+protected:
+    void ComputeNorms();
+
+protected:
+    std::unordered_map<std::string, size_t> id_map_;
+    std::vector<std::string> feat_name_;
+    size_t num_feat_;
+    size_t hidden_size_;
+    size_t match_threads_;
+    std::vector<float> values_;
+    std::vector<float> query_;
+    std::vector<float> inv_norms_;
+    EmbeddingFile file_;
+    const float* model_;
+    bool init_;
+};
+
+#endif // SRC_EMBEDDING_MODEL_H
+/* vim: set ts=4 sw=4 tw=0 et :*/
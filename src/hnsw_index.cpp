@@ -0,0 +1,436 @@
+#include "src/hnsw_index.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <queue>
+#include <random>
+
+#include "src/thread_pool.h"
+
+struct HnswIndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t score_type;
+    uint64_t max_links;
+    uint64_t max_level;
+    uint64_t entry;
+    uint64_t rows;
+    uint64_t hidden_size;
+    uint64_t fingerprint;
+};
+
+// levels above this one are never drawn, 16^16 rows would be needed
+static const size_t HNSW_MAX_LEVEL = 16;
+
+HnswIndex::HnswIndex()
+: model_ {nullptr},
+  score_type_ {SCORE_COSINE},
+  max_links_ {0},
+  max_links0_ {0},
+  max_level_ {0},
+  entry_ {0},
+  building_ {false} {
+}
+
+HnswIndex::~HnswIndex() {
+    for (size_t i = 0; i < contexts_.size(); ++i) {
+        delete contexts_[i];
+    }
+}
+
+bool HnswIndex::Build(
+    EmbeddingModel* model,
+    ScoreType score_type,
+    size_t m,
+    size_t ef_construction,
+    unsigned seed
+) {
+    size_t rows = model->size();
+    if (rows == 0 || rows > UINT32_MAX || m < 2) {
+        return false;
+    }
+
+    model_ = model;
+    score_type_ = score_type;
+    max_links_ = m;
+    max_links0_ = 2 * m;
+
+    // levels are drawn up front, so they do not depend on the threads
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> uniform(0, 1);
+    double level_mult = 1 / log(static_cast<double>(m));
+    levels_.resize(rows);
+    upper_links_.assign(rows, std::vector<uint32_t>());
+    for (size_t i = 0; i < rows; ++i) {
+        double level = -log(std::max(uniform(rng), 1e-12)) * level_mult;
+        levels_[i] = static_cast<uint8_t>(std::min(static_cast<size_t>(level), HNSW_MAX_LEVEL));
+        if (levels_[i] > 0) {
+            upper_links_[i].assign(levels_[i] * (max_links_ + 1), 0);
+        }
+    }
+
+    links0_.assign(rows * (max_links0_ + 1), 0);
+    locks_ = std::vector<SpinLock>(rows);
+    entry_ = 0;
+    max_level_ = levels_[0];
+    building_ = true;
+
+    ThreadPool* pool = ThreadPool::Global();
+    std::vector<SearchContext> contexts(std::max(pool->size(), static_cast<size_t>(1)));
+    pool->ParallelFor(1, rows, [&] (size_t worker_id, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            Insert(static_cast<uint32_t>(i), ef_construction, &contexts[worker_id]);
+        }
+    }, 256);
+
+    building_ = false;
+    return true;
+}
+
+void HnswIndex::Neighbors(size_t id, size_t level, SearchContext* context) {
+    if (building_) {
+        locks_[id].lock();
+    }
+    const uint32_t* links = Links(id, level);
+    context->neighbors.assign(links + 1, links + 1 + links[0]);
+    if (building_) {
+        locks_[id].unlock();
+    }
+}
+
+std::vector<HnswIndex::candidate_t> HnswIndex::SearchLevel(
+    const float* query,
+    candidate_t entry,
+    size_t ef,
+    size_t level,
+    SearchContext* context
+) {
+    if (context->visited.size() != levels_.size() || ++context->tag == 0) {
+        context->visited.assign(levels_.size(), 0);
+        context->tag = 1;
+    }
+
+    // candidates to expand, best on top; results, worst on top
+    std::priority_queue<candidate_t> candidates;
+    std::priority_queue<candidate_t, std::vector<candidate_t>, std::greater<candidate_t> > results;
+    candidates.push(entry);
+    results.push(entry);
+    context->visited[entry.second] = context->tag;
+
+    while (!candidates.empty()) {
+        candidate_t current = candidates.top();
+        if (current.first < results.top().first && results.size() >= ef) {
+            break;
+        }
+        candidates.pop();
+
+        // the rows of a list are scattered, load them all before scoring
+        Neighbors(current.second, level, context);
+        for (uint32_t neighbor : context->neighbors) {
+            if (context->visited[neighbor] != context->tag) {
+                model_->Prefetch(neighbor);
+            }
+        }
+
+        for (uint32_t neighbor : context->neighbors) {
+            if (context->visited[neighbor] == context->tag) {
+                continue;
+            }
+            context->visited[neighbor] = context->tag;
+
+            float score = model_->Score(query, neighbor, score_type_, &context->row);
+            if (results.size() < ef || score > results.top().first) {
+                candidates.push(candidate_t(score, neighbor));
+                results.push(candidate_t(score, neighbor));
+                if (results.size() > ef) {
+                    results.pop();
+                }
+            }
+        }
+    }
+
+    std::vector<candidate_t> best(results.size());
+    for (size_t i = best.size(); i > 0; --i) {
+        best[i - 1] = results.top();
+        results.pop();
+    }
+    return best;
+}
+
+void HnswIndex::SelectNeighbors(
+    std::vector<candidate_t>* candidates,
+    size_t max_links,
+    SearchContext* context
+) {
+    if (candidates->size() <= max_links) {
+        return;
+    }
+
+    std::vector<candidate_t> selected;
+    for (const candidate_t& candidate : *candidates) {
+        if (selected.size() >= max_links) {
+            break;
+        }
+
+        // a candidate closer to a kept one than to the query is reached
+        // through it, which keeps the links of a cluster from crowding out
+        // the links that leave it
+        const float* row = model_->ScaleQuery(
+            model_->Row(candidate.second, &context->other), score_type_, &context->query);
+        bool keep = true;
+        for (const candidate_t& kept : selected) {
+            if (model_->Score(row, kept.second, score_type_, &context->row) > candidate.first) {
+                keep = false;
+                break;
+            }
+        }
+        if (keep) {
+            selected.push_back(candidate);
+        }
+    }
+
+    candidates->swap(selected);
+}
+
+void HnswIndex::Connect(uint32_t neighbor, uint32_t id, size_t level, SearchContext* context) {
+    size_t max_links = level == 0 ? max_links0_ : max_links_;
+
+    std::lock_guard<SpinLock> lock(locks_[neighbor]);
+    uint32_t* links = Links(neighbor, level);
+    if (links[0] < max_links) {
+        links[links[0] + 1] = id;
+        ++links[0];
+        return;
+    }
+
+    // the list is full: choose again among the old neighbors and id, by
+    // their scores against the neighbor
+    const float* row = model_->ScaleQuery(
+        model_->Row(neighbor, &context->other), score_type_, &context->query);
+    std::vector<candidate_t> candidates;
+    candidates.push_back(candidate_t(model_->Score(row, id, score_type_, &context->row), id));
+    for (size_t i = 1; i <= links[0]; ++i) {
+        candidates.push_back(candidate_t(
+            model_->Score(row, links[i], score_type_, &context->row), links[i]));
+    }
+    std::sort(candidates.begin(), candidates.end(), std::greater<candidate_t>());
+    SelectNeighbors(&candidates, max_links, context);
+
+    links[0] = static_cast<uint32_t>(candidates.size());
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        links[i + 1] = candidates[i].second;
+    }
+}
+
+void HnswIndex::Insert(uint32_t id, size_t ef_construction, SearchContext* context) {
+    size_t level = levels_[id];
+
+    // a new top level keeps the entry lock until the row is linked
+    std::unique_lock<std::mutex> entry_lock(entry_mutex_);
+    size_t max_level = max_level_;
+    uint32_t entry = entry_;
+    if (level <= max_level) {
+        entry_lock.unlock();
+    }
+
+    // an own copy, the buffers of the context are reused below
+    std::vector<float> query_buffer;
+    const float* query = model_->ScaleQuery(
+        model_->Row(id, &context->other), score_type_, &query_buffer);
+    if (query != query_buffer.data()) {
+        query_buffer.assign(query, query + model_->hidden_size());
+        query = query_buffer.data();
+    }
+
+    candidate_t current(model_->Score(query, entry, score_type_, &context->row), entry);
+    for (size_t l = max_level; l > level; --l) {
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            Neighbors(current.second, l, context);
+            for (uint32_t neighbor : context->neighbors) {
+                float score = model_->Score(query, neighbor, score_type_, &context->row);
+                if (score > current.first) {
+                    current = candidate_t(score, neighbor);
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    for (size_t l = std::min(level, max_level) + 1; l-- > 0;) {
+        std::vector<candidate_t> candidates = SearchLevel(query, current, ef_construction, l, context);
+        current = candidates[0];
+        SelectNeighbors(&candidates, max_links_, context);
+
+        {
+            std::lock_guard<SpinLock> lock(locks_[id]);
+            uint32_t* links = Links(id, l);
+            links[0] = static_cast<uint32_t>(candidates.size());
+            for (size_t i = 0; i < candidates.size(); ++i) {
+                links[i + 1] = candidates[i].second;
+            }
+        }
+
+        for (const candidate_t& candidate : candidates) {
+            Connect(candidate.second, id, l, context);
+        }
+    }
+
+    if (level > max_level) {
+        max_level_ = level;
+        entry_ = id;
+    }
+}
+
+std::vector<TopK::entry_t> HnswIndex::Search(const float* embedding, size_t topn, size_t ef) {
+    std::vector<TopK::entry_t> best;
+    if (levels_.empty() || topn == 0) {
+        return best;
+    }
+
+    SearchContext* context = AcquireContext();
+    const float* query = model_->ScaleQuery(embedding, score_type_, &context->query);
+
+    candidate_t current(model_->Score(query, entry_, score_type_, &context->row), entry_);
+    for (size_t l = max_level_; l > 0; --l) {
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            Neighbors(current.second, l, context);
+            for (uint32_t neighbor : context->neighbors) {
+                float score = model_->Score(query, neighbor, score_type_, &context->row);
+                if (score > current.first) {
+                    current = candidate_t(score, neighbor);
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    std::vector<candidate_t> candidates = SearchLevel(query, current, std::max(ef, topn), 0, context);
+    ReleaseContext(context);
+
+    best.reserve(std::min(topn, candidates.size()));
+    for (size_t i = 0; i < candidates.size() && i < topn; ++i) {
+        best.push_back(TopK::entry_t(candidates[i].first, candidates[i].second));
+    }
+    return best;
+}
+
+HnswIndex::SearchContext* HnswIndex::AcquireContext() {
+    std::lock_guard<std::mutex> lock(contexts_mutex_);
+    if (contexts_.empty()) {
+        return new SearchContext();
+    }
+
+    SearchContext* context = contexts_.back();
+    contexts_.pop_back();
+    return context;
+}
+
+void HnswIndex::ReleaseContext(SearchContext* context) {
+    std::lock_guard<std::mutex> lock(contexts_mutex_);
+    contexts_.push_back(context);
+}
+
+bool HnswIndex::Save(const char* path) {
+    std::string tmp_path = std::string(path) + ".tmp";
+    FILE* fp = fopen(tmp_path.c_str(), "wb");
+    if (!fp) {
+        return false;
+    }
+
+    HnswIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HNSW_INDEX_MAGIC, sizeof(header.magic));
+    header.version = HNSW_INDEX_VERSION;
+    header.score_type = score_type_;
+    header.max_links = max_links_;
+    header.max_level = max_level_;
+    header.entry = entry_;
+    header.rows = levels_.size();
+    header.hidden_size = model_->hidden_size();
+    header.fingerprint = model_->Fingerprint();
+
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+        fwrite(levels_.data(), 1, levels_.size(), fp) == levels_.size() &&
+        fwrite(links0_.data(), sizeof(uint32_t), links0_.size(), fp) == links0_.size();
+    for (size_t i = 0; ok && i < upper_links_.size(); ++i) {
+        const std::vector<uint32_t>& links = upper_links_[i];
+        ok = fwrite(links.data(), sizeof(uint32_t), links.size(), fp) == links.size();
+    }
+
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok || rename(tmp_path.c_str(), path) != 0) {
+        remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool HnswIndex::Load(const char* path, EmbeddingModel* model) {
+    FILE* fp = fopen(path, "rb");
+    if (!fp) {
+        return false;
+    }
+
+    HnswIndexHeader header;
+    bool ok = fread(&header, sizeof(header), 1, fp) == 1 &&
+        memcmp(header.magic, HNSW_INDEX_MAGIC, sizeof(header.magic)) == 0 &&
+        header.version == HNSW_INDEX_VERSION &&
+        header.rows == model->size() && header.hidden_size == model->hidden_size() &&
+        header.max_links >= 2 && header.max_links <= UINT32_MAX / 4 &&
+        header.max_level <= HNSW_MAX_LEVEL && header.entry < header.rows &&
+        header.fingerprint == model->Fingerprint();
+
+    if (ok) {
+        model_ = model;
+        score_type_ = static_cast<ScoreType>(header.score_type);
+        max_links_ = header.max_links;
+        max_links0_ = 2 * header.max_links;
+        max_level_ = header.max_level;
+        entry_ = static_cast<uint32_t>(header.entry);
+
+        levels_.resize(header.rows);
+        links0_.resize(header.rows * (max_links0_ + 1));
+        ok = fread(levels_.data(), 1, levels_.size(), fp) == levels_.size() &&
+            fread(links0_.data(), sizeof(uint32_t), links0_.size(), fp) == links0_.size();
+
+        upper_links_.assign(header.rows, std::vector<uint32_t>());
+        for (size_t i = 0; ok && i < header.rows; ++i) {
+            ok = levels_[i] <= max_level_;
+            if (ok && levels_[i] > 0) {
+                std::vector<uint32_t>& links = upper_links_[i];
+                links.resize(levels_[i] * (max_links_ + 1));
+                ok = fread(links.data(), sizeof(uint32_t), links.size(), fp) == links.size();
+            }
+        }
+
+        // Search() follows the lists without checks: every count must fit
+        // its list, every id be a row that has the level of the list, and
+        // the entry must reach the top level
+        ok = ok && levels_[entry_] == max_level_;
+        for (size_t i = 0; ok && i < header.rows; ++i) {
+            for (size_t l = 0; ok && l <= levels_[i]; ++l) {
+                const uint32_t* links = Links(i, l);
+                ok = links[0] <= (l == 0 ? max_links0_ : max_links_);
+                for (size_t j = 1; ok && j <= links[0]; ++j) {
+                    ok = links[j] < header.rows && levels_[links[j]] >= l;
+                }
+            }
+        }
+    }
+
+    fclose(fp);
+    if (!ok) {
+        levels_.clear();
+        links0_.clear();
+        upper_links_.clear();
+    }
+    return ok;
+}
+/* vim: set ts=4 sw=4 tw=0 et :*/
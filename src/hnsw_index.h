@@ -0,0 +1,129 @@
+#ifndef SRC_HNSW_INDEX_H
+#define SRC_HNSW_INDEX_H
+
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "src/embedding_model.h"
+#include "src/lock.h"
+
+static const char HNSW_INDEX_MAGIC[8] = {'B', 'W', '2', 'V', 'H', 'N', 'S', 'W'};
+static const uint32_t HNSW_INDEX_VERSION = 2;
+
+const size_t DEF_HNSW_M = 16;
+const size_t DEF_HNSW_EF_CONSTRUCTION = 200;
+const size_t DEF_HNSW_EF = 64;
+
+// Hierarchical navigable small world graph over the rows of an
+// EmbeddingModel (Malkov & Yashunin). The index holds the graph only, the
+// vectors are read from the model, which must outlive it. Scores are the
+// ones of Match(), cosine or dot, larger is closer.
+//
+// On disk: header | uint8 level of every row | level 0 lists of
+// (uint32 count, 2 * m uint32 ids) | upper lists of (uint32 count, m
+// uint32 ids) for levels 1..level of every row with level > 0
+class HnswIndex {
+public:
+    HnswIndex();
+    virtual ~HnswIndex();
+
+    // insert the rows of model concurrently on the global pool, every
+    // neighbor list has its own lock
+    bool Build(
+        EmbeddingModel* model,
+        ScoreType score_type,
+        size_t m = DEF_HNSW_M,
+        size_t ef_construction = DEF_HNSW_EF_CONSTRUCTION,
+        unsigned seed = 1
+    );
+
+    bool Save(const char* path);
+
+    // false unless path holds an index built on the rows of model, as told
+    // by EmbeddingModel::Fingerprint(); the index of a retrained model is stale
+    bool Load(const char* path, EmbeddingModel* model);
+
+    // the best topn rows for embedding, searching with max(ef, topn)
+    // candidates on the bottom level; safe to call concurrently
+    std::vector<TopK::entry_t> Search(const float* embedding, size_t topn, size_t ef = DEF_HNSW_EF);
+
+public:
+    inline ScoreType score_type() {
+        return score_type_;
+    }
+
+    inline size_t size() {
+        return levels_.size();
+    }
+
+private:
+    typedef std::pair<float, uint32_t> candidate_t;
+
+    // per thread state of a search: visited marks and decode buffers
+    struct SearchContext {
+        std::vector<uint32_t> visited;
+        uint32_t tag;
+        std::vector<float> row;
+        std::vector<float> query;
+        std::vector<float> other;
+        std::vector<uint32_t> neighbors;
+
+        SearchContext() : tag {0} {}
+    };
+
+    // list of id at level: count followed by the capacity of ids
+    inline uint32_t* Links(size_t id, size_t level) {
+        if (level == 0) {
+            return &links0_[id * (max_links0_ + 1)];
+        }
+        return &upper_links_[id][(level - 1) * (max_links_ + 1)];
+    }
+
+    // copy of the neighbors of id at level, locked while building
+    void Neighbors(size_t id, size_t level, SearchContext* context);
+
+    void Insert(uint32_t id, size_t ef_construction, SearchContext* context);
+
+    // best first candidates of level, at most ef, reachable from entry
+    std::vector<candidate_t> SearchLevel(
+        const float* query,
+        candidate_t entry,
+        size_t ef,
+        size_t level,
+        SearchContext* context
+    );
+
+    // keep up to max_links candidates (best first) that are closer to
+    // the query than to every candidate kept before them
+    void SelectNeighbors(std::vector<candidate_t>* candidates, size_t max_links, SearchContext* context);
+
+    // add id to the list of neighbor at level, shrinking a full list
+    void Connect(uint32_t neighbor, uint32_t id, size_t level, SearchContext* context);
+
+    SearchContext* AcquireContext();
+
+    void ReleaseContext(SearchContext* context);
+
+private:
+    EmbeddingModel* model_;
+    ScoreType score_type_;
+    size_t max_links_;
+    size_t max_links0_;
+    size_t max_level_;
+    uint32_t entry_;
+    bool building_;
+
+    std::vector<uint8_t> levels_;
+    std::vector<uint32_t> links0_;
+    std::vector<std::vector<uint32_t> > upper_links_;
+    std::vector<SpinLock> locks_;
+    std::mutex entry_mutex_;
+
+    std::vector<SearchContext*> contexts_;
+    std::mutex contexts_mutex_;
+};
+
+#endif // SRC_HNSW_INDEX_H
+/* vim: set ts=4 sw=4 tw=0 et :*/
@@ -0,0 +1,124 @@
+#ifndef SRC_HOT_ROWS_H
+#define SRC_HOT_ROWS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// The set of most frequently touched rows of an embedding matrix, shared
+// by all training threads.
+class HotRowSet {
+public:
+    HotRowSet() {}
+
+    // keep the `count` ids with the largest scores
+    void Build(const std::vector<double>& scores, size_t count) {
+        count = std::min(count, scores.size());
+        ids_.resize(scores.size());
+        for (size_t i = 0; i < ids_.size(); ++i) {
+            ids_[i] = i;
+        }
+
+        std::partial_sort(
+            ids_.begin(),
+            ids_.begin() + count,
+            ids_.end(),
+            [&] (size_t left, size_t right) {
+                return scores[left] > scores[right];
+            }
+        );
+        ids_.resize(count);
+
+        slot_.assign(scores.size(), -1);
+        for (size_t i = 0; i < ids_.size(); ++i) {
+            slot_[ids_[i]] = static_cast<int32_t>(i);
+        }
+    }
+
+    inline int32_t slot(size_t id) const {
+        return id < slot_.size() ? slot_[id] : -1;
+    }
+
+    inline size_t id(size_t slot) const {
+        return ids_[slot];
+    }
+
+    inline size_t size() const {
+        return ids_.size();
+    }
+
+private:
+    std::vector<size_t> ids_;
+    std::vector<int32_t> slot_;
+};
+
+// Per-thread copies of the hot rows of a matrix. Updates to hot rows stay
+// in the local copy and are merged into the master matrix by Sync(), so
+// threads stop invalidating each other's cache lines on popular rows. A
+// row is copied from the master on its first use after a sync, and only
+// the rows used since the last sync are merged, so a sync costs the rows
+// a thread touched, not the whole hot set.
+template <typename T>
+class HotRowReplica {
+public:
+    HotRowReplica(const HotRowSet* hot_rows, T* master, size_t hidden_size)
+    : hot_rows_(hot_rows), master_(master), hidden_size_(hidden_size) {
+        local_.resize(hot_rows_->size() * hidden_size_);
+        base_.resize(hot_rows_->size() * hidden_size_);
+        dirty_.assign(hot_rows_->size(), 0);
+        dirty_slots_.reserve(hot_rows_->size());
+    }
+
+    inline T* Row(size_t id) {
+        int32_t slot = hot_rows_->slot(id);
+        if (slot < 0) {
+            return master_ + id * hidden_size_;
+        }
+
+        T* local_row = &local_[slot * hidden_size_];
+        if (!dirty_[slot]) {
+            const T* master_row = master_ + id * hidden_size_;
+            std::copy(master_row, master_row + hidden_size_, local_row);
+            std::copy(master_row, master_row + hidden_size_, &base_[slot * hidden_size_]);
+            dirty_[slot] = 1;
+            dirty_slots_.push_back(slot);
+        }
+        return local_row;
+    }
+
+    // the row Row() would read, without copying it in; for prefetching
+    inline const T* PeekRow(size_t id) const {
+        int32_t slot = hot_rows_->slot(id);
+        if (slot < 0 || !dirty_[slot]) {
+            return master_ + id * hidden_size_;
+        }
+        return &local_[slot * hidden_size_];
+    }
+
+    // add the local change since the last sync of every row used since
+    // then to the master rows; their next use copies the merged values
+    void Sync() {
+        for (int32_t slot : dirty_slots_) {
+            T* master_row = master_ + hot_rows_->id(slot) * hidden_size_;
+            const T* local_row = &local_[slot * hidden_size_];
+            const T* base_row = &base_[slot * hidden_size_];
+            for (size_t i = 0; i < hidden_size_; ++i) {
+                master_row[i] += local_row[i] - base_row[i];
+            }
+            dirty_[slot] = 0;
+        }
+        dirty_slots_.clear();
+    }
+
+private:
+    const HotRowSet* hot_rows_;
+    T* master_;
+    size_t hidden_size_;
+    std::vector<T> local_;
+    std::vector<T> base_;
+    std::vector<uint8_t> dirty_;
+    std::vector<int32_t> dirty_slots_;
+};
+
+#endif // SRC_HOT_ROWS_H
+/* vim: set ts=4 sw=4 tw=0 et :*/
@@ -0,0 +1,320 @@
+#include "src/ivf_index.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+
+#include "src/thread_pool.h"
+
+struct IvfIndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t score_type;
+    uint64_t nlist;
+    uint64_t subspaces;
+    uint64_t rows;
+    uint64_t hidden_size;
+    uint64_t fingerprint;
+};
+
+// rows of a list loaded ahead of the one being scored
+static const size_t IVF_PREFETCH_DISTANCE = 8;
+
+IvfIndex::IvfIndex()
+: model_ {nullptr},
+  score_type_ {SCORE_COSINE},
+  hidden_size_ {0} {
+}
+
+IvfIndex::~IvfIndex() {
+}
+
+bool IvfIndex::Build(
+    EmbeddingModel* model,
+    ScoreType score_type,
+    size_t nlist,
+    size_t code_subspaces,
+    unsigned seed
+) {
+    size_t rows = model->size();
+    if (rows == 0 || rows > UINT32_MAX || nlist == 0) {
+        return false;
+    }
+
+    model_ = model;
+    score_type_ = score_type;
+    hidden_size_ = model->hidden_size();
+    nlist = std::min(nlist, rows);
+    if (code_subspaces > 0) {
+        code_subspaces = PQSubspaces(hidden_size_, code_subspaces);
+    }
+
+    // the centroids are trained on a random sample of the rows, scaled as
+    // the queries will be
+    std::mt19937 rng(seed);
+    std::vector<size_t> sample(rows);
+    for (size_t i = 0; i < rows; ++i) {
+        sample[i] = i;
+    }
+    size_t samples = std::min(rows, nlist * IVF_TRAIN_ROWS_PER_LIST);
+    if (samples < rows) {
+        std::shuffle(sample.begin(), sample.end(), rng);
+        sample.resize(samples);
+        std::sort(sample.begin(), sample.end());
+    }
+
+    ThreadPool* pool = ThreadPool::Global();
+    std::vector<float> sample_rows(samples * hidden_size_);
+    pool->ParallelFor(0, samples, [&] (size_t, size_t begin, size_t end) {
+        std::vector<float> row;
+        std::vector<float> scaled;
+        for (size_t i = begin; i < end; ++i) {
+            const float* x = model_->ScaleQuery(model_->Row(sample[i], &row), score_type_, &scaled);
+            std::copy(x, x + hidden_size_, &sample_rows[i * hidden_size_]);
+        }
+    });
+
+    std::vector<uint32_t> assignment = KMeans(sample_rows.data(), samples, hidden_size_,
+        hidden_size_, nlist, IVF_TRAIN_ITERATIONS, &centroids_);
+    centroid_norms_ = CentroidNorms(centroids_.data(), nlist, hidden_size_);
+
+    // the codes quantize what the centroid of its list leaves of a row
+    pq_ = ProductQuantizer();
+    if (code_subspaces > 0) {
+        for (size_t i = 0; i < samples; ++i) {
+            const float* centroid = &centroids_[assignment[i] * hidden_size_];
+            for (size_t d = 0; d < hidden_size_; ++d) {
+                sample_rows[i * hidden_size_ + d] -= centroid[d];
+            }
+        }
+        pq_.Train(sample_rows.data(), samples, hidden_size_, code_subspaces, seed);
+    }
+    std::vector<float>().swap(sample_rows);
+
+    std::vector<uint32_t> lists(rows);
+    std::vector<uint8_t> row_codes(rows * code_subspaces);
+    pool->ParallelFor(0, rows, [&] (size_t, size_t begin, size_t end) {
+        std::vector<float> row;
+        std::vector<float> scaled;
+        std::vector<float> residual(hidden_size_);
+        for (size_t i = begin; i < end; ++i) {
+            const float* x = model_->ScaleQuery(model_->Row(i, &row), score_type_, &scaled);
+            size_t list = NearestCentroid(x, centroids_.data(), nlist, hidden_size_, centroid_norms_.data());
+            lists[i] = static_cast<uint32_t>(list);
+            if (code_subspaces > 0) {
+                const float* centroid = &centroids_[list * hidden_size_];
+                for (size_t d = 0; d < hidden_size_; ++d) {
+                    residual[d] = x[d] - centroid[d];
+                }
+                pq_.Encode(residual.data(), &row_codes[i * code_subspaces]);
+            }
+        }
+    }, 1024);
+
+    // group the ids and codes by list, ascending ids within a list
+    offsets_.assign(nlist + 1, 0);
+    for (size_t i = 0; i < rows; ++i) {
+        ++offsets_[lists[i] + 1];
+    }
+    for (size_t l = 0; l < nlist; ++l) {
+        offsets_[l + 1] += offsets_[l];
+    }
+
+    std::vector<uint64_t> next(offsets_.begin(), offsets_.end() - 1);
+    ids_.resize(rows);
+    codes_.resize(rows * code_subspaces);
+    for (size_t i = 0; i < rows; ++i) {
+        size_t j = next[lists[i]]++;
+        ids_[j] = static_cast<uint32_t>(i);
+        std::copy(&row_codes[i * code_subspaces], &row_codes[(i + 1) * code_subspaces],
+            &codes_[j * code_subspaces]);
+    }
+
+    return true;
+}
+
+std::vector<size_t> IvfIndex::ProbeLists(const float* query, size_t nprobe) {
+    size_t lists = nlist();
+    nprobe = std::min(std::max(nprobe, static_cast<size_t>(1)), lists);
+
+    // |query - centroid|^2 up to |query|^2, smallest first
+    std::vector<std::pair<float, size_t> > dists(lists);
+    for (size_t l = 0; l < lists; ++l) {
+        dists[l].first = centroid_norms_[l] - 2 * util_dot(query, &centroids_[l * hidden_size_], hidden_size_);
+        dists[l].second = l;
+    }
+    std::partial_sort(dists.begin(), dists.begin() + nprobe, dists.end());
+
+    std::vector<size_t> probes(nprobe);
+    for (size_t i = 0; i < nprobe; ++i) {
+        probes[i] = dists[i].second;
+    }
+    return probes;
+}
+
+std::vector<TopK::entry_t> IvfIndex::Search(
+    const float* embedding,
+    size_t topn,
+    size_t nprobe,
+    size_t rerank
+) {
+    if (ids_.empty() || topn == 0) {
+        return std::vector<TopK::entry_t>();
+    }
+
+    std::vector<float> query_buffer;
+    std::vector<float> row;
+    const float* query = model_->ScaleQuery(embedding, score_type_, &query_buffer);
+    std::vector<size_t> probes = ProbeLists(query, nprobe);
+
+    size_t subspaces = pq_.subspaces();
+    if (subspaces == 0) {
+        TopK top(topn);
+        for (size_t list : probes) {
+            size_t end = offsets_[list + 1];
+            for (size_t j = offsets_[list]; j < end; ++j) {
+                if (j + IVF_PREFETCH_DISTANCE < end) {
+                    model_->Prefetch(ids_[j + IVF_PREFETCH_DISTANCE]);
+                }
+                top.Push(model_->Score(query, ids_[j], score_type_, &row), ids_[j]);
+            }
+        }
+        return top.Sorted();
+    }
+
+    // query . (centroid + residual) by table lookups: the score of every
+    // subspace of the query against each of its code centroids
+    size_t sub_dim = hidden_size_ / subspaces;
+    const float* code_centroids = pq_.centroids().data();
+    std::vector<float> table(subspaces * PQ_CENTROIDS);
+    for (size_t m = 0; m < subspaces; ++m) {
+        for (size_t k = 0; k < PQ_CENTROIDS; ++k) {
+            table[m * PQ_CENTROIDS + k] = util_dot(query + m * sub_dim,
+                code_centroids + (m * PQ_CENTROIDS + k) * sub_dim, sub_dim);
+        }
+    }
+
+    TopK candidates(std::max(rerank == 0 ? 4 * topn : rerank, topn));
+    for (size_t list : probes) {
+        float base = util_dot(query, &centroids_[list * hidden_size_], hidden_size_);
+        for (size_t j = offsets_[list]; j < offsets_[list + 1]; ++j) {
+            const uint8_t* codes = &codes_[j * subspaces];
+            float score = base;
+            for (size_t m = 0; m < subspaces; ++m) {
+                score += table[m * PQ_CENTROIDS + codes[m]];
+            }
+            candidates.Push(score, ids_[j]);
+        }
+    }
+
+    const std::vector<TopK::entry_t>& sorted = candidates.Sorted();
+    for (const TopK::entry_t& candidate : sorted) {
+        model_->Prefetch(candidate.second);
+    }
+    TopK top(topn);
+    for (const TopK::entry_t& candidate : sorted) {
+        top.Push(model_->Score(query, candidate.second, score_type_, &row), candidate.second);
+    }
+    return top.Sorted();
+}
+
+size_t IvfIndex::bytes() {
+    return centroids_.size() * sizeof(float) + offsets_.size() * sizeof(uint64_t) +
+        ids_.size() * sizeof(uint32_t) + pq_.centroids().size() * sizeof(float) + codes_.size();
+}
+
+bool IvfIndex::Save(const char* path) {
+    std::string tmp_path = std::string(path) + ".tmp";
+    FILE* fp = fopen(tmp_path.c_str(), "wb");
+    if (!fp) {
+        return false;
+    }
+
+    IvfIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IVF_INDEX_MAGIC, sizeof(header.magic));
+    header.version = IVF_INDEX_VERSION;
+    header.score_type = score_type_;
+    header.nlist = nlist();
+    header.subspaces = pq_.subspaces();
+    header.rows = ids_.size();
+    header.hidden_size = hidden_size_;
+    header.fingerprint = model_->Fingerprint();
+
+    const std::vector<float>& code_centroids = pq_.centroids();
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+        fwrite(centroids_.data(), sizeof(float), centroids_.size(), fp) == centroids_.size() &&
+        fwrite(offsets_.data(), sizeof(uint64_t), offsets_.size(), fp) == offsets_.size() &&
+        fwrite(ids_.data(), sizeof(uint32_t), ids_.size(), fp) == ids_.size() &&
+        fwrite(code_centroids.data(), sizeof(float), code_centroids.size(), fp) == code_centroids.size() &&
+        fwrite(codes_.data(), 1, codes_.size(), fp) == codes_.size();
+
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok || rename(tmp_path.c_str(), path) != 0) {
+        remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool IvfIndex::Load(const char* path, EmbeddingModel* model) {
+    FILE* fp = fopen(path, "rb");
+    if (!fp) {
+        return false;
+    }
+
+    IvfIndexHeader header;
+    bool ok = fread(&header, sizeof(header), 1, fp) == 1 &&
+        memcmp(header.magic, IVF_INDEX_MAGIC, sizeof(header.magic)) == 0 &&
+        header.version == IVF_INDEX_VERSION &&
+        header.rows == model->size() && header.hidden_size == model->hidden_size() &&
+        header.nlist > 0 && header.nlist <= header.rows &&
+        (header.subspaces == 0 || header.hidden_size % header.subspaces == 0) &&
+        header.fingerprint == model->Fingerprint();
+
+    if (ok) {
+        model_ = model;
+        score_type_ = static_cast<ScoreType>(header.score_type);
+        hidden_size_ = header.hidden_size;
+
+        centroids_.resize(header.nlist * hidden_size_);
+        offsets_.resize(header.nlist + 1);
+        ids_.resize(header.rows);
+        std::vector<float> code_centroids(header.subspaces * PQ_CENTROIDS * (hidden_size_ /
+            std::max(header.subspaces, static_cast<uint64_t>(1))));
+        codes_.resize(header.rows * header.subspaces);
+        ok = fread(centroids_.data(), sizeof(float), centroids_.size(), fp) == centroids_.size() &&
+            fread(offsets_.data(), sizeof(uint64_t), offsets_.size(), fp) == offsets_.size() &&
+            fread(ids_.data(), sizeof(uint32_t), ids_.size(), fp) == ids_.size() &&
+            fread(code_centroids.data(), sizeof(float), code_centroids.size(), fp) == code_centroids.size() &&
+            fread(codes_.data(), 1, codes_.size(), fp) == codes_.size();
+
+        ok = ok && offsets_[0] == 0 && offsets_.back() == header.rows;
+        for (size_t l = 0; ok && l < header.nlist; ++l) {
+            ok = offsets_[l] <= offsets_[l + 1];
+        }
+        for (size_t i = 0; ok && i < ids_.size(); ++i) {
+            ok = ids_[i] < header.rows;
+        }
+
+        pq_ = ProductQuantizer();
+        if (ok && header.subspaces > 0) {
+            ok = pq_.SetCentroids(hidden_size_, header.subspaces, code_centroids.data());
+        }
+        if (ok) {
+            centroid_norms_ = CentroidNorms(centroids_.data(), header.nlist, hidden_size_);
+        }
+    }
+
+    fclose(fp);
+    if (!ok) {
+        centroids_.clear();
+        offsets_.clear();
+        ids_.clear();
+        codes_.clear();
+    }
+    return ok;
+}
+/* vim: set ts=4 sw=4 tw=0 et :*/
@@ -0,0 +1,96 @@
+#ifndef SRC_IVF_INDEX_H
+#define SRC_IVF_INDEX_H
+
+#include <cstdint>
+#include <vector>
+
+#include "src/embedding_model.h"
+#include "src/quantizer.h"
+
+static const char IVF_INDEX_MAGIC[8] = {'B', 'W', '2', 'V', 'I', 'V', 'F', '1'};
+static const uint32_t IVF_INDEX_VERSION = 2;
+
+const size_t DEF_IVF_NPROBE = 8;
+const size_t IVF_TRAIN_ROWS_PER_LIST = 64;
+const size_t IVF_TRAIN_ITERATIONS = 10;
+
+// Inverted file over the rows of an EmbeddingModel: k-means splits the
+// rows (scaled as queries are) into nlist lists, a query scans the rows of
+// the nprobe lists whose centroids are closest. With residual codes every
+// row also keeps the product quantization codes of row - centroid, the
+// lists are scanned on the codes alone and only the best candidates are
+// scored exactly against the model, which must outlive the index.
+//
+// On disk: header | nlist x hidden centroids | nlist + 1 uint64 offsets |
+// uint32 ids grouped by list | subspaces x 256 x (hidden / subspaces) code
+// centroids | subspaces uint8 codes per id, in the order of the ids
+class IvfIndex {
+public:
+    IvfIndex();
+    virtual ~IvfIndex();
+
+    // train nlist coarse centroids and, with code_subspaces > 0, the
+    // residual codes, on the global pool
+    bool Build(
+        EmbeddingModel* model,
+        ScoreType score_type,
+        size_t nlist,
+        size_t code_subspaces = 0,
+        unsigned seed = 1
+    );
+
+    bool Save(const char* path);
+
+    // false unless path holds an index built on the rows of model, as told
+    // by EmbeddingModel::Fingerprint(); the index of a retrained model is stale
+    bool Load(const char* path, EmbeddingModel* model);
+
+    // the best topn rows of the nprobe closest lists; with codes the best
+    // max(rerank, topn) rows by code are scored exactly, rerank 0 for 4 *
+    // topn. Safe to call concurrently
+    std::vector<TopK::entry_t> Search(
+        const float* embedding,
+        size_t topn,
+        size_t nprobe = DEF_IVF_NPROBE,
+        size_t rerank = 0
+    );
+
+    // bytes of the centroids, lists and codes
+    size_t bytes();
+
+public:
+    inline ScoreType score_type() {
+        return score_type_;
+    }
+
+    inline size_t size() {
+        return ids_.size();
+    }
+
+    inline size_t nlist() {
+        return offsets_.empty() ? 0 : offsets_.size() - 1;
+    }
+
+    inline size_t code_subspaces() {
+        return pq_.subspaces();
+    }
+
+private:
+    // the nprobe lists closest to query by l2 distance to their centroids
+    std::vector<size_t> ProbeLists(const float* query, size_t nprobe);
+
+private:
+    EmbeddingModel* model_;
+    ScoreType score_type_;
+    size_t hidden_size_;
+
+    std::vector<float> centroids_;
+    std::vector<float> centroid_norms_;
+    std::vector<uint64_t> offsets_;
+    std::vector<uint32_t> ids_;
+    ProductQuantizer pq_;
+    std::vector<uint8_t> codes_;
+};
+
+#endif // SRC_IVF_INDEX_H
+/* vim: set ts=4 sw=4 tw=0 et :*/
@@ -0,0 +1,238 @@
+#include <getopt.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "src/embedding_model.h"
+#include "src/thread_pool.h"
+
+enum SearchSpace { SPACE_SOURCE = 0, SPACE_TARGET = 1, SPACE_ALIGNMENT = 2 };
+
+enum OutputFormat { OUTPUT_TSV = 0, OUTPUT_BINARY = 1 };
+
+// query rows matched at once, bounds the memory of the results
+const size_t EXPORT_CHUNK_SIZE = 16384;
+
+// Binary k nearest neighbor graph:
+//
+//   header | topn (uint32 row id, float32 score) entries per query row
+//
+// Query rows follow the row order of the query matrix, result ids index
+// the rows of the matched matrix; a row with fewer than topn results is
+// padded with id KNN_PAD_ID.
+struct KnnFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t topn;
+    uint64_t rows;
+};
+
+struct KnnEntry {
+    uint32_t id;
+    float score;
+};
+
+static const char KNN_FILE_MAGIC[8] = {'B', 'W', '2', 'V', 'K', 'N', 'N', '1'};
+static const uint32_t KNN_FILE_VERSION = 1;
+static const uint32_t KNN_PAD_ID = std::numeric_limits<uint32_t>::max();
+
+void print_usage(int argc, char **argv) {
+    printf("Usage: %s --model model_path [options]\n"
+        "options:\n"
+        "--output path : write the graph to path, default stdout (tsv only)\n"
+        "--format tsv|binary : write source, target and score lines, or the "
+        "binary graph of row ids, default tsv\n"
+        "--topn n : set number of neighbors per row, default 20\n"
+        "--space source|target|alignment : match the rows of .source against "
+        ".target (alignment), or the rows of one matrix against each other "
+        "without the row itself, default alignment\n"
+        "--score-func cosine|dot : set scoring function, default cosine\n"
+        "--threads n : set number of threads, default all cores\n"
+        "--help : print this help\n", argv[0]
+    );
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    int opt_idx = 0;
+
+    static struct option long_options[] = {
+        {"model", required_argument, nullptr, 'm'},
+        {"output", required_argument, nullptr, 'o'},
+        {"format", required_argument, nullptr, 'f'},
+        {"topn", required_argument, nullptr, 'n'},
+        {"space", required_argument, nullptr, 'x'},
+        {"score-func", required_argument, nullptr, 's'},
+        {"threads", required_argument, nullptr, 't'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    std::string model_path;
+    std::string output_path;
+    OutputFormat format = OUTPUT_TSV;
+    size_t topn = 20;
+    size_t threads = 0;
+    ScoreType score_type = SCORE_COSINE;
+    SearchSpace space = SPACE_ALIGNMENT;
+
+    while ((opt = getopt_long(argc, argv, "h", long_options, &opt_idx)) != -1) {
+        switch (opt) {
+        case 'm':
+            model_path = optarg;
+            break;
+        case 'o':
+            output_path = optarg;
+            break;
+        case 'f':
+            if (!strcmp(optarg, "tsv")) {
+                format = OUTPUT_TSV;
+            } else if (!strcmp(optarg, "binary")) {
+                format = OUTPUT_BINARY;
+            } else {
+                print_usage(argc, argv);
+                exit(-1);
+            }
+            break;
+        case 'n':
+            topn = static_cast<size_t>(atoi(optarg));
+            break;
+        case 'x':
+            if (!strcmp(optarg, "source")) {
+                space = SPACE_SOURCE;
+            } else if (!strcmp(optarg, "target")) {
+                space = SPACE_TARGET;
+            } else if (!strcmp(optarg, "alignment")) {
+                space = SPACE_ALIGNMENT;
+            } else {
+                print_usage(argc, argv);
+                exit(-1);
+            }
+            break;
+        case 's':
+            if (!strcmp(optarg, "cosine")) {
+                score_type = SCORE_COSINE;
+            } else if (!strcmp(optarg, "dot")) {
+                score_type = SCORE_DOT;
+            } else {
+                print_usage(argc, argv);
+                exit(-1);
+            }
+            break;
+        case 't':
+            threads = static_cast<size_t>(atoi(optarg));
+            break;
+        case 'h':
+        default:
+            print_usage(argc, argv);
+            exit(-1);
+        }
+    }
+
+    if (model_path.size() == 0 || (format == OUTPUT_BINARY && output_path.size() == 0)) {
+        print_usage(argc, argv);
+        exit(-1);
+    }
+
+    if (threads > 0) {
+        ThreadPool::InitGlobal(threads);
+    }
+
+    // within one space a single model is both the queries and the rows
+    EmbeddingModel model_source, model_target;
+    EmbeddingModel* queries = &model_source;
+    EmbeddingModel* rows = &model_target;
+    bool ok = false;
+    if (space == SPACE_ALIGNMENT) {
+        auto source_loaded = ThreadPool::Global()->Submit([&] () {
+            return model_source.LoadModel((model_path + ".source").c_str());
+        });
+        ok = model_target.LoadModel((model_path + ".target").c_str());
+        ok = source_loaded.get() && ok;
+    } else {
+        std::string path = model_path + (space == SPACE_SOURCE ? ".source" : ".target");
+        ok = model_source.LoadModel(path.c_str());
+        rows = &model_source;
+    }
+
+    if (!ok || queries->hidden_size() != rows->hidden_size()) {
+        fprintf(stderr, "failed to load %s\n", model_path.c_str());
+        return -1;
+    }
+
+    FILE* fp = output_path.size() > 0 ? fopen(output_path.c_str(), "wb") : stdout;
+    if (!fp) {
+        fprintf(stderr, "failed to open %s\n", output_path.c_str());
+        return -1;
+    }
+
+    if (format == OUTPUT_BINARY) {
+        KnnFileHeader header;
+        memcpy(header.magic, KNN_FILE_MAGIC, sizeof(header.magic));
+        header.version = KNN_FILE_VERSION;
+        header.topn = static_cast<uint32_t>(topn);
+        header.rows = queries->size();
+        fwrite(&header, sizeof(header), 1, fp);
+    }
+
+    // the row itself is the best match within one space, ask for one more
+    bool exclude_self = queries == rows;
+    size_t num_rows = queries->size();
+    std::vector<float> buffer;
+    std::vector<KnnEntry> entries(topn);
+    for (size_t begin = 0; begin < num_rows; begin += EXPORT_CHUNK_SIZE) {
+        size_t end = std::min(begin + EXPORT_CHUNK_SIZE, num_rows);
+        const float* tile = queries->Tile(begin, end, &buffer);
+        std::vector<const float*> chunk(end - begin);
+        for (size_t i = begin; i < end; ++i) {
+            chunk[i - begin] = tile + (i - begin) * queries->hidden_size();
+        }
+
+        auto res = rows->MatchBatchIds(chunk, score_type, exclude_self ? topn + 1 : topn);
+        for (size_t i = begin; i < end; ++i) {
+            size_t count = 0;
+            for (const TopK::entry_t& entry : res[i - begin]) {
+                if ((exclude_self && entry.second == i) || count == topn) {
+                    continue;
+                }
+
+                if (format == OUTPUT_TSV) {
+                    fprintf(fp, "%s\t%s\t%g\n", queries->Name(i), rows->Name(entry.second), entry.first);
+                } else {
+                    entries[count].id = static_cast<uint32_t>(entry.second);
+                    entries[count].score = entry.first;
+                }
+                ++count;
+            }
+
+            if (format == OUTPUT_BINARY) {
+                for (; count < topn; ++count) {
+                    entries[count].id = KNN_PAD_ID;
+                    entries[count].score = 0;
+                }
+                fwrite(entries.data(), sizeof(KnnEntry), topn, fp);
+            }
+        }
+
+        fprintf(stderr, "%crows: %lu/%lu", 13, end, num_rows);
+        fflush(stderr);
+    }
+    fprintf(stderr, "\n");
+
+    bool written = !ferror(fp);
+    if (fp != stdout) {
+        written = (fclose(fp) == 0) && written;
+    }
+    if (!written) {
+        fprintf(stderr, "failed to write %s\n", output_path.c_str());
+        return -1;
+    }
+
+    return 0;
+}
+/* vim: set ts=4 sw=4 tw=0 et :*/
@@ -0,0 +1,150 @@
+#include "src/mmap_file.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <algorithm>
+
+MmapFile::MmapFile() : data_ {nullptr}, size_ {0} {
+}
+
+MmapFile::~MmapFile() {
+    Close();
+}
+
+bool MmapFile::Open(const char* path, bool writable) {
+    Close();
+
+    int fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+
+    bool ret = Map(fd, static_cast<size_t>(st.st_size), writable);
+    close(fd);
+
+    if (ret) {
+        path_ = path;
+    }
+    return ret;
+}
+
+bool MmapFile::Create(const char* path, size_t size) {
+    Close();
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return false;
+    }
+
+    if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+        close(fd);
+        return false;
+    }
+
+    bool ret = Map(fd, size, true);
+    close(fd);
+
+    if (ret) {
+        path_ = path;
+    }
+    return ret;
+}
+
+bool MmapFile::CreateShared(const char* name, size_t size) {
+    Close();
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        return false;
+    }
+
+    if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+        close(fd);
+        shm_unlink(name);
+        return false;
+    }
+
+    bool ret = Map(fd, size, true);
+    close(fd);
+
+    // the mapping outlives the name and forked children inherit it, so
+    // nothing is left in /dev/shm even if the run crashes
+    shm_unlink(name);
+    if (ret) {
+        path_ = name;
+    }
+    return ret;
+}
+
+bool MmapFile::Map(int fd, size_t size, bool writable) {
+    if (size == 0) {
+        return false;
+    }
+
+    int prot = writable ? (PROT_READ | PROT_WRITE) : PROT_READ;
+    void* addr = mmap(nullptr, size, prot, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+
+    data_ = reinterpret_cast<char*>(addr);
+    size_ = size;
+    return true;
+}
+
+void MmapFile::Close() {
+    if (data_ != nullptr) {
+        munmap(data_, size_);
+    }
+
+    data_ = nullptr;
+    size_ = 0;
+    path_.clear();
+}
+
+void MmapFile::Advise(size_t offset, size_t length, int advice) {
+    if (data_ == nullptr || offset >= size_) {
+        return;
+    }
+
+    // widen to whole pages, advice on a shared mapping never loses data
+    size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t begin = offset / page_size * page_size;
+    size_t end = std::min(offset + length, size_);
+    if (begin >= end) {
+        return;
+    }
+
+    madvise(data_ + begin, end - begin, advice);
+}
+
+void MmapFile::Sync(size_t offset, size_t length) {
+    if (data_ == nullptr || offset >= size_) {
+        return;
+    }
+
+    size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t begin = offset / page_size * page_size;
+    size_t end = std::min(offset + length, size_);
+    msync(data_ + begin, end - begin, MS_SYNC);
+}
+
+void MmapFile::Release(size_t offset, size_t length) {
+    Advise(offset, length, MADV_DONTNEED);
+}
+
+void MmapFile::WillNeed(size_t offset, size_t length) {
+    Advise(offset, length, MADV_WILLNEED);
+}
+
+/* vim: set ts=4 sw=4 tw=0 et :*/
@@ -0,0 +1,62 @@
+#ifndef SRC_MMAP_FILE_H
+#define SRC_MMAP_FILE_H
+
+#include <cstddef>
+#include <string>
+
+// A file mapped into memory with MAP_SHARED, so that writes to the mapping
+// end up in the file and untouched pages never count against the RSS.
+class MmapFile {
+public:
+    MmapFile();
+    virtual ~MmapFile();
+
+    // map an existing file, read-only unless writable is set
+    bool Open(const char* path, bool writable = false);
+
+    // create (or truncate) a file of `size` bytes and map it read-write
+    bool Create(const char* path, size_t size);
+
+    // create a POSIX shared memory segment `name` (e.g. "/segment") of
+    // `size` bytes and map it read-write; the mapping is inherited by
+    // forked processes and the name is unlinked as soon as it is mapped
+    bool CreateShared(const char* name, size_t size);
+
+    void Close();
+
+    // write dirty pages of [offset, offset + length) back to the file
+    void Sync(size_t offset, size_t length);
+
+    // drop the pages of [offset, offset + length) from this process, they
+    // are read back from the file on the next access
+    void Release(size_t offset, size_t length);
+
+    // start reading [offset, offset + length) ahead of its use
+    void WillNeed(size_t offset, size_t length);
+
+public:
+    inline char* data() {
+        return data_;
+    }
+
+    inline size_t size() {
+        return size_;
+    }
+
+    inline const std::string& path() {
+        return path_;
+    }
+
+private:
+    bool Map(int fd, size_t size, bool writable);
+
+    void Advise(size_t offset, size_t length, int advice);
+
+private:
+    std::string path_;
+    char* data_;
+    size_t size_;
+};
+
+#endif // SRC_MMAP_FILE_H
+/* vim: set ts=4 sw=4 tw=0 et :*/
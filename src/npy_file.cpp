@@ -0,0 +1,31 @@
+#include "src/npy_file.h"
+
+#include <cstdint>
+#include <string>
+
+bool WriteNpyHeader(FILE* fp, size_t value_size, size_t rows, size_t cols) {
+    if (value_size != 4 && value_size != 8) {
+        return false;
+    }
+
+    char dict[128];
+    int len = snprintf(dict, sizeof(dict),
+        "{'descr': '<f%lu', 'fortran_order': False, 'shape': (%lu, %lu), }",
+        value_size, rows, cols);
+    if (len < 0 || static_cast<size_t>(len) >= sizeof(dict)) {
+        return false;
+    }
+
+    // magic, version 1.0 and the length of the dictionary, which is padded
+    // with spaces and ends with a newline
+    std::string header("\x93NUMPY\x01\x00", 8);
+    uint16_t header_len = static_cast<uint16_t>(NPY_DATA_OFFSET - header.size() - 2);
+    header.push_back(static_cast<char>(header_len & 0xff));
+    header.push_back(static_cast<char>(header_len >> 8));
+    header.append(dict, len);
+    header.resize(NPY_DATA_OFFSET - 1, ' ');
+    header.push_back('\n');
+
+    return fwrite(header.data(), 1, header.size(), fp) == header.size();
+}
+/* vim: set ts=4 sw=4 tw=0 et :*/
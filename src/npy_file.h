@@ -0,0 +1,17 @@
+#ifndef SRC_NPY_FILE_H
+#define SRC_NPY_FILE_H
+
+#include <cstddef>
+#include <cstdio>
+
+// Data of a written .npy file starts at this offset, so a mapped matrix is
+// page aligned (numpy.load(path, mmap_mode='r') takes it as it is).
+static const size_t NPY_DATA_OFFSET = 4096;
+
+// write the header of a little endian, C ordered .npy file (format 1.0)
+// of a rows x cols matrix of value_size byte floats, padded to
+// NPY_DATA_OFFSET bytes; the raw values follow
+bool WriteNpyHeader(FILE* fp, size_t value_size, size_t rows, size_t cols);
+
+#endif // SRC_NPY_FILE_H
+/* vim: set ts=4 sw=4 tw=0 et :*/
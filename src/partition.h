@@ -0,0 +1,229 @@
+#ifndef SRC_PARTITION_H
+#define SRC_PARTITION_H
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "src/data.h"
+#include "src/sampler.h"
+#include "src/thread_pool.h"
+#include "src/util.h"
+
+// Contiguous id ranges [begin(b), end(b)) splitting n ids into buckets.
+class BucketRange {
+public:
+    BucketRange() : num_ids_(0), num_buckets_(1) {}
+
+    BucketRange(size_t num_ids, size_t num_buckets)
+    : num_ids_(num_ids), num_buckets_(std::max(num_buckets, static_cast<size_t>(1))) {
+    }
+
+    inline size_t bucket(size_t id) const {
+        return num_ids_ == 0 ? 0 : id * num_buckets_ / num_ids_;
+    }
+
+    inline size_t begin(size_t b) const {
+        return (b * num_ids_ + num_buckets_ - 1) / num_buckets_;
+    }
+
+    inline size_t end(size_t b) const {
+        return begin(b + 1);
+    }
+
+    inline size_t num_buckets() const {
+        return num_buckets_;
+    }
+
+private:
+    size_t num_ids_;
+    size_t num_buckets_;
+};
+
+// Groups the edges of a DataManager by (source bucket, target bucket), so
+// that training can work on one bucket pair at a time and only touch the
+// rows of those two buckets.
+template <typename IdType, typename T>
+class EdgePartition {
+public:
+    explicit EdgePartition(size_t num_buckets);
+    virtual ~EdgePartition();
+
+    // noise_weights holds the negative sampling weight of every target
+    bool Build(
+        DataManager<IdType, T>* data_manager,
+        const std::vector<double>& noise_weights,
+        unsigned seed = 1
+    );
+
+    // the smallest number of buckets whose active rows fit into `budget`
+    // bytes: one source bucket and one target bucket of hidden_size values
+    static size_t BucketsForBudget(
+        size_t source_size,
+        size_t target_size,
+        size_t row_bytes,
+        size_t budget
+    );
+
+public:
+    inline size_t num_buckets() {
+        return num_buckets_;
+    }
+
+    inline const BucketRange& source_range() {
+        return source_range_;
+    }
+
+    inline const BucketRange& target_range() {
+        return target_range_;
+    }
+
+    inline size_t pair(size_t source_bucket, size_t target_bucket) {
+        return source_bucket * num_buckets_ + target_bucket;
+    }
+
+    // samples edge ids of one bucket pair, nullptr if it has no edges
+    inline BaseSampler* edge_sampler(size_t pair) {
+        return edge_samplers_[pair];
+    }
+
+    // samples target ids of one target bucket, nullptr if it is empty
+    inline BaseSampler* negative_sampler(size_t target_bucket) {
+        return negative_samplers_[target_bucket];
+    }
+
+    inline double pair_weight(size_t pair) {
+        return pair_weights_[pair];
+    }
+
+    inline double total_weight() {
+        return total_weight_;
+    }
+
+private:
+    size_t num_buckets_;
+    BucketRange source_range_;
+    BucketRange target_range_;
+
+    std::vector<BaseSampler*> edge_samplers_;
+    std::vector<BaseSampler*> negative_samplers_;
+    std::vector<double> pair_weights_;
+    double total_weight_;
+};
+
+template <typename IdType, typename T>
+EdgePartition<IdType, T>::EdgePartition(size_t num_buckets)
+: num_buckets_(std::max(num_buckets, static_cast<size_t>(1))), total_weight_(0) {
+}
+
+template <typename IdType, typename T>
+EdgePartition<IdType, T>::~EdgePartition() {
+    for (size_t i = 0; i < edge_samplers_.size(); ++i) {
+        if (edge_samplers_[i]) {
+            delete edge_samplers_[i];
+        }
+    }
+
+    for (size_t i = 0; i < negative_samplers_.size(); ++i) {
+        if (negative_samplers_[i]) {
+            delete negative_samplers_[i];
+        }
+    }
+}
+
+template <typename IdType, typename T>
+size_t EdgePartition<IdType, T>::BucketsForBudget(
+    size_t source_size,
+    size_t target_size,
+    size_t row_bytes,
+    size_t budget
+) {
+    size_t total = (source_size + target_size) * row_bytes;
+    if (budget == 0 || total <= budget) {
+        return 1;
+    }
+
+    return (total + budget - 1) / budget;
+}
+
+template <typename IdType, typename T>
+bool EdgePartition<IdType, T>::Build(
+    DataManager<IdType, T>* data_manager,
+    const std::vector<double>& noise_weights,
+    unsigned seed
+) {
+    size_t num_pairs = num_buckets_ * num_buckets_;
+    source_range_ = BucketRange(data_manager->source_size(), num_buckets_);
+    target_range_ = BucketRange(data_manager->target_size(), num_buckets_);
+
+    // counting sort of the edge ids by bucket pair
+    std::vector<size_t> offsets(num_pairs + 1, 0);
+    std::vector<size_t> pair_of(data_manager->size());
+    for (size_t i = 0; i < data_manager->size(); ++i) {
+        const Sample<IdType, T>* sample = data_manager->SampleAt(i);
+        pair_of[i] = pair(
+            source_range_.bucket(sample->source()),
+            target_range_.bucket(sample->target())
+        );
+        ++offsets[pair_of[i] + 1];
+    }
+
+    for (size_t p = 0; p < num_pairs; ++p) {
+        offsets[p + 1] += offsets[p];
+    }
+
+    std::vector<size_t> edges(data_manager->size());
+    std::vector<size_t> fill(offsets.begin(), offsets.end() - 1);
+    for (size_t i = 0; i < data_manager->size(); ++i) {
+        edges[fill[pair_of[i]]++] = i;
+    }
+
+    edge_samplers_.assign(num_pairs, nullptr);
+    pair_weights_.assign(num_pairs, 0);
+    ThreadPool::Global()->Run([&] (size_t p) {
+        if (offsets[p] == offsets[p + 1]) {
+            return;
+        }
+
+        std::vector<std::pair<size_t, double> > data_weights;
+        data_weights.reserve(offsets[p + 1] - offsets[p]);
+        for (size_t k = offsets[p]; k < offsets[p + 1]; ++k) {
+            double weight = data_manager->SampleAt(edges[k])->weight();
+            data_weights.push_back(std::pair<size_t, double>(edges[k], weight));
+            pair_weights_[p] += weight;
+        }
+
+        AliasSampler* sampler = new AliasSampler(data_weights);
+        sampler->seed(seed + p);
+        edge_samplers_[p] = sampler;
+    }, num_pairs);
+
+    total_weight_ = 0;
+    for (size_t p = 0; p < num_pairs; ++p) {
+        total_weight_ += pair_weights_[p];
+    }
+
+    negative_samplers_.assign(num_buckets_, nullptr);
+    ThreadPool::Global()->Run([&] (size_t b) {
+        size_t begin = target_range_.begin(b);
+        size_t end = std::min(target_range_.end(b), noise_weights.size());
+        if (begin >= end) {
+            return;
+        }
+
+        std::vector<std::pair<size_t, double> > data_weights;
+        data_weights.reserve(end - begin);
+        for (size_t id = begin; id < end; ++id) {
+            data_weights.push_back(std::pair<size_t, double>(id, noise_weights[id]));
+        }
+
+        AliasSampler* sampler = new AliasSampler(data_weights);
+        sampler->seed(seed + num_pairs + b);
+        negative_samplers_[b] = sampler;
+    }, num_buckets_);
+
+    return true;
+}
+
+#endif // SRC_PARTITION_H
+/* vim: set ts=4 sw=4 tw=0 et :*/
@@ -0,0 +1,200 @@
+#include "src/quantizer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+
+#include "src/thread_pool.h"
+#include "src/util.h"
+
+float ScalarQuantize(const float* row, size_t dim, int8_t* codes) {
+    float max_abs = 0;
+    for (size_t i = 0; i < dim; ++i) {
+        max_abs = std::max(max_abs, std::fabs(row[i]));
+    }
+
+    float scale = max_abs / 127;
+    for (size_t i = 0; i < dim; ++i) {
+        codes[i] = scale > 0 ? static_cast<int8_t>(std::lround(row[i] / scale)) : 0;
+    }
+    return scale;
+}
+
+size_t PQSubspaces(size_t dim, size_t requested) {
+    requested = std::max(std::min(requested, dim), static_cast<size_t>(1));
+    for (size_t m = requested; m > 1; --m) {
+        if (dim % m == 0) {
+            return m;
+        }
+    }
+    return 1;
+}
+
+size_t NearestCentroid(
+    const float* x,
+    const float* centroids,
+    size_t k,
+    size_t dim,
+    const float* norms
+) {
+    size_t nearest = 0;
+    float best = std::numeric_limits<float>::max();
+    for (size_t c = 0; c < k; ++c) {
+        const float* centroid = centroids + c * dim;
+        float dist = 0;
+        if (norms != nullptr) {
+            // |x - c|^2 without the |x|^2 all centroids share
+            dist = norms[c] - 2 * util_dot(x, centroid, dim);
+        } else {
+            for (size_t d = 0; d < dim; ++d) {
+                dist += (x[d] - centroid[d]) * (x[d] - centroid[d]);
+            }
+        }
+        if (dist < best) {
+            best = dist;
+            nearest = c;
+        }
+    }
+    return nearest;
+}
+
+std::vector<float> CentroidNorms(const float* centroids, size_t k, size_t dim) {
+    std::vector<float> norms(k);
+    for (size_t c = 0; c < k; ++c) {
+        norms[c] = util_dot(centroids + c * dim, centroids + c * dim, dim);
+    }
+    return norms;
+}
+
+std::vector<uint32_t> KMeans(
+    const float* data,
+    size_t n,
+    size_t dim,
+    size_t stride,
+    size_t k,
+    size_t iterations,
+    std::vector<float>* centroids
+) {
+    centroids->assign(k * dim, 0);
+    std::vector<uint32_t> assignment(n);
+    if (n == 0) {
+        return assignment;
+    }
+
+    for (size_t c = 0; c < k; ++c) {
+        const float* x = data + (c * n / k) * stride;
+        std::copy(x, x + dim, centroids->data() + c * dim);
+    }
+
+    ThreadPool* pool = ThreadPool::Global();
+    std::vector<double> sums(k * dim);
+    std::vector<size_t> counts(k);
+    for (size_t iter = 0; iter < iterations; ++iter) {
+        std::vector<float> norms = CentroidNorms(centroids->data(), k, dim);
+        pool->ParallelFor(0, n, [&] (size_t, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                assignment[i] = static_cast<uint32_t>(
+                    NearestCentroid(data + i * stride, centroids->data(), k, dim, norms.data()));
+            }
+        });
+
+        std::fill(sums.begin(), sums.end(), 0);
+        std::fill(counts.begin(), counts.end(), 0);
+        for (size_t i = 0; i < n; ++i) {
+            const float* x = data + i * stride;
+            size_t c = assignment[i];
+            ++counts[c];
+            for (size_t d = 0; d < dim; ++d) {
+                sums[c * dim + d] += x[d];
+            }
+        }
+
+        for (size_t c = 0; c < k; ++c) {
+            if (counts[c] == 0) {
+                continue;
+            }
+            for (size_t d = 0; d < dim; ++d) {
+                (*centroids)[c * dim + d] = sums[c * dim + d] / counts[c];
+            }
+        }
+    }
+
+    return assignment;
+}
+
+ProductQuantizer::ProductQuantizer() : dim_ {0}, subspaces_ {0}, sub_dim_ {0} {
+}
+
+ProductQuantizer::~ProductQuantizer() {
+}
+
+bool ProductQuantizer::Train(
+    const float* data,
+    size_t rows,
+    size_t dim,
+    size_t subspaces,
+    unsigned seed
+) {
+    if (rows == 0 || subspaces == 0 || dim % subspaces != 0) {
+        return false;
+    }
+
+    dim_ = dim;
+    subspaces_ = subspaces;
+    sub_dim_ = dim / subspaces;
+    centroids_.assign(subspaces_ * PQ_CENTROIDS * sub_dim_, 0);
+
+    std::default_random_engine rand_generator(seed);
+    std::vector<size_t> sample(rows);
+    for (size_t i = 0; i < rows; ++i) {
+        sample[i] = i;
+    }
+    if (rows > PQ_TRAIN_ROWS) {
+        std::shuffle(sample.begin(), sample.end(), rand_generator);
+        sample.resize(PQ_TRAIN_ROWS);
+    }
+
+    std::vector<float> sample_rows(sample.size() * dim_);
+    for (size_t i = 0; i < sample.size(); ++i) {
+        std::copy(data + sample[i] * dim_, data + (sample[i] + 1) * dim_, &sample_rows[i * dim_]);
+    }
+
+    // k-means on every subspace, the subspaces are independent
+    ThreadPool::Global()->Run([&] (size_t m) {
+        std::vector<float> centroids;
+        KMeans(&sample_rows[m * sub_dim_], sample.size(), sub_dim_, dim_,
+            PQ_CENTROIDS, PQ_TRAIN_ITERATIONS, &centroids);
+        std::copy(centroids.begin(), centroids.end(), &centroids_[m * PQ_CENTROIDS * sub_dim_]);
+    }, subspaces_);
+
+    return true;
+}
+
+void ProductQuantizer::Encode(const float* row, uint8_t* codes) const {
+    for (size_t m = 0; m < subspaces_; ++m) {
+        codes[m] = static_cast<uint8_t>(NearestCentroid(
+            row + m * sub_dim_, &centroids_[m * PQ_CENTROIDS * sub_dim_], PQ_CENTROIDS, sub_dim_));
+    }
+}
+
+void ProductQuantizer::Decode(const uint8_t* codes, float* row) const {
+    for (size_t m = 0; m < subspaces_; ++m) {
+        const float* c = &centroids_[(m * PQ_CENTROIDS + codes[m]) * sub_dim_];
+        std::copy(c, c + sub_dim_, row + m * sub_dim_);
+    }
+}
+
+bool ProductQuantizer::SetCentroids(size_t dim, size_t subspaces, const float* centroids) {
+    if (subspaces == 0 || dim % subspaces != 0) {
+        return false;
+    }
+
+    dim_ = dim;
+    subspaces_ = subspaces;
+    sub_dim_ = dim / subspaces;
+    centroids_.assign(centroids, centroids + subspaces_ * PQ_CENTROIDS * sub_dim_);
+    return true;
+}
+
+/* vim: set ts=4 sw=4 tw=0 et :*/
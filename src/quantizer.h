@@ -0,0 +1,92 @@
+#ifndef SRC_QUANTIZER_H
+#define SRC_QUANTIZER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+const size_t PQ_CENTROIDS = 256;
+const size_t PQ_TRAIN_ROWS = 16384;
+const size_t PQ_TRAIN_ITERATIONS = 10;
+
+// int8 codes of a row sharing one scale, value[i] ~= codes[i] * scale;
+// returns the scale
+float ScalarQuantize(const float* row, size_t dim, int8_t* codes);
+
+// the number of subspaces closest to `requested` that divides dim
+size_t PQSubspaces(size_t dim, size_t requested);
+
+// k-means of n vectors of dim values, vector i at data + i * stride, by
+// l2 distance; centroids (k x dim) start from evenly spaced vectors and
+// empty clusters keep their centroid. Returns the cluster of every vector
+std::vector<uint32_t> KMeans(
+    const float* data,
+    size_t n,
+    size_t dim,
+    size_t stride,
+    size_t k,
+    size_t iterations,
+    std::vector<float>* centroids
+);
+
+// the nearest of k centroids (k x dim) to x by l2 distance; with the
+// squared norms of the centroids it takes one dot product per centroid
+size_t NearestCentroid(
+    const float* x,
+    const float* centroids,
+    size_t k,
+    size_t dim,
+    const float* norms = nullptr
+);
+
+// squared l2 norms of k centroids (k x dim)
+std::vector<float> CentroidNorms(const float* centroids, size_t k, size_t dim);
+
+// Splits vectors into `subspaces` slices of dim / subspaces values and
+// encodes every slice by the index of its nearest of 256 centroids, one
+// byte per slice. Centroids are trained by k-means per subspace.
+class ProductQuantizer {
+public:
+    ProductQuantizer();
+    virtual ~ProductQuantizer();
+
+    // train on (a random sample of) the rows of data, dim must be a
+    // multiple of subspaces
+    bool Train(
+        const float* data,
+        size_t rows,
+        size_t dim,
+        size_t subspaces,
+        unsigned seed = 1
+    );
+
+    void Encode(const float* row, uint8_t* codes) const;
+
+    void Decode(const uint8_t* codes, float* row) const;
+
+    // restore a quantizer from the centroids() of a trained one
+    bool SetCentroids(size_t dim, size_t subspaces, const float* centroids);
+
+public:
+    inline size_t dim() const {
+        return dim_;
+    }
+
+    inline size_t subspaces() const {
+        return subspaces_;
+    }
+
+    // subspaces x 256 x (dim / subspaces) values
+    inline const std::vector<float>& centroids() const {
+        return centroids_;
+    }
+
+private:
+    size_t dim_;
+    size_t subspaces_;
+    size_t sub_dim_;
+    std::vector<float> centroids_;
+};
+
+#endif // SRC_QUANTIZER_H
+/* vim: set ts=4 sw=4 tw=0 et :*/
@@ -0,0 +1,185 @@
+#include "src/query_server.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <exception>
+#include <thread>
+
+#include "src/thread_pool.h"
+
+QueryServer::QueryServer() : listen_fd_ {-1} {
+}
+
+QueryServer::~QueryServer() {
+    Close();
+}
+
+bool QueryServer::Listen(const std::string& address) {
+    Close();
+
+    // host:port with a numeric port is TCP, anything else a socket path
+    size_t colon = address.rfind(':');
+    bool tcp = colon != std::string::npos && colon + 1 < address.size() &&
+        address.find_first_not_of("0123456789", colon + 1) == std::string::npos;
+
+    if (tcp) {
+        std::string host = colon > 0 ? address.substr(0, colon) : "127.0.0.1";
+        std::string port = address.substr(colon + 1);
+
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        struct addrinfo* addrs = nullptr;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs) != 0) {
+            return false;
+        }
+
+        for (struct addrinfo* addr = addrs; addr != nullptr && listen_fd_ == -1; addr = addr->ai_next) {
+            int fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+            if (fd == -1) {
+                continue;
+            }
+            int reuse = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+            if (bind(fd, addr->ai_addr, addr->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0) {
+                listen_fd_ = fd;
+            } else {
+                close(fd);
+            }
+        }
+        freeaddrinfo(addrs);
+        return listen_fd_ != -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (address.empty() || address.size() >= sizeof(addr.sun_path)) {
+        return false;
+    }
+    memcpy(addr.sun_path, address.c_str(), address.size());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return false;
+    }
+
+    // a socket left behind by a server that was killed refuses
+    // connections; one that accepts them belongs to a running server
+    struct stat st;
+    if (stat(address.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == 0 ||
+                errno != ECONNREFUSED) {
+            close(fd);
+            return false;
+        }
+        close(fd);
+        unlink(address.c_str());
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd == -1) {
+            return false;
+        }
+    }
+    if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0 ||
+            listen(fd, SOMAXCONN) != 0) {
+        close(fd);
+        return false;
+    }
+
+    listen_fd_ = fd;
+    unix_path_ = address;
+    return true;
+}
+
+void QueryServer::Serve(const handler_t& handler) {
+    while (listen_fd_ != -1) {
+        int fd = accept(listen_fd_, nullptr, nullptr);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+        std::thread(&QueryServer::HandleClient, this, fd, handler).detach();
+    }
+}
+
+void QueryServer::Close() {
+    if (listen_fd_ != -1) {
+        close(listen_fd_);
+        listen_fd_ = -1;
+    }
+    if (!unix_path_.empty()) {
+        unlink(unix_path_.c_str());
+        unix_path_.clear();
+    }
+}
+
+void QueryServer::HandleClient(int fd, handler_t handler) {
+    std::string buffer;
+    char chunk[4096];
+    while (true) {
+        size_t newline = buffer.find('\n');
+        if (newline == std::string::npos) {
+            if (buffer.size() > QUERY_MAX_LINE) {
+                break;
+            }
+            ssize_t count = recv(fd, chunk, sizeof(chunk), 0);
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count <= 0) {
+                break;
+            }
+            buffer.append(chunk, static_cast<size_t>(count));
+            continue;
+        }
+
+        std::string request = buffer.substr(0, newline);
+        buffer.erase(0, newline + 1);
+        if (!request.empty() && request.back() == '\r') {
+            request.pop_back();
+        }
+        if (request == "quit") {
+            break;
+        }
+
+        // a request that throws fails alone, not the server
+        std::string response;
+        try {
+            response = ThreadPool::Global()->Submit([&] () {
+                return handler(request);
+            }).get();
+        } catch (const std::exception& e) {
+            response = std::string("ERR ") + e.what() + "\n";
+        } catch (...) {
+            response = "ERR internal error\n";
+        }
+
+        // a client that went away must not raise SIGPIPE
+        size_t sent = 0;
+        while (sent < response.size()) {
+            ssize_t count = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count <= 0) {
+                break;
+            }
+            sent += static_cast<size_t>(count);
+        }
+        if (sent < response.size()) {
+            break;
+        }
+    }
+    close(fd);
+}
+/* vim: set ts=4 sw=4 tw=0 et :*/
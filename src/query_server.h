@@ -0,0 +1,42 @@
+#ifndef SRC_QUERY_SERVER_H
+#define SRC_QUERY_SERVER_H
+
+#include <functional>
+#include <string>
+
+// longest request line a client may send
+const size_t QUERY_MAX_LINE = 65536;
+
+// Answers requests of one line each over a Unix domain socket or a TCP
+// port, for processes that would otherwise load a model per lookup. Every
+// client has a thread reading its requests; a request runs on the global
+// pool and its response is written before the next line is read, so a
+// slow client only delays itself. The line "quit" closes a connection.
+class QueryServer {
+public:
+    // response to a request line without its newline
+    typedef std::function<std::string(const std::string&)> handler_t;
+
+    QueryServer();
+    virtual ~QueryServer();
+
+    // listen on host:port (TCP, host defaults to 127.0.0.1) or on the path
+    // of a Unix domain socket, replacing a stale socket file; false if a
+    // running server still accepts connections on the path
+    bool Listen(const std::string& address);
+
+    // accept clients until the listening socket fails
+    void Serve(const handler_t& handler);
+
+    void Close();
+
+private:
+    void HandleClient(int fd, handler_t handler);
+
+private:
+    int listen_fd_;
+    std::string unix_path_;
+};
+
+#endif // SRC_QUERY_SERVER_H
+/* vim: set ts=4 sw=4 tw=0 et :*/
@@ -0,0 +1,92 @@
+#include "src/result_cache.h"
+
+#include <algorithm>
+
+ResultCache::ResultCache(size_t capacity, size_t shards)
+: capacity_ {capacity},
+  shards_(std::min(std::max(shards, static_cast<size_t>(1)), capacity)),
+  hits_ {0},
+  misses_ {0} {
+    // the first capacity % shards shards hold one entry more
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        shards_[i].hand = 0;
+        shards_[i].capacity = capacity / shards_.size() + (i < capacity % shards_.size() ? 1 : 0);
+        shards_[i].entries.reserve(shards_[i].capacity);
+    }
+}
+
+ResultCache::~ResultCache() {
+}
+
+bool ResultCache::Get(const std::string& key, std::vector<pair_t>* value) {
+    if (shards_.empty()) {
+        ++misses_;
+        return false;
+    }
+
+    Shard& shard = ShardOf(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto iter = shard.slots.find(key);
+    if (iter == shard.slots.end()) {
+        ++misses_;
+        return false;
+    }
+
+    Entry& entry = shard.entries[iter->second];
+    entry.referenced = true;
+    *value = entry.value;
+    ++hits_;
+    return true;
+}
+
+void ResultCache::Put(const std::string& key, const std::vector<pair_t>& value) {
+    if (shards_.empty()) {
+        return;
+    }
+
+    Shard& shard = ShardOf(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto iter = shard.slots.find(key);
+    if (iter != shard.slots.end()) {
+        shard.entries[iter->second].value = value;
+        return;
+    }
+
+    if (shard.entries.size() < shard.capacity) {
+        shard.slots[key] = shard.entries.size();
+        shard.entries.push_back(Entry {key, value, false});
+        return;
+    }
+
+    // every entry hit since the last pass gets another round
+    while (shard.entries[shard.hand].referenced) {
+        shard.entries[shard.hand].referenced = false;
+        shard.hand = (shard.hand + 1) % shard.capacity;
+    }
+
+    Entry& victim = shard.entries[shard.hand];
+    shard.slots.erase(victim.key);
+    victim.key = key;
+    victim.value = value;
+    shard.slots[key] = shard.hand;
+    shard.hand = (shard.hand + 1) % shard.capacity;
+}
+
+void ResultCache::Clear() {
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        std::lock_guard<std::mutex> lock(shards_[i].mutex);
+        shards_[i].slots.clear();
+        shards_[i].entries.clear();
+        shards_[i].hand = 0;
+    }
+}
+
+size_t ResultCache::size() {
+    size_t count = 0;
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        std::lock_guard<std::mutex> lock(shards_[i].mutex);
+        count += shards_[i].entries.size();
+    }
+    return count;
+}
+/* vim: set ts=4 sw=4 tw=0 et :*/
@@ -0,0 +1,74 @@
+#ifndef SRC_RESULT_CACHE_H
+#define SRC_RESULT_CACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "src/embedding_model.h"
+
+const size_t RESULT_CACHE_SHARDS = 16;
+
+// Bounded cache of query results shared by concurrent requests. Keys are
+// spread over shards of fixed capacity with a lock each, a shard evicts by
+// CLOCK: a hit marks its entry, the hand clears marks until it finds an
+// unmarked entry to replace. A capacity of 0 caches nothing.
+class ResultCache {
+public:
+    explicit ResultCache(size_t capacity, size_t shards = RESULT_CACHE_SHARDS);
+    virtual ~ResultCache();
+
+    // false on a miss, value is left alone
+    bool Get(const std::string& key, std::vector<pair_t>* value);
+
+    void Put(const std::string& key, const std::vector<pair_t>& value);
+
+    // drop every entry, the results of a model that changed
+    void Clear();
+
+    size_t size();
+
+public:
+    inline size_t capacity() {
+        return capacity_;
+    }
+
+    inline uint64_t hits() {
+        return hits_.load();
+    }
+
+    inline uint64_t misses() {
+        return misses_.load();
+    }
+
+private:
+    struct Entry {
+        std::string key;
+        std::vector<pair_t> value;
+        bool referenced;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<std::string, size_t> slots;
+        std::vector<Entry> entries;
+        size_t hand;
+        size_t capacity;
+    };
+
+    inline Shard& ShardOf(const std::string& key) {
+        return shards_[std::hash<std::string>()(key) % shards_.size()];
+    }
+
+private:
+    size_t capacity_;
+    std::vector<Shard> shards_;
+    std::atomic<uint64_t> hits_;
+    std::atomic<uint64_t> misses_;
+};
+
+#endif // SRC_RESULT_CACHE_H
+/* vim: set ts=4 sw=4 tw=0 et :*/
@@ -12,6 +12,10 @@ void BaseSampler::seed(unsigned val) {
     rand_generator_.seed(val);
 }
 
+size_t BaseSampler::sampling() {
+    return sampling(rand_generator_);
+}
+
 
 AliasSampler::AliasSampler(
     std::vector<std::pair<size_t, double> >& data_weights
@@ -88,9 +92,11 @@ bool AliasSampler::Init(
     return true;
 }
 
-size_t AliasSampler::draw() {
-    size_t idx = uniform_int_dist_(rand_generator_);
-    double rand_prob = uniform_real_dist_(rand_generator_);
+size_t AliasSampler::draw(std::default_random_engine& rng) {
+    std::uniform_int_distribution<size_t> int_dist(uniform_int_dist_.param());
+    std::uniform_real_distribution<double> real_dist(uniform_real_dist_.param());
+    size_t idx = int_dist(rng);
+    double rand_prob = real_dist(rng);
     if (util_less<double> (rand_prob, alias_prob_[idx])) {
         return idx;
     } else {
@@ -98,8 +104,8 @@ size_t AliasSampler::draw() {
     }
 }
 
-size_t AliasSampler::sampling() {
-    size_t idx = draw();
+size_t AliasSampler::sampling(std::default_random_engine& rng) {
+    size_t idx = draw(rng);
     if (idx >= data_index_.size()) {
         idx = data_index_.size() - 1;
     }
@@ -135,12 +141,13 @@ MultinomialSampler::MultinomialSampler(
 
 MultinomialSampler::~MultinomialSampler() { }
 
-double MultinomialSampler::random_impl() {
-    return uniform_dist_(rand_generator_);
+double MultinomialSampler::random_impl(std::default_random_engine& rng) {
+    std::uniform_real_distribution<double> dist(uniform_dist_.param());
+    return dist(rng);
 }
 
-size_t MultinomialSampler::sampling() {
-    double rand_prob = random_impl();
+size_t MultinomialSampler::sampling(std::default_random_engine& rng) {
+    double rand_prob = random_impl(rng);
 
     auto it = std::upper_bound(
         multinomial_dist_.begin(),
@@ -167,8 +174,9 @@ RandomSampler::RandomSampler(
 RandomSampler::~RandomSampler() {
 }
 
-size_t RandomSampler::sampling() {
-    size_t idx = uniform_dist_(rand_generator_);
+size_t RandomSampler::sampling(std::default_random_engine& rng) {
+    std::uniform_int_distribution<size_t> dist(uniform_dist_.param());
+    size_t idx = dist(rng);
     if (idx >= data_index_.size()) {
         idx = data_index_.size() - 1;
     }
@@ -176,4 +184,69 @@ size_t RandomSampler::sampling() {
     return data_index_[idx];
 }
 
+FenwickSampler::FenwickSampler(
+    std::vector<std::pair<size_t, double> >& data_weights
+) : BaseSampler(data_weights), total_(0), uniform_dist_(0, 1) {
+    for (size_t i = 0; i < data_weights.size(); ++i) {
+        Set(data_weights[i].first, data_weights[i].second);
+    }
+}
+
+FenwickSampler::~FenwickSampler() {
+}
+
+void FenwickSampler::Grow(size_t size) {
+    size_t capacity = std::max(tree_.size(), static_cast<size_t>(1));
+    while (capacity < size) {
+        capacity *= 2;
+    }
+
+    weights_.resize(capacity, 0);
+
+    // linear time rebuild, every node adds itself to its parent
+    tree_.assign(weights_.begin(), weights_.end());
+    for (size_t i = 1; i <= capacity; ++i) {
+        size_t parent = i + (i & (~i + 1));
+        if (parent <= capacity) {
+            tree_[parent - 1] += tree_[i - 1];
+        }
+    }
+}
+
+void FenwickSampler::Set(size_t id, double weight) {
+    if (id >= tree_.size()) {
+        Grow(id + 1);
+    }
+
+    double delta = weight - weights_[id];
+    weights_[id] = weight;
+    total_ += delta;
+    for (size_t i = id + 1; i <= tree_.size(); i += i & (~i + 1)) {
+        tree_[i - 1] += delta;
+    }
+}
+
+size_t FenwickSampler::sampling(std::default_random_engine& rng) {
+    if (tree_.empty()) {
+        return 0;
+    }
+
+    // descend from the highest power of two, tree_.size() is one
+    std::uniform_real_distribution<double> dist(uniform_dist_.param());
+    double target = dist(rng) * total_;
+    size_t pos = 0;
+    for (size_t step = tree_.size(); step > 0; step /= 2) {
+        if (pos + step <= tree_.size() && tree_[pos + step - 1] <= target) {
+            pos += step;
+            target -= tree_[pos - 1];
+        }
+    }
+
+    // rounding may step past the last id with a weight
+    while (pos > 0 && (pos >= weights_.size() || weights_[pos] <= 0)) {
+        --pos;
+    }
+    return pos;
+}
+
 /* vim: set ts=4 sw=4 tw=0 et :*/
@@ -20,7 +20,12 @@ public:
 
 public:
     virtual void seed(unsigned val);
-    virtual size_t sampling() = 0;
+
+    // draw with the sampler's own engine, not safe across threads
+    virtual size_t sampling();
+
+    // draw with a caller owned engine, safe across threads
+    virtual size_t sampling(std::default_random_engine& rng) = 0;
 
 protected:
     std::default_random_engine rand_generator_;
@@ -35,14 +40,15 @@ public:
     virtual ~AliasSampler();
 
 public:
-    size_t sampling();
+    using BaseSampler::sampling;
+    size_t sampling(std::default_random_engine& rng);
 
 protected:
     bool Init(
         std::vector<std::pair<size_t, double> >& data_weights
     );
 
-    size_t draw();
+    size_t draw(std::default_random_engine& rng);
 
 private:
     std::vector<size_t> alias_;
@@ -62,10 +68,11 @@ public:
     virtual ~MultinomialSampler();
 
 public:
-    size_t sampling();
+    using BaseSampler::sampling;
+    size_t sampling(std::default_random_engine& rng);
 
 protected:
-    double random_impl();
+    double random_impl(std::default_random_engine& rng);
 
 protected:
     std::uniform_real_distribution<double> uniform_dist_;
@@ -84,12 +91,51 @@ public:
     virtual ~RandomSampler();
 
 public:
-    virtual size_t sampling();
+    using BaseSampler::sampling;
+    virtual size_t sampling(std::default_random_engine& rng);
 
 protected:
     std::uniform_int_distribution<size_t> uniform_dist_;
     std::vector<size_t> data_index_;
 };
 
+// Samples ids in proportion to weights that can change, and grow in
+// number, between draws. Set() and sampling() take O(log n) on a Fenwick
+// tree; the tree doubles its capacity when an id beyond it is set.
+class FenwickSampler : public BaseSampler {
+public:
+    FenwickSampler(
+        std::vector<std::pair<size_t, double> >& data_weights
+    );
+
+    virtual ~FenwickSampler();
+
+public:
+    using BaseSampler::sampling;
+    size_t sampling(std::default_random_engine& rng);
+
+    // set the weight of id, not safe while other threads draw
+    void Set(size_t id, double weight);
+
+    inline double weight(size_t id) const {
+        return id < weights_.size() ? weights_[id] : 0;
+    }
+
+    inline double total() const {
+        return total_;
+    }
+
+protected:
+    void Grow(size_t size);
+
+private:
+    // tree_[i - 1] holds the sum of weights_[i - lowbit(i), i)
+    std::vector<double> tree_;
+    std::vector<double> weights_;
+    double total_;
+
+    std::uniform_real_distribution<double> uniform_dist_;
+};
+
 #endif // SRC_SAMPLER_H
 /* vim: set ts=4 sw=4 tw=0 et :*/
@@ -0,0 +1,310 @@
+#include <getopt.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "src/embedding_model.h"
+#include "src/thread_pool.h"
+#include "src/util.h"
+
+enum PairScore { PAIR_SCORE_SIGMOID = 0, PAIR_SCORE_DOT = 1 };
+
+enum OutputFormat { OUTPUT_TSV = 0, OUTPUT_BINARY = 1 };
+
+// bytes of input parsed per round, and pairs a task groups by source
+const size_t SCORE_CHUNK_BYTES = 64 << 20;
+const size_t SCORE_SLICE_PAIRS = 65536;
+
+// pairs ahead of the one being scored whose target row is loaded
+const size_t SCORE_PREFETCH_DISTANCE = 4;
+
+typedef std::unordered_map<std::string_view, size_t> name_index_t;
+
+// row ids by name over the names the model keeps anyway, a hash lookup
+// instead of the binary search of Find()
+name_index_t BuildNameIndex(EmbeddingModel* model) {
+    name_index_t index;
+    index.reserve(model->size());
+    for (size_t i = 0; i < model->size(); ++i) {
+        index.emplace(model->Name(i), i);
+    }
+    return index;
+}
+
+size_t FindName(const name_index_t& index, const char* name) {
+    auto iter = index.find(name);
+    return iter != index.end() ? iter->second : EmbeddingFile::npos;
+}
+
+void print_usage(int argc, char **argv) {
+    printf("Usage: %s --model model_path [options]\n"
+        "Scores lines of source and target names, separated by a tab (or a "
+        "space if there is no tab), with the rows of model.source and "
+        "model.target\n"
+        "options:\n"
+        "--input path : read pairs from path, default stdin\n"
+        "--output path : write the scores to path, default stdout\n"
+        "--format tsv|binary : write source, target and score lines, or one "
+        "float32 per input line without a header, default tsv\n"
+        "--score-func sigmoid|dot : set score, sigmoid of the dot product as "
+        "the model predicts an edge, or the dot product, default sigmoid\n"
+        "--threads n : set number of threads, default all cores\n"
+        "--help : print this help\n"
+        "Pairs with an unknown name score nan\n", argv[0]
+    );
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    int opt_idx = 0;
+
+    static struct option long_options[] = {
+        {"model", required_argument, nullptr, 'm'},
+        {"input", required_argument, nullptr, 'i'},
+        {"output", required_argument, nullptr, 'o'},
+        {"format", required_argument, nullptr, 'f'},
+        {"score-func", required_argument, nullptr, 's'},
+        {"threads", required_argument, nullptr, 't'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    std::string model_path;
+    std::string input_path;
+    std::string output_path;
+    OutputFormat format = OUTPUT_TSV;
+    PairScore score_func = PAIR_SCORE_SIGMOID;
+    size_t threads = 0;
+
+    while ((opt = getopt_long(argc, argv, "h", long_options, &opt_idx)) != -1) {
+        switch (opt) {
+        case 'm':
+            model_path = optarg;
+            break;
+        case 'i':
+            input_path = optarg;
+            break;
+        case 'o':
+            output_path = optarg;
+            break;
+        case 'f':
+            if (!strcmp(optarg, "tsv")) {
+                format = OUTPUT_TSV;
+            } else if (!strcmp(optarg, "binary")) {
+                format = OUTPUT_BINARY;
+            } else {
+                print_usage(argc, argv);
+                exit(-1);
+            }
+            break;
+        case 's':
+            if (!strcmp(optarg, "sigmoid")) {
+                score_func = PAIR_SCORE_SIGMOID;
+            } else if (!strcmp(optarg, "dot")) {
+                score_func = PAIR_SCORE_DOT;
+            } else {
+                print_usage(argc, argv);
+                exit(-1);
+            }
+            break;
+        case 't':
+            threads = static_cast<size_t>(atoi(optarg));
+            break;
+        case 'h':
+        default:
+            print_usage(argc, argv);
+            exit(-1);
+        }
+    }
+
+    if (model_path.size() == 0) {
+        print_usage(argc, argv);
+        exit(-1);
+    }
+
+    if (threads > 0) {
+        ThreadPool::InitGlobal(threads);
+    }
+    ThreadPool* pool = ThreadPool::Global();
+
+    EmbeddingModel model_source, model_target;
+    auto source_loaded = pool->Submit([&] () {
+        return model_source.LoadModel((model_path + ".source").c_str());
+    });
+    bool ok = model_target.LoadModel((model_path + ".target").c_str());
+    ok = source_loaded.get() && ok;
+    if (!ok || model_source.hidden_size() != model_target.hidden_size()) {
+        fprintf(stderr, "failed to load %s\n", model_path.c_str());
+        return -1;
+    }
+
+    FILE* in = input_path.size() > 0 ? fopen(input_path.c_str(), "rb") : stdin;
+    if (!in) {
+        fprintf(stderr, "failed to open %s\n", input_path.c_str());
+        return -1;
+    }
+    FILE* out = output_path.size() > 0 ? fopen(output_path.c_str(), "wb") : stdout;
+    if (!out) {
+        fprintf(stderr, "failed to open %s\n", output_path.c_str());
+        return -1;
+    }
+
+    auto source_indexed = pool->Submit([&] () {
+        return BuildNameIndex(&model_source);
+    });
+    name_index_t target_index = BuildNameIndex(&model_target);
+    name_index_t source_index = source_indexed.get();
+
+    SigmoidTable sigmoid;
+    size_t hidden_size = model_source.hidden_size();
+    std::atomic<size_t> unknown(0);
+    size_t total = 0;
+
+    std::vector<char> buffer;
+    std::vector<char*> lines;
+    std::vector<float> scores;
+    std::vector<std::string> texts;
+    size_t carry = 0;
+    bool eof = false;
+    while (!eof) {
+        buffer.resize(carry + SCORE_CHUNK_BYTES + 1);
+        size_t count = fread(&buffer[carry], 1, SCORE_CHUNK_BYTES, in);
+        eof = count < SCORE_CHUNK_BYTES;
+        size_t size = carry + count;
+
+        // a round ends after its last newline, the rest starts the next one
+        size_t end = size;
+        while (end > 0 && buffer[end - 1] != '\n') {
+            --end;
+        }
+        if (eof && end < size) {
+            buffer[size++] = '\n';
+            end = size;
+        }
+
+        lines.clear();
+        for (char* p = &buffer[0]; p < &buffer[0] + end;) {
+            char* newline = static_cast<char*>(memchr(p, '\n', &buffer[0] + end - p));
+            *newline = '\0';
+            lines.push_back(p);
+            p = newline + 1;
+        }
+
+        size_t num_pairs = lines.size();
+        size_t num_slices = (num_pairs + SCORE_SLICE_PAIRS - 1) / SCORE_SLICE_PAIRS;
+        scores.resize(num_pairs);
+        texts.assign(format == OUTPUT_TSV ? num_slices : 0, std::string());
+
+        // a slice resolves its names, scores its pairs grouped by source
+        // so every source row is loaded once, and formats them in order
+        pool->ParallelFor(0, num_pairs, [&] (size_t, size_t begin, size_t end) {
+            std::vector<const char*> targets(end - begin);
+            std::vector<std::pair<size_t, size_t> > ids(end - begin);
+            std::vector<size_t> order;
+            order.reserve(end - begin);
+
+            for (size_t i = begin; i < end; ++i) {
+                char* source = lines[i];
+                char* separator = strchr(source, '\t');
+                if (separator == nullptr) {
+                    separator = strchr(source, ' ');
+                }
+
+                char* target = separator;
+                if (separator != nullptr) {
+                    *separator = '\0';
+                    target = separator + 1 + strspn(separator + 1, "\t ");
+                    target[strcspn(target, "\t\r ")] = '\0';
+                } else {
+                    target = source + strlen(source);
+                    source[strcspn(source, "\r")] = '\0';
+                }
+
+                targets[i - begin] = target;
+                ids[i - begin] = std::make_pair(FindName(source_index, source), FindName(target_index, target));
+                if (ids[i - begin].first < model_source.size() && ids[i - begin].second < model_target.size()) {
+                    order.push_back(i - begin);
+                } else {
+                    scores[i] = NAN;
+                    ++unknown;
+                }
+            }
+
+            std::sort(order.begin(), order.end(), [&] (size_t a, size_t b) {
+                return ids[a] < ids[b];
+            });
+
+            std::vector<float> source_buffer, target_buffer;
+            const float* source_row = nullptr;
+            size_t source_id = EmbeddingFile::npos;
+            for (size_t j = 0; j < order.size(); ++j) {
+                if (j + SCORE_PREFETCH_DISTANCE < order.size()) {
+                    model_target.Prefetch(ids[order[j + SCORE_PREFETCH_DISTANCE]].second);
+                }
+
+                const std::pair<size_t, size_t>& pair = ids[order[j]];
+                if (pair.first != source_id) {
+                    source_id = pair.first;
+                    source_row = model_source.Row(source_id, &source_buffer);
+                }
+
+                float score = util_dot(source_row, model_target.Row(pair.second, &target_buffer), hidden_size);
+                if (score_func == PAIR_SCORE_SIGMOID) {
+                    score = static_cast<float>(sigmoid[score]);
+                }
+                scores[begin + order[j]] = score;
+            }
+
+            if (format == OUTPUT_TSV) {
+                std::string& text = texts[begin / SCORE_SLICE_PAIRS];
+                char value[32];
+                for (size_t i = begin; i < end; ++i) {
+                    snprintf(value, sizeof(value), "\t%g\n", scores[i]);
+                    text.append(lines[i]);
+                    text.push_back('\t');
+                    text.append(targets[i - begin]);
+                    text.append(value);
+                }
+            }
+        }, SCORE_SLICE_PAIRS);
+
+        if (format == OUTPUT_TSV) {
+            for (size_t i = 0; i < texts.size(); ++i) {
+                fwrite(texts[i].data(), 1, texts[i].size(), out);
+            }
+        } else {
+            fwrite(scores.data(), sizeof(float), num_pairs, out);
+        }
+
+        total += num_pairs;
+        fprintf(stderr, "%cpairs: %lu", 13, total);
+        fflush(stderr);
+
+        carry = size - end;
+        memmove(&buffer[0], &buffer[end], carry);
+    }
+    fprintf(stderr, "\npairs with unknown names: %lu\n", unknown.load());
+
+    if (in != stdin) {
+        fclose(in);
+    }
+    bool written = !ferror(out);
+    if (out != stdout) {
+        written = (fclose(out) == 0) && written;
+    }
+    if (!written) {
+        fprintf(stderr, "failed to write %s\n", output_path.c_str());
+        return -1;
+    }
+
+    return 0;
+}
+/* vim: set ts=4 sw=4 tw=0 et :*/
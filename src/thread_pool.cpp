@@ -0,0 +1,124 @@
+#include "src/thread_pool.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+static thread_local bool in_worker = false;
+
+static std::mutex global_mutex;
+static ThreadPool* global_pool = nullptr;
+
+// fork() happens with global_mutex held, so a child never inherits it
+// locked by a thread that does not exist in the child
+static void lock_global() {
+    global_mutex.lock();
+}
+
+static void unlock_global() {
+    global_mutex.unlock();
+}
+
+static int global_atfork = pthread_atfork(lock_global, unlock_global, unlock_global);
+
+ThreadPool::ThreadPool(size_t num_threads, bool pin_cpu)
+: stop_ {false}, pin_cpu_ {pin_cpu} {
+    if (num_threads == 0) {
+        num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    for (size_t i = 0; i < num_threads; ++i) {
+        threads_.push_back(std::thread(&ThreadPool::WorkerLoop, this, i));
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cond_.notify_all();
+
+    for (size_t i = 0; i < threads_.size(); ++i) {
+        threads_[i].join();
+    }
+}
+
+ThreadPool* ThreadPool::Global() {
+    std::lock_guard<std::mutex> lock(global_mutex);
+    if (global_pool == nullptr) {
+        global_pool = new ThreadPool();
+    }
+
+    return global_pool;
+}
+
+ThreadPool* ThreadPool::InitGlobal(size_t num_threads, bool pin_cpu) {
+    std::lock_guard<std::mutex> lock(global_mutex);
+    if (num_threads == 0) {
+        num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    if (global_pool != nullptr) {
+        if (global_pool->size() == num_threads && global_pool->pin_cpu() == pin_cpu) {
+            return global_pool;
+        }
+        delete global_pool;
+    }
+
+    global_pool = new ThreadPool(num_threads, pin_cpu);
+    return global_pool;
+}
+
+ThreadPool* ThreadPool::ResetGlobalAfterFork(size_t num_threads, bool pin_cpu) {
+    // joining the inherited threads would block forever, so the old pool
+    // is leaked on purpose, its mutex is never taken again
+    std::lock_guard<std::mutex> lock(global_mutex);
+    if (num_threads == 0) {
+        num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    global_pool = new ThreadPool(num_threads, pin_cpu);
+    return global_pool;
+}
+
+bool ThreadPool::InWorker() {
+    return in_worker;
+}
+
+void ThreadPool::Enqueue(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tasks_.push(std::move(task));
+    }
+    cond_.notify_one();
+}
+
+void ThreadPool::WorkerLoop(size_t worker_id) {
+    in_worker = true;
+
+#ifdef __linux__
+    if (pin_cpu_) {
+        size_t num_cpus = std::max(std::thread::hardware_concurrency(), 1u);
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        CPU_SET(worker_id % num_cpus, &cpu_set);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+    }
+#endif
+
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cond_.wait(lock, [this] () { return stop_ || !tasks_.empty(); });
+            if (stop_ && tasks_.empty()) {
+                break;
+            }
+            task = std::move(tasks_.front());
+            tasks_.pop();
+        }
+        task();
+    }
+}
+
+/* vim: set ts=4 sw=4 tw=0 et :*/
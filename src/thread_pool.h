@@ -0,0 +1,159 @@
+#ifndef SRC_THREAD_POOL_H
+#define SRC_THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// Persistent pool of worker threads shared by every phase of a process.
+// Tasks submitted from inside a worker are executed inline, so nested
+// Run/ParallelFor calls never dead-lock the pool.
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t num_threads = 0, bool pin_cpu = false);
+    virtual ~ThreadPool();
+
+    // process wide pool, created on first use with hardware concurrency
+    static ThreadPool* Global();
+
+    // (re)create the process wide pool, usually once from main()
+    static ThreadPool* InitGlobal(size_t num_threads, bool pin_cpu = false);
+
+    // replace the process wide pool in a child created by fork(), whose
+    // inherited pool has no threads left; the old pool is abandoned
+    static ThreadPool* ResetGlobalAfterFork(size_t num_threads, bool pin_cpu = false);
+
+    // true if the calling thread is a worker of any pool
+    static bool InWorker();
+
+public:
+    template <class Func>
+    std::future<typename std::result_of<Func()>::type> Submit(Func func);
+
+    // call func(task_id) for every task_id in [0, num_tasks), wait for all;
+    // the first exception of a task is rethrown once all are done
+    template <class Func>
+    void Run(const Func& func, size_t num_tasks = 0);
+
+    // split [begin, end) into chunks of `grain` handed out from a shared
+    // cursor, call func(worker_id, chunk_begin, chunk_end), wait for all
+    template <class Func>
+    void ParallelFor(size_t begin, size_t end, const Func& func, size_t grain = 0);
+
+    inline size_t size() {
+        return threads_.size();
+    }
+
+    inline bool pin_cpu() {
+        return pin_cpu_;
+    }
+
+private:
+    void Enqueue(std::function<void()> task);
+
+    void WorkerLoop(size_t worker_id);
+
+private:
+    std::vector<std::thread> threads_;
+    std::queue<std::function<void()> > tasks_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    bool stop_;
+    bool pin_cpu_;
+};
+
+template <class Func>
+std::future<typename std::result_of<Func()>::type> ThreadPool::Submit(Func func) {
+    typedef typename std::result_of<Func()>::type result_t;
+
+    auto task = std::make_shared<std::packaged_task<result_t()> >(func);
+    std::future<result_t> result = task->get_future();
+    if (InWorker() || threads_.empty()) {
+        (*task)();
+    } else {
+        Enqueue([task] () { (*task)(); });
+    }
+
+    return result;
+}
+
+template <class Func>
+void ThreadPool::Run(const Func& func, size_t num_tasks) {
+    if (num_tasks == 0) {
+        num_tasks = std::max(size(), static_cast<size_t>(1));
+    }
+
+    if (InWorker() || threads_.empty() || num_tasks == 1) {
+        for (size_t i = 0; i < num_tasks; ++i) {
+            func(i);
+        }
+        return;
+    }
+
+    std::mutex done_mutex;
+    std::condition_variable done_cond;
+    size_t remaining = num_tasks;
+    std::exception_ptr error;
+
+    // an exception must not leave the worker, that would terminate
+    for (size_t i = 0; i < num_tasks; ++i) {
+        Enqueue([&, i] () {
+            std::exception_ptr task_error;
+            try {
+                func(i);
+            } catch (...) {
+                task_error = std::current_exception();
+            }
+            std::lock_guard<std::mutex> lock(done_mutex);
+            if (task_error && !error) {
+                error = task_error;
+            }
+            if (--remaining == 0) {
+                done_cond.notify_one();
+            }
+        });
+    }
+
+    std::unique_lock<std::mutex> lock(done_mutex);
+    done_cond.wait(lock, [&] () { return remaining == 0; });
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+template <class Func>
+void ThreadPool::ParallelFor(size_t begin, size_t end, const Func& func, size_t grain) {
+    if (begin >= end) {
+        return;
+    }
+
+    size_t num_workers = std::max(size(), static_cast<size_t>(1));
+    if (grain == 0) {
+        grain = std::max((end - begin) / (num_workers * 8), static_cast<size_t>(1));
+    }
+    num_workers = std::min(num_workers, (end - begin + grain - 1) / grain);
+
+    std::atomic<size_t> cursor(begin);
+    auto worker = [&] (size_t worker_id) {
+        while (true) {
+            size_t chunk_begin = cursor.fetch_add(grain);
+            if (chunk_begin >= end) {
+                break;
+            }
+            func(worker_id, chunk_begin, std::min(chunk_begin + grain, end));
+        }
+    };
+
+    Run(worker, num_workers);
+}
+
+#endif // SRC_THREAD_POOL_H
+/* vim: set ts=4 sw=4 tw=0 et :*/
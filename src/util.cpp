@@ -5,6 +5,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <cstdio>
 #include <cstring>
 
 SigmoidTable::SigmoidTable(size_t table_size) : table_size_(table_size) {
@@ -88,4 +89,49 @@ size_t count_file_lines(const char* path) {
     return number_of_lines;
 }
 
+size_t util_peak_rss() {
+    FILE* fp = fopen("/proc/self/status", "r");
+    if (!fp) {
+        return 0;
+    }
+
+    char line[256];
+    size_t peak_kb = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "VmHWM: %lu kB", &peak_kb) == 1) {
+            break;
+        }
+    }
+    fclose(fp);
+
+    return peak_kb * 1024;
+}
+
+size_t util_parse_size(const char* str) {
+    char* end = nullptr;
+    double value = strtod(str, &end);
+    if (end == str || value < 0) {
+        return 0;
+    }
+
+    switch (*end) {
+    case 'T': case 't':
+        value *= 1024;
+        [[fallthrough]];
+    case 'G': case 'g':
+        value *= 1024;
+        [[fallthrough]];
+    case 'M': case 'm':
+        value *= 1024;
+        [[fallthrough]];
+    case 'K': case 'k':
+        value *= 1024;
+        break;
+    default:
+        break;
+    }
+
+    return static_cast<size_t>(value);
+}
+
 /* vim: set ts=4 sw=4 tw=0 et :*/
@@ -8,11 +8,23 @@
 #include <limits>
 #include <vector>
 
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#endif
+
+#include "src/thread_pool.h"
+
 const double MAX_EXP_NUM = 20.0;
 const size_t DEF_EXP_TABLE_SIZE = 1000;
 
 size_t count_file_lines(const char* path);
 
+// peak resident set size of this process in bytes, 0 if unknown
+size_t util_peak_rss();
+
+// parse a byte count with an optional K, M, G or T suffix (powers of 1024)
+size_t util_parse_size(const char* str);
+
 
 class SigmoidTable {
 public:
@@ -32,20 +44,43 @@ private:
 
 template <class Func>
 void util_parallel_run(const Func& func, size_t num_threads) {
-    if (num_threads == 0) {
-        num_threads = std::thread::hardware_concurrency();
-    }
+    ThreadPool::Global()->Run(func, num_threads);
+}
 
-    std::thread *threads = new std::thread[num_threads];
-    for (size_t i = 0; i < num_threads; ++i) {
-        threads[i] = std::thread(func, i);
+// prefetch every cache line of [addr, addr + bytes) for writing
+inline void util_prefetch(const void* addr, size_t bytes) {
+    const char* p = reinterpret_cast<const char*>(addr);
+    for (size_t offset = 0; offset < bytes; offset += 64) {
+        __builtin_prefetch(p + offset, 1, 3);
     }
+}
 
-    for (size_t i = 0; i < num_threads; ++i) {
-        threads[i].join();
+// dot product of two float vectors, 16 values per step with two fused
+// multiply-add accumulators where the target has AVX2 and FMA
+inline float util_dot(const float* v1, const float* v2, size_t n) {
+    size_t i = 0;
+    float sum = 0;
+#if defined(__AVX2__) && defined(__FMA__)
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(v1 + i), _mm256_loadu_ps(v2 + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(v1 + i + 8), _mm256_loadu_ps(v2 + i + 8), acc1);
     }
-
-    delete [] threads;
+    if (i + 8 <= n) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(v1 + i), _mm256_loadu_ps(v2 + i), acc0);
+        i += 8;
+    }
+    acc0 = _mm256_add_ps(acc0, acc1);
+    __m128 half = _mm_add_ps(_mm256_castps256_ps128(acc0), _mm256_extractf128_ps(acc0, 1));
+    half = _mm_hadd_ps(half, half);
+    half = _mm_hadd_ps(half, half);
+    sum = _mm_cvtss_f32(half);
+#endif
+    for (; i < n; ++i) {
+        sum += v1[i] * v2[i];
+    }
+    return sum;
 }
 
 template <typename T>
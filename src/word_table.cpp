@@ -1,16 +1,15 @@
 #include "src/word_table.h"
 
 WordTable::WordTable() {
-    word_map_.reserve(DEFAULT_TABLE_SIZE);
 }
 
 WordTable::~WordTable() {
 }
 
 void WordTable::reserve(size_t table_size) {
-    if (table_size > DEFAULT_TABLE_SIZE) {
-        word_map_.reserve(table_size + 1);
-    }
+    // sized by the caller (e.g. by the number of input lines), reserving a
+    // fixed DEFAULT_TABLE_SIZE up front took hundreds of MB per table
+    word_map_.reserve(table_size + 1);
 }
 
 size_t WordTable::SearchWord(const std::string& word) {
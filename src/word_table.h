@@ -27,6 +27,11 @@ public:
 
     std::string WordAt(size_t pos);
 
+    // unlocked view of a word, only valid while no words are added
+    inline const std::string& WordRef(size_t pos) const {
+        return word_vec_[pos];
+    }
+
     inline size_t size() {
         return word_vec_.size();
     }